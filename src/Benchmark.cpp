@@ -0,0 +1,71 @@
+// Benchmark.cpp : Runs the micro benchmarks in PerformanceExperiments.h.
+//
+
+#include "ExperimentTypedefs.h"
+#include "PerformanceExperiments.h"
+
+using namespace std;
+
+int main(int argc, char** argv) {
+	if (argc < 2) {
+		cerr << "Usage: benchmark parse|cosine|scan|kmeans|insert|prefetch|beam|int8|simhash|nearest|search|pq|assign|treefile [doc2vec file] [vector_size] [max threads]" << endl;
+		cerr << "A synthetic doc2vec file is generated when no file is given." << endl;
+		return 1;
+	}
+
+	string benchmark = argv[1];
+	string doc2vecFile = argc > 2 ? argv[2] : "";
+	size_t vectorLength = argc > 3 ? atoi(argv[3]) : 200;
+	int maxThreads = argc > 4 ? atoi(argv[4]) : tbb::task_scheduler_init::default_num_threads();
+	if (doc2vecFile.empty() && (benchmark == "parse" || benchmark == "insert"
+			|| benchmark == "prefetch" || benchmark == "beam" || benchmark == "int8"
+			|| benchmark == "simhash"
+			|| benchmark == "nearest" || benchmark == "search"
+			|| benchmark == "pq" || benchmark == "assign"
+			|| benchmark == "treefile")) {
+		doc2vecFile = "benchmark_doc2vec.txt";
+		cout << "writing synthetic data to " << doc2vecFile << endl;
+		writeSyntheticDoc2Vec(doc2vecFile, vectorLength, 50000);
+	}
+
+	try {
+		if (benchmark == "parse") {
+			parseThroughput(doc2vecFile, vectorLength);
+		} else if (benchmark == "cosine") {
+			cosineThroughput<float>(vectorLength);
+			cosineThroughput<double>(vectorLength);
+		} else if (benchmark == "scan") {
+			nodeScanThroughput(vectorLength);
+		} else if (benchmark == "kmeans") {
+			kmeansAssignThroughput(vectorLength);
+		} else if (benchmark == "insert") {
+			insertScaling(doc2vecFile, vectorLength, maxThreads);
+		} else if (benchmark == "prefetch") {
+			prefetchStall(doc2vecFile, vectorLength);
+		} else if (benchmark == "beam") {
+			beamTradeoff(doc2vecFile, vectorLength);
+		} else if (benchmark == "int8") {
+			int8Tradeoff(doc2vecFile, vectorLength);
+		} else if (benchmark == "simhash") {
+			simhashTradeoff(doc2vecFile, vectorLength);
+		} else if (benchmark == "nearest") {
+			nearestClustersTradeoff(doc2vecFile, vectorLength);
+		} else if (benchmark == "search") {
+			documentSearchTradeoff(doc2vecFile, vectorLength);
+		} else if (benchmark == "pq") {
+			productQuantizerTradeoff(doc2vecFile, vectorLength);
+		} else if (benchmark == "assign") {
+			assignScaling(doc2vecFile, vectorLength, maxThreads);
+		} else if (benchmark == "treefile") {
+			treeFileRoundTrip(doc2vecFile, vectorLength);
+		} else {
+			cerr << "unknown benchmark " << benchmark << endl;
+			return 1;
+		}
+	} catch (const exception& e) {
+		cerr << e.what() << endl;
+		return 1;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,63 @@
+// ConvertDoc2Vec.cpp : Converts a doc2vec text file into a binary vector file
+// that can be memory mapped by MappedSVectorStream.
+//
+
+#include "lmw/StdIncludes.h"
+#include "lmw/Distance.h"
+#include "lmw/SVectorStream.h"
+#include "lmw/VectorFile.h"
+
+using namespace lmw;
+using namespace std;
+
+int main(int argc, char** argv) {
+	if (argc < 4) {
+		cerr << "Usage: convertdoc2vec [doc2vec file] [vector file] [vector_size] [float32|float64] [normalize]" << endl;
+		cerr << "normalize scales vectors to unit length for emtree ... normalized" << endl;
+		return 1;
+	}
+
+	string doc2vecFile = argv[1];
+	string vectorFile = argv[2];
+	size_t vectorLength = atoi(argv[3]);
+	string type = argc > 4 ? argv[4] : "float32";
+	bool normalize = argc > 5 && string(argv[5]) == "normalize";
+
+	VectorFileHeader::Type fileType;
+	if (type == "float32") {
+		fileType = VectorFileHeader::FLOAT32;
+	} else if (type == "float64") {
+		fileType = VectorFileHeader::FLOAT64;
+	} else {
+		cerr << "unknown type " << type << endl;
+		return 1;
+	}
+
+	try {
+		boost::timer::auto_cpu_timer convert("converting doc2vec file: %w seconds\n");
+		SVectorStream<SVector<double>> vs(doc2vecFile, vectorLength);
+		VectorFileWriter writer(vectorFile, vectorLength, fileType);
+		normalizedCosineDistance<SVector<double>> normalizer;
+		for (;;) {
+			vector<SVector<double>*> data;
+			size_t read = vs.read(10000, &data);
+			if (read == 0) {
+				break;
+			}
+			for (auto vector : data) {
+				if (normalize) {
+					normalizer.prepare(vector);
+				}
+				writer.write(vs.ids().get(vector->getID()), *vector);
+			}
+			vs.free(&data);
+		}
+		writer.close();
+		cout << writer.size() << " vectors written to " << vectorFile << endl;
+	} catch (const exception& e) {
+		cerr << e.what() << endl;
+		return 1;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -5,6 +5,7 @@
 #define	LOADSIGNATURES_H
 
 #include "lmw/StdIncludes.h"
+#include "lmw/IdTable.h"
 #include <cstdlib>
 
 void genData(vector<SVector<bool>*> &vectors, size_t sigSize, size_t numVectors) {
@@ -24,8 +25,12 @@ void genData(vector<SVector<bool>*> &vectors, size_t sigSize, size_t numVectors)
     vecGenerator::genVectors(vectors, numVectors, gen, sigSize);
 }
 
-void readSignatures(vector<SVector<bool>*> &vectors, string docidFile, string signatureFile,
-        size_t sigSize, size_t maxVectors) {
+/**
+ * Reads signatures with ordinals that are resolved to their document IDs by
+ * ids.
+ */
+void readSignatures(vector<SVector<bool>*> &vectors, IdTable& ids, string docidFile,
+        string signatureFile, size_t sigSize, size_t maxVectors) {
     using namespace std;
     cout << docidFile << endl << signatureFile << endl;
 
@@ -44,7 +49,7 @@ void readSignatures(vector<SVector<bool>*> &vectors, string docidFile, string si
     while (getline(docidStream, docid)) {
         sigStream.read(data, numBytes);
         SVector<bool>* vector = new SVector<bool>(data, sigSize);
-        vector->setID(docid);
+        vector->setID(ids.append(docid));
         vectors.push_back(vector);
         if (vectors.size() % 1000 == 0) {
             cout << "." << flush;
@@ -60,42 +65,37 @@ void readSignatures(vector<SVector<bool>*> &vectors, string docidFile, string si
     delete[] data;
 }
 
-void loadWikiSignatures(vector<SVector<bool>*>& vectors, int veccount) {
+void loadWikiSignatures(vector<SVector<bool>*>& vectors, IdTable& ids, int veccount) {
     const char docidFile[] = "data/wikisignatures/wiki.4096.docids";
     const char signatureFile[] = "data/wikisignatures/wiki.4096.sig";
     const size_t signatureLength = 4096;
-    readSignatures(vectors, docidFile, signatureFile, signatureLength, veccount);
+    readSignatures(vectors, ids, docidFile, signatureFile, signatureLength, veccount);
 }
 
 
 // add  by fantao at 2015-8-16 ;
-void loadSubset_doc2vec(char * doc2vecFile, size_t vec_length, vector<SVector<double>*>& vectors, int max_subset_count){
+template <typename T>
+void loadSubset_doc2vec(const string& doc2vecFile, size_t vec_length, vector<SVector<T>*>& vectors, int max_subset_count){
 	//const char doc2vecFile[] = "data/doc2vec.txt";
 	using namespace std;
 	
-	string vec_str;
-	//const size_t vec_length = 200;
-
-	ifstream doc2vecStream(doc2vecFile);
-	long long  line_num = 0;
+	const char* begin;
+	const char* end;
+	const char* idBegin;
+	const char* idEnd;
 
 	// get sample data size;
 	vector<string> docids;
-
-	if (!doc2vecStream) {
-        cout << "unable to open file" << endl;
-        return;
-    }
-	
-	while(getline(doc2vecStream, vec_str)){
-		line_num++;	
-		int pos = vec_str.find(" ", 0);
-		if (pos < vec_str.size() && pos >= 0 ){
-			string docid = vec_str.substr(0, pos);
-			docids.push_back(docid);			
-			}	
-		
+	{
+		LineBlockReader reader(doc2vecFile);
+		while (reader.nextLine(&begin, &end)) {
+			Doc2VecParser::parseID(begin, end, &idBegin, &idEnd);
+			if (idBegin != idEnd) {
+				docids.push_back(string(idBegin, idEnd));
+			}
 		}
+	}
+	long long line_num = docids.size();
 
 	random_shuffle(docids.begin(), docids.end());
 
@@ -111,68 +111,57 @@ void loadSubset_doc2vec(char * doc2vecFile, size_t vec_length, vector<SVector<do
 		subdocids.insert(docids[i]);
 		}
 	
-	doc2vecStream.close();
-	doc2vecStream.clear();
-	doc2vecStream.open(doc2vecFile);
-	while(getline(doc2vecStream, vec_str)){
-		int size = vec_str.size();
-		int flag = 0;
-
-		int vec_pos = 0;
-		string v1;
-		string docid;
-
-		SVector<double>* vector = NULL;
-
-		for(int i = 0; i < size; i++){
-			int pos = vec_str.find(" ", i);
-			if (pos < size && pos >= 0 ){
-				v1 = vec_str.substr(i, pos - i);				
-				i = pos;				           
-				}            
-			else{				 
-				v1 = vec_str.substr(i, size-i);				
-				i=size;            
-				}
-			
-			if (flag == 0){
-				docid = v1;
-				flag = 1;				
-
-				if (subdocids.find(docid) == subdocids.end())
-					break;	
-				
-				vector = new SVector<double>(vec_length);
-				vector->setID(docid);				
-				}
-			
-			else{			
-				double vec = atof(v1.c_str());
-				vector->set(vec_pos, vec);
-				vec_pos++;
-				
-				}
-			
-			}
+	LineBlockReader reader(doc2vecFile);
+	Doc2VecParser parser(vec_length);
+	string docid;
+	while (reader.nextLine(&begin, &end)) {
+		Doc2VecParser::parseID(begin, end, &idBegin, &idEnd);
+		docid.assign(idBegin, idEnd);
+		if (subdocids.find(docid) == subdocids.end()) {
+			continue;
+		}
+		unique_ptr<SVector<T>> vector(new SVector<T>(vec_length));
+		parser.parse(begin, end, vector.get(), reader.lineNumber());
+		vectors.push_back(vector.release());
+	}
+}
 
-		
-		if (subdocids.find(docid) != subdocids.end()){			
-			vectors.push_back(vector);
-			}
-		
-       /*
-		if (vectors.size() % 1000 == 0) {
-            cout << "." << flush;
-        }
-        */
-		
-				
-		}	
-	
+/**
+ * Samples the same number of vectors as loadSubset_doc2vec from a binary
+ * vector file. The vectors are copied out of the mapping and converted to T.
+ */
+template <typename T>
+void loadSubset_binary(const string& vectorFile, size_t vec_length, vector<SVector<T>*>& vectors, int max_subset_count){
+	MappedVectorFile file(vectorFile);
+	if (file.dimensions() != vec_length) {
+		throw runtime_error(string("unexpected vector length in ") + vectorFile);
+	}
+
+	vector<size_t> indices(file.size());
+	for (size_t i = 0; i < indices.size(); i++) {
+		indices[i] = i;
+	}
+	random_shuffle(indices.begin(), indices.end());
+
+	size_t sample_size = file.size() * 0.1;
+	if (sample_size > max_subset_count) {
+		sample_size = max_subset_count;
+	}
+
+	for (size_t i = 0; i < sample_size; i++) {
+		SVector<T>* vector = new SVector<T>(vec_length);
+		if (file.type() == VectorFileHeader::FLOAT32) {
+			std::copy_n(file.row<float>(indices[i]), vec_length, vector->begin());
+		} else {
+			std::copy_n(file.row<double>(indices[i]), vec_length, vector->begin());
+		}
+		vector->setID(indices[i]);
+		vectors.push_back(vector);
+	}
 }
 
-void loadSubset(vector<SVector<bool>*>& vectors, vector<SVector<bool>*>& subset,
-        string docidFile) {
+void loadSubset(vector<SVector<bool>*>& vectors, const IdTable& ids,
+        vector<SVector<bool>*>& subset, string docidFile) {
     using namespace std;
     ifstream docidStream(docidFile);
     string docid;
@@ -181,7 +170,7 @@ void loadSubset(vector<SVector<bool>*>& vectors, vector<SVector<bool>*>& subset,
         docids.insert(docid);
     }
     for (SVector<bool>* vector : vectors) {
-        if (docids.find(vector->getID()) != docids.end()) {
+        if (docids.find(ids.get(vector->getID())) != docids.end()) {
             subset.push_back(vector);
         }
     }
@@ -190,7 +179,8 @@ void loadSubset(vector<SVector<bool>*>& vectors, vector<SVector<bool>*>& subset,
 
 void testReadVectors() {
     vector < SVector<bool>*> vectors;
-    loadWikiSignatures(vectors, 100 * 1000);
+    IdTable ids;
+    loadWikiSignatures(vectors, ids, 100 * 1000);
 }
 
 #endif	/* LOADSIGNATURES_H */
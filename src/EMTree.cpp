@@ -7,24 +7,127 @@
 //#include "JournalPaperExperiments.h"
 //#include "GeneralExperiments.h"
 using namespace std;
+namespace po = boost::program_options;
+
 int main(int argc, char** argv) {
     std::srand(std::time(0));	
 	
-	if (argc < 5){
-		cerr<<"Usage: emtree [filename] [vector_size] [m-tree] [depth]"<<endl;
+	string doc2vecfile;
+	int vector_length;
+	int m;
+	int d;
+	string distance;
+	size_t cacheMB;
+	string assignTree;
+	string idFile;
+	size_t batchSize;
+	StreamingOptions streaming;
+
+	po::options_description options(
+			"Usage: emtree [filename] [vector_size] [m-tree] [depth] [cosine|normalized|hamming] [options]");
+	options.add_options()
+		("help", "print this message")
+		("filename", po::value<string>(&doc2vecfile), "doc2vec text file or binary vector file")
+		("vector_size", po::value<int>(&vector_length), "the length of the vectors")
+		("m-tree", po::value<int>(&m), "the order of the tree")
+		("depth", po::value<int>(&d), "the depth of the tree")
+		("distance", po::value<string>(&distance)->default_value("cosine"),
+			"cosine, or normalized to scale vectors and centroids to unit length so cosine is a dot product, "
+			"or hamming to cluster a file of bit signatures, where vector_size is the number of bits")
+		("id-file", po::value<string>(&idFile),
+			"the IDs of the signatures with hamming, one per line")
+		("cache-mb", po::value<size_t>(&cacheMB)->default_value(0),
+			"keep a doc2vec text file in memory across iterations if it fits in this many MB")
+		("spill-file", po::value<string>(&streaming.spillFile),
+			"write a doc2vec text file that does not fit in --cache-mb to this binary scratch file "
+			"during the first iteration, and read it from there in later iterations")
+		("pq-bytes", po::value<size_t>(&streaming.pqBytes)->default_value(0),
+			"cache product quantized codes of this many bytes per vector instead of the values, "
+			"which must divide vector_size; later iterations see the quantized vectors")
+		("read-size", po::value<int>(&streaming.readSize)->default_value(streaming.readSize),
+			"the number of vectors read at once")
+		("max-tokens", po::value<int>(&streaming.maxTokens)->default_value(streaming.maxTokens),
+			"the maximum number of read size chunks being processed at once")
+		("prefetch", po::value<int>(&streaming.prefetchChunks)->default_value(streaming.prefetchChunks),
+			"the number of chunks an I/O thread reads ahead, 0 reads in the pipeline")
+		("beam-width", po::value<int>(&streaming.beamWidth)->default_value(streaming.beamWidth),
+			"the number of nearest keys kept at each level when inserting a vector, 1 follows the nearest key")
+		("save-tree", po::value<string>(&streaming.saveTree),
+			"save the tree to this file after every iteration and at the end")
+		("load-tree", po::value<string>(&streaming.loadTree),
+			"continue iterating from a tree saved with --save-tree instead of building a new one")
+		("assign", po::value<string>(&assignTree),
+			"assign the vectors in filename, or stdin if it is - or missing, to the clusters of a tree "
+			"saved with --save-tree without updating it, vector_size, m-tree and depth are not needed")
+		("batch-size", po::value<size_t>(&batchSize)->default_value(1000),
+			"the maximum number of vectors assigned at once with --assign");
+	po::positional_options_description positional;
+	positional.add("filename", 1).add("vector_size", 1).add("m-tree", 1)
+			.add("depth", 1).add("distance", 1);
+
+	po::variables_map vm;
+	try {
+		po::store(po::command_line_parser(argc, argv).options(options)
+				.positional(positional).run(), vm);
+		po::notify(vm);
+	} catch (const po::error& e) {
+		cerr << e.what() << endl << options << endl;
+		return 1;
+	}
+	if (vm.count("assign")) {
+		if (!vm.count("filename")) {
+			doc2vecfile = "-";
+		}
+		try {
+			if (distance == "cosine") {
+				assignFrozenTree<OPTIMIZER>(assignTree, doc2vecfile, batchSize);
+			} else if (distance == "normalized") {
+				assignFrozenTree<NORMALIZED_OPTIMIZER>(assignTree, doc2vecfile, batchSize);
+			} else {
+				cerr << "unknown distance " << distance << endl;
+				return 1;
+			}
+		} catch (const std::exception& e) {
+			cerr << e.what() << endl;
+			return 1;
+		}
+		return EXIT_SUCCESS;
+	}
+	if (vm.count("help") || !vm.count("depth")) {
+		cerr << options << endl;
 		return 1;
 	}
 
-	char* doc2vecfile = argv[1];
-	
-	int vector_length = atoi(argv[2]);
-	
-	int m = atoi(argv[3]);
-	int d = atoi(argv[4]);
+	streaming.cacheBudget = cacheMB * 1024 * 1024;
 	
-    streamingEMTree(doc2vecfile, vector_length, m, d);
+    try {
+        if (distance == "cosine") {
+            streamingEMTree<TSVQ_t, StreamingEMTree_t>(doc2vecfile, vector_length,
+                    m, d, streaming);
+        } else if (distance == "normalized") {
+            streamingEMTree<TSVQ_normalized_t, StreamingEMTree_normalized_t>(
+                    doc2vecfile, vector_length, m, d, streaming);
+        } else if (distance == "hamming") {
+            if (!vm.count("id-file")) {
+                cerr << "hamming needs --id-file" << endl;
+                return 1;
+            }
+            if (cacheMB > 0 || !streaming.spillFile.empty() || streaming.pqBytes > 0
+                    || !streaming.saveTree.empty() || !streaming.loadTree.empty()) {
+                cerr << "hamming does not support --cache-mb, --spill-file, --pq-bytes, "
+                        "--save-tree or --load-tree" << endl;
+                return 1;
+            }
+            streamingEMTree<BitTSVQ_t, BitStreamingEMTree_t>(idFile, doc2vecfile,
+                    vector_length, m, d, streaming);
+        } else {
+            cerr << "unknown distance " << distance << endl;
+            return 1;
+        }
+    } catch (const std::exception& e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
    
     return EXIT_SUCCESS;
 }
-
-
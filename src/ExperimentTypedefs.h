@@ -19,11 +19,15 @@
 #include "lmw/KTree.h"
 #include "lmw/EMTree.h"
 #include "lmw/StreamingEMTree.h"
+#include "lmw/RandomProjection.h"
 
 using namespace lmw;
 
 // change by fantao at 2015-8-16;
-typedef SVector<double> vecType;
+// doc2vec produces float32 vectors, so use half the memory and bandwidth of
+// double. Binary vector files must be converted with float32 to be mapped.
+typedef SVector<float> vecType;
+//typedef SVector<double> vecType;
 //typedef SVector<bool> vecType;
 
 
@@ -45,8 +49,26 @@ typedef TSVQ<vecType, KMeans_t, cosinedistance_type> TSVQ_t;
 
 typedef KTree<vecType, KMeans_t, OPTIMIZER> KTree_t;
 typedef EMTree<vecType, KMeans_t, OPTIMIZER> EMTree_t;
+// Sums of millions of vectors lose too much precision in float.
 typedef SVector<double> ACCUMULATOR;
 typedef StreamingEMTree<vecType, ACCUMULATOR, OPTIMIZER> StreamingEMTree_t;
 
+// Vectors and centroids are scaled to unit length, so cosine is a dot product.
+typedef normalizedCosineDistance<vecType> normalizedcosine_type;
+typedef Optimizer<vecType, normalizedcosine_type, Maximize, meanPrototype_double> NORMALIZED_OPTIMIZER;
+typedef KMeans<vecType, RandomSeeder_t, NORMALIZED_OPTIMIZER> KMeans_normalized_t;
+typedef TSVQ<vecType, KMeans_normalized_t, normalizedcosine_type> TSVQ_normalized_t;
+typedef StreamingEMTree<vecType, ACCUMULATOR, NORMALIZED_OPTIMIZER> StreamingEMTree_normalized_t;
+
+// Bit signatures of doc2vec vectors from a RandomProjection, compared by
+// Hamming distance. The accumulators count the set bits of each dimension.
+typedef SVector<bool> bitVecType;
+typedef RandomProjection<vecType> Projection_t;
+typedef Optimizer<bitVecType, hammingDistance, Minimize, meanBitPrototype2> BIT_OPTIMIZER;
+typedef KMeans<bitVecType, RandomSeeder<bitVecType>, BIT_OPTIMIZER> BitKMeans_t;
+typedef TSVQ<bitVecType, BitKMeans_t, hammingDistance> BitTSVQ_t;
+typedef SVector<int> BIT_ACCUMULATOR;
+typedef StreamingEMTree<bitVecType, BIT_ACCUMULATOR, BIT_OPTIMIZER> BitStreamingEMTree_t;
+
 #endif	/* EXPERIMENTTYPEDEFS_H */
 
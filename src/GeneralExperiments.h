@@ -218,7 +218,7 @@ void reduceDims(const set<int>& topbits, vector<SVector<bool>*>& vectors,
     }
 }
 
-void testHistogram(vector<SVector<bool>*>& vectors) {
+void testHistogram(vector<SVector<bool>*>& vectors, const IdTable& ids) {
     if (!vectors.empty()) {
         vector < SVector<bool>*> subset;
         int dims = vectors[0]->size();
@@ -227,7 +227,7 @@ void testHistogram(vector<SVector<bool>*>& vectors) {
             boost::timer::auto_cpu_timer seed("calculating histogram: %w seconds\n");
             topbits = dimensionHistogram(vectors, dims);
         }
-        loadSubset(vectors, subset, "data/inex_xml_mining_subset_2010.txt");
+        loadSubset(vectors, ids, subset, "data/inex_xml_mining_subset_2010.txt");
         vector < SVector<bool>*> reducedSubset;
         cout << "reducing dimensionality to " << topbits.size() << endl;
         reduceDims(topbits, subset, reducedSubset);
@@ -453,9 +453,10 @@ void clueweb() {
     int dims = 4096;
     int veccount = -1;
     vector < SVector<bool>*> vectors;
+    IdTable ids;
     {
         boost::timer::auto_cpu_timer load("loading document vectors %w seconds\n");
-        readSignatures(vectors, docidFile, signatureFile, dims, veccount);
+        readSignatures(vectors, ids, docidFile, signatureFile, dims, veccount);
     }
 
     // k-tree
@@ -0,0 +1,866 @@
+/**
+ * This file contains micro benchmarks for the performance critical parts of
+ * streaming EM-tree. They are run by the benchmark executable.
+ */
+#ifndef PERFORMANCEEXPERIMENTS_H
+#define	PERFORMANCEEXPERIMENTS_H
+
+#include "ExperimentTypedefs.h"
+#include "lmw/StdIncludes.h"
+#include "lmw/Doc2VecParser.h"
+#include "lmw/DocumentIndex.h"
+#include "lmw/KeyMatrix.h"
+#include "lmw/ProductQuantizer.h"
+#include "StreamingEMTreeExperiments.h"
+
+#include <boost/timer/timer.hpp>
+#include <cfloat>
+#include <iomanip>
+
+/**
+ * Writes a doc2vec text file of normally distributed vectors.
+ */
+void writeSyntheticDoc2Vec(const string& file, size_t vectorLength, size_t count) {
+    RND_ENG eng(1);
+    RND_NORMAL normal(0, 0.5);
+    RND_NORM_GEN_01 gen(eng, normal);
+    ofstream out(file);
+    if (!out) {
+        throw runtime_error("unable to open " + file);
+    }
+    for (size_t i = 0; i < count; i++) {
+        out << "doc" << i;
+        for (size_t j = 0; j < vectorLength; j++) {
+            out << " " << gen();
+        }
+        out << "\n";
+    }
+}
+
+/**
+ * The doc2vec tokenizer used by SVectorStream before it was replaced by
+ * Doc2VecParser. It is kept as the baseline for parseThroughput().
+ */
+size_t legacyDoc2VecRead(ifstream& stream, size_t vectorLength, size_t n,
+        vector<SVector<double>*>* data) {
+    string docid;
+    string v1;
+    size_t read = 0;
+    string vec_str;
+    while (getline(stream, vec_str)) {
+        int size = vec_str.size();
+        int flag = 0;
+        int vec_pos = 0;
+        SVector<double>* vector = new SVector<double>(vectorLength);
+        for (int i = 0; i < size; i++) {
+            int pos = vec_str.find(" ", i);
+            if (pos < size && pos >= 0) {
+                v1 = vec_str.substr(i, pos - i);
+                i = pos;
+            } else {
+                v1 = vec_str.substr(i, size - i);
+                i = size;
+            }
+            if (flag == 0) {
+                docid = v1;
+                flag = 1;
+            } else {
+                double vec = atof(v1.c_str());
+                vector->set(vec_pos, vec);
+                vec_pos++;
+            }
+        }
+        data->push_back(vector);
+        if (++read == n) {
+            break;
+        }
+    }
+    return read;
+}
+
+double fileSizeMB(const string& file) {
+    ifstream in(file, ios::in | ios::binary | ios::ate);
+    return double(in.tellg()) / (1024 * 1024);
+}
+
+template <typename READ>
+void timeParse(const string& name, const string& file, READ read) {
+    boost::timer::cpu_timer timer;
+    size_t total = 0;
+    for (;;) {
+        vector<SVector<double>*> data;
+        size_t n = read(&data);
+        for (auto vector : data) {
+            delete vector;
+        }
+        if (n == 0) {
+            break;
+        }
+        total += n;
+    }
+    double seconds = timer.elapsed().wall / 1e9;
+    cout << name << ": " << total << " vectors in " << seconds << " seconds, "
+            << fileSizeMB(file) / seconds << " MB/s" << endl;
+}
+
+/**
+ * Throws runtime_error unless SVectorStream parses every value of file to
+ * within float rounding of the legacy tokenizer, which uses atof. The fast
+ * path of Doc2VecParser::parseDouble() is not correctly rounded, so values
+ * may differ in the last bits of a double.
+ */
+void checkParse(const string& file, size_t vectorLength) {
+    const size_t readSize = 1000;
+    ifstream stream(file);
+    SVectorStream<SVector<double>> vs(file, vectorLength);
+    size_t vectors = 0, differ = 0;
+    double maxRelative = 0;
+    for (;;) {
+        vector<SVector<double>*> expected, parsed;
+        size_t n = legacyDoc2VecRead(stream, vectorLength, readSize, &expected);
+        size_t m = vs.read(readSize, &parsed);
+        if (n != m) {
+            Utils::purge(expected);
+            Utils::purge(parsed);
+            throw runtime_error("parsers read different numbers of vectors");
+        }
+        for (size_t i = 0; i < n; i++) {
+            for (size_t j = 0; j < vectorLength; j++) {
+                double a = (*expected[i])[j], b = (*parsed[i])[j];
+                if (a == b) {
+                    continue;
+                }
+                differ++;
+                double relative = fabs(a - b) / std::max(fabs(a), fabs(b));
+                maxRelative = std::max(maxRelative, relative);
+            }
+        }
+        vectors += n;
+        Utils::purge(expected);
+        Utils::purge(parsed);
+        if (n == 0) {
+            break;
+        }
+    }
+    cout << "checked " << vectors << " vectors, " << differ
+            << " values differ from atof by at most " << maxRelative
+            << " relative" << endl;
+    if (maxRelative > FLT_EPSILON / 2) {
+        throw runtime_error("parsed values differ by more than float rounding");
+    }
+}
+
+/**
+ * Compares the parse throughput of the legacy tokenizer and SVectorStream,
+ * both reading owned vectors and parsing recycled chunks as a pipeline does.
+ * The values parsed by both are compared first with checkParse().
+ */
+void parseThroughput(const string& file, size_t vectorLength) {
+    const size_t readSize = 1000;
+    checkParse(file, vectorLength);
+    {
+        ifstream stream(file);
+        timeParse("legacy getline/substr/atof", file,
+                [&](vector<SVector<double>*>* data) {
+                    return legacyDoc2VecRead(stream, vectorLength, readSize, data);
+                });
+    }
+    {
+        SVectorStream<SVector<double>> vs(file, vectorLength);
+        timeParse("SVectorStream block reader", file,
+                [&](vector<SVector<double>*>* data) {
+                    return vs.read(readSize, data);
+                });
+    }
+    {
+        SVectorStream<SVector<double>> vs(file, vectorLength);
+        timeParse("SVectorStream recycled chunks", file,
+                [&](vector<SVector<double>*>*) {
+                    auto chunk = vs.readChunk(readSize);
+                    if (!chunk) {
+                        return size_t(0);
+                    }
+                    vs.parseChunk(chunk);
+                    size_t n = chunk->vectors.size();
+                    vs.freeChunk(chunk);
+                    return n;
+                });
+    }
+}
+
+/**
+ * Compares the scalar cosine kernel with the SIMD kernel chosen at runtime,
+ * and with the dot product used for vectors that are already unit length.
+ */
+template <typename T>
+void cosineThroughput(size_t vectorLength) {
+    const size_t count = 1000;
+    const size_t repeats = 200;
+    RND_ENG eng(1);
+    RND_NORMAL normal(0, 0.5);
+    RND_NORM_GEN_01 gen(eng, normal);
+    vector<T> data(count * vectorLength);
+    for (auto& value : data) {
+        value = gen();
+    }
+    auto run = [&](const char* name, void (*kernel)(const T*, const T*, size_t,
+            double*, double*, double*)) {
+        boost::timer::cpu_timer timer;
+        double checksum = 0;
+        for (size_t r = 0; r < repeats; r++) {
+            for (size_t i = 1; i < count; i++) {
+                double dot, norm1, norm2;
+                kernel(&data[0], &data[i * vectorLength], vectorLength, &dot, &norm1, &norm2);
+                checksum += dot / sqrt(norm1 * norm2);
+            }
+        }
+        double seconds = timer.elapsed().wall / 1e9;
+        cout << name << ": " << (repeats * (count - 1)) / seconds / 1e6
+                << " million distances/s (checksum " << checksum << ")" << endl;
+    };
+    cout << "cosine on " << vectorLength << " dimensional " << sizeof (T) * 8
+            << " bit vectors" << endl;
+    run("scalar", &VectorKernels::cosineTermsScalar<T>);
+    run(VectorKernels::instructionSet(), &VectorKernels::cosineTerms);
+
+    // normalizedCosineDistance only needs the dot product
+    boost::timer::cpu_timer timer;
+    double checksum = 0;
+    for (size_t r = 0; r < repeats; r++) {
+        for (size_t i = 1; i < count; i++) {
+            checksum += VectorKernels::dot(&data[0], &data[i * vectorLength], vectorLength);
+        }
+    }
+    double seconds = timer.elapsed().wall / 1e9;
+    cout << VectorKernels::instructionSet() << " dot product only: "
+            << (repeats * (count - 1)) / seconds / 1e6
+            << " million distances/s (checksum " << checksum << ")" << endl;
+}
+
+/**
+ * A key in the layout used by StreamingEMTree before KeyMatrix, a pointer to
+ * a struct that points to an SVector that points to its data.
+ */
+struct ScanKey {
+    vecType* key;
+    double keyNorm;
+};
+
+/**
+ * Compares the time to find the nearest of m keys in a node when each key is
+ * reached through pointers and when the keys are in a KeyMatrix. Both must
+ * choose the same keys.
+ */
+void nodeScanThroughput(size_t vectorLength) {
+    const size_t queries = 2000;
+    RND_ENG eng(1);
+    RND_NORMAL normal(0, 0.5);
+    RND_NORM_GEN_01 gen(eng, normal);
+    auto randomVector = [&]() {
+        vecType* v = new vecType(vectorLength);
+        for (size_t i = 0; i < vectorLength; i++) {
+            v->set(i, gen());
+        }
+        return v;
+    };
+    OPTIMIZER optimizer;
+    vector<vecType*> objects;
+    for (size_t i = 0; i < queries; i++) {
+        objects.push_back(randomVector());
+    }
+    cout << "nearest key in a node of " << vectorLength << " dimensional "
+            << sizeof (vecType::value_type) * 8 << " bit keys using "
+            << VectorKernels::instructionSet() << endl;
+    for (size_t m : {10, 100, 500, 1000, 4000}) {
+        // scatter the keys in memory like a tree built over many iterations
+        vector<ScanKey*> keys;
+        vector<vecType*> spacers;
+        for (size_t i = 0; i < m; i++) {
+            spacers.push_back(randomVector());
+            ScanKey* key = new ScanKey();
+            key->key = randomVector();
+            key->keyNorm = optimizer.norm(key->key);
+            keys.push_back(key);
+        }
+        KeyMatrix<vecType::value_type> matrix;
+        matrix.resize(m, vectorLength);
+        for (size_t i = 0; i < m; i++) {
+            matrix.setRow(i, keys[i]->key->begin(), keys[i]->keyNorm);
+        }
+        auto accessor = [](ScanKey* key) { return key->key; };
+        auto normAccessor = [](ScanKey* key) { return key->keyNorm; };
+
+        boost::timer::cpu_timer pointerTimer;
+        size_t pointerChecksum = 0;
+        for (auto object : objects) {
+            pointerChecksum += optimizer.nearest(object, optimizer.norm(object),
+                    keys, accessor, normAccessor).index;
+        }
+        double pointerSeconds = pointerTimer.elapsed().wall / 1e9;
+
+        boost::timer::cpu_timer matrixTimer;
+        size_t matrixChecksum = 0;
+        for (auto object : objects) {
+            matrixChecksum += optimizer.nearest(object, optimizer.norm(object),
+                    keys, matrix).index;
+        }
+        double matrixSeconds = matrixTimer.elapsed().wall / 1e9;
+
+        cout << "m = " << m << ": pointers " << pointerSeconds / queries * 1e6
+                << " us per node, KeyMatrix " << matrixSeconds / queries * 1e6
+                << " us per node, speedup " << pointerSeconds / matrixSeconds
+                << (pointerChecksum == matrixChecksum ? "" : " MISMATCH") << endl;
+        for (auto key : keys) {
+            delete key->key;
+            delete key;
+        }
+        Utils::purge(spacers);
+    }
+    Utils::purge(objects);
+}
+
+/**
+ * Compares k-means when vectors are assigned to centroids one at a time and
+ * when they are assigned with matrix multiplication. Both start from the same
+ * seeds, so they must find the same clusters.
+ */
+void kmeansAssignThroughput(size_t vectorLength) {
+    const size_t count = 10000;
+    const int iterations = 5;
+    RND_ENG eng(1);
+    RND_NORMAL normal(0, 0.5);
+    RND_NORM_GEN_01 gen(eng, normal);
+    vector<vecType*> data;
+    for (size_t i = 0; i < count; i++) {
+        vecType* v = new vecType(vectorLength);
+        for (size_t j = 0; j < vectorLength; j++) {
+            v->set(j, gen());
+        }
+        data.push_back(v);
+    }
+    cout << "k-means on " << count << " " << vectorLength << " dimensional "
+            << sizeof (vecType::value_type) * 8 << " bit vectors, "
+            << iterations << " iterations" << endl;
+    for (size_t k : {10, 100, 1000}) {
+        double seconds[2], rmse[2];
+        for (int matrix = 0; matrix < 2; matrix++) {
+            std::srand(1);
+            KMeans_t kmeans(k);
+            kmeans.setMaxIters(iterations);
+            if (!matrix) {
+                kmeans.setMinMatrixClusters(std::numeric_limits<size_t>::max());
+            }
+            boost::timer::cpu_timer timer;
+            kmeans.cluster(data);
+            seconds[matrix] = timer.elapsed().wall / 1e9;
+            rmse[matrix] = kmeans.getRMSE();
+        }
+        cout << "k = " << k << ": one at a time " << seconds[0]
+                << " seconds, matrix " << seconds[1] << " seconds, speedup "
+                << seconds[0] / seconds[1]
+                << (fabs(rmse[0] - rmse[1]) < 1e-6 * rmse[0] ? "" : " MISMATCH")
+                << endl;
+    }
+    Utils::purge(data);
+}
+
+template <typename VECTORSTREAM>
+size_t timeInsert(StreamingEMTree_t* emtree, VECTORSTREAM& vs, double* seconds) {
+    emtree->clearAccumulators();
+    boost::timer::cpu_timer timer;
+    size_t read = emtree->insert(vs);
+    *seconds = timer.elapsed().wall / 1e9;
+    return read;
+}
+
+/**
+ * Inserts a file into a streaming EM-tree with 1, 2, 4, ... maxThreads
+ * threads. Every run must produce the same accumulators.
+ */
+void insertScaling(const string& file, size_t vectorLength, int maxThreads) {
+    StreamingEMTree_t* emtree = streamingEMTreeInit<TSVQ_t, StreamingEMTree_t>(
+            file, vectorLength, 10, 3);
+    vector<int> threads;
+    for (int t = 1; t < maxThreads; t *= 2) {
+        threads.push_back(t);
+    }
+    threads.push_back(maxThreads);
+    double baseSeconds = 0, baseRMSE = 0;
+    for (int t : threads) {
+        tbb::task_scheduler_init init(t);
+        double seconds;
+        size_t read;
+        if (isVectorFile(file)) {
+            MappedSVectorStream<vecType> vs(file, vectorLength);
+            read = timeInsert(emtree, vs, &seconds);
+        } else {
+            SVectorStream<vecType> vs(file, vectorLength, -1, NULL);
+            read = timeInsert(emtree, vs, &seconds);
+        }
+        double RMSE = emtree->getRMSE();
+        if (t == 1) {
+            baseSeconds = seconds;
+            baseRMSE = RMSE;
+        }
+        cout << t << " threads: " << read / seconds / 1e6
+                << " million vectors/s, speedup " << baseSeconds / seconds
+                << (emtree->getObjCount() == read
+                && fabs(RMSE - baseRMSE) <= 1e-9 * baseRMSE ? "" : " MISMATCH")
+                << endl;
+    }
+    delete emtree;
+}
+
+/**
+ * Inserts a file with 0, 1, 2 and 4 chunks read ahead by the I/O thread and
+ * reports how long the pipeline waited for data.
+ */
+void prefetchStall(const string& file, size_t vectorLength) {
+    StreamingEMTree_t* emtree = streamingEMTreeInit<TSVQ_t, StreamingEMTree_t>(
+            file, vectorLength, 10, 3);
+    for (int prefetch : {0, 1, 2, 4}) {
+        emtree->setPrefetchChunks(prefetch);
+        double seconds;
+        size_t read;
+        if (isVectorFile(file)) {
+            MappedSVectorStream<vecType> vs(file, vectorLength);
+            read = timeInsert(emtree, vs, &seconds);
+        } else {
+            SVectorStream<vecType> vs(file, vectorLength, -1, NULL);
+            read = timeInsert(emtree, vs, &seconds);
+        }
+        cout << prefetch << " chunks prefetched: " << read / seconds / 1e6
+                << " million vectors/s, stalled for "
+                << emtree->getInputStallSeconds() << " of " << seconds
+                << " seconds" << endl;
+    }
+    delete emtree;
+}
+
+/**
+ * Inserts a file into the same streaming EM-tree with beam widths of 1, 2, 4
+ * and 8, and reports the RMSE of the assignments against the number of
+ * distances calculated.
+ */
+void beamTradeoff(const string& file, size_t vectorLength) {
+    StreamingEMTree_t* emtree = streamingEMTreeInit<TSVQ_t, StreamingEMTree_t>(
+            file, vectorLength, 10, 3);
+    for (int beamWidth : {1, 2, 4, 8}) {
+        emtree->setBeamWidth(beamWidth);
+        double seconds;
+        size_t read;
+        if (isVectorFile(file)) {
+            MappedSVectorStream<vecType> vs(file, vectorLength);
+            read = timeInsert(emtree, vs, &seconds);
+        } else {
+            SVectorStream<vecType> vs(file, vectorLength, -1, NULL);
+            read = timeInsert(emtree, vs, &seconds);
+        }
+        uint64_t distances = 0;
+        for (uint64_t count : emtree->getDistanceCounts()) {
+            distances += count;
+        }
+        cout << "beam width " << beamWidth << ": RMSE " << std::setprecision(8) << emtree->getRMSE()
+                << ", " << double(distances) / read << " distances per vector, "
+                << read / seconds / 1e6 << " million vectors/s" << endl;
+    }
+    delete emtree;
+}
+
+/**
+ * Inserts the vectors of a file held in memory into the same streaming
+ * EM-tree with exact float keys, with keys quantized to 8 bits, and with
+ * quantized keys where the 4 nearest leaf keys are compared again with the
+ * exact keys. Reports the RMSE of the assignments and the throughput of one
+ * thread. The tree is wide, so scanning the keys dominates.
+ */
+void int8Tradeoff(const string& file, size_t vectorLength) {
+    StreamingEMTree_t* emtree = streamingEMTreeInit<TSVQ_t, StreamingEMTree_t>(
+            file, vectorLength, 50, 2);
+    vector<vecType*> data;
+    SVectorStream<vecType> vs(file, vectorLength, -1, NULL);
+    while (vs.read(1000, &data) > 0) { }
+    cout << "8 bit keys use " << VectorKernels::instructionSet() << endl;
+    for (int rerank : {-1, 0, 4}) {
+        emtree->setInt8Keys(rerank >= 0);
+        emtree->setInt8Rerank(std::max(rerank, 0));
+        emtree->clearAccumulators();
+        boost::timer::cpu_timer timer;
+        emtree->insert(data);
+        double seconds = timer.elapsed().wall / 1e9;
+        string name = rerank < 0 ? "float keys"
+                : "8 bit keys, rerank " + std::to_string(rerank);
+        cout << name << ": RMSE " << std::setprecision(8) << emtree->getRMSE()
+                << ", " << data.size() / seconds / 1e6 << " million vectors/s"
+                << endl;
+    }
+    Utils::purge(data);
+    delete emtree;
+}
+
+/**
+ * Compares clustering a file with cosine similarity to clustering the
+ * signatures of a RandomProjection in Hamming space. Reports the throughput
+ * of one thread projecting vectors and inserting vectors or signatures held
+ * in memory, and of projecting in the insert pipeline from the file. Both
+ * trees are initialized with TSVQ on a sample and take one insert pass. The
+ * keys of the Hamming tree are then updated to the means of the dense
+ * vectors in each cluster with meanTree(), and the quality of both trees is
+ * the RMSE of another dense insert pass after the update.
+ */
+void simhashTradeoff(const string& file, size_t vectorLength) {
+    vector<vecType*> data;
+    if (isVectorFile(file)) {
+        MappedSVectorStream<vecType> vs(file, vectorLength);
+        while (auto chunk = vs.readChunk(1000)) {
+            vs.parseChunk(chunk);
+            for (vecType* object : chunk->vectors) {
+                data.push_back(new vecType(*object));
+            }
+            vs.freeChunk(chunk);
+        }
+    } else {
+        SVectorStream<vecType> vs(file, vectorLength, -1, NULL);
+        while (vs.read(1000, &data) > 0) { }
+    }
+    vector<vecType*> sample(data.begin(), data.begin() + std::min(data.size(), size_t(10000)));
+    {
+        TSVQ_t tsvq(10, 3, 10);
+        tsvq.cluster(sample);
+        StreamingEMTree_t emtree(tsvq.getMWayTree());
+        tbb::task_scheduler_init init(1);
+        boost::timer::cpu_timer timer;
+        emtree.insert(data);
+        double seconds = timer.elapsed().wall / 1e9;
+        emtree.update();
+        emtree.clearAccumulators();
+        emtree.insert(data);
+        cout << "cosine: insert " << data.size() / seconds / 1e6
+                << " million vectors/s, RMSE " << std::setprecision(8)
+                << emtree.getRMSE() << endl;
+    }
+    for (size_t bits : {64, 256, 1024}) {
+        Projection_t projection(vectorLength, bits);
+        vector<bitVecType*> signatures;
+        double projectSeconds, insertSeconds, pipelineSeconds;
+        unique_ptr<Node<vecType>> means;
+        {
+            tbb::task_scheduler_init init(1);
+            boost::timer::cpu_timer timer;
+            for (vecType* object : data) {
+                signatures.push_back(projection.allocate());
+                projection(object, signatures.back());
+            }
+            projectSeconds = timer.elapsed().wall / 1e9;
+        }
+        vector<bitVecType*> signatureSample(signatures.begin(),
+                signatures.begin() + sample.size());
+        BitTSVQ_t tsvq(10, 3, 10);
+        tsvq.cluster(signatureSample);
+        BitStreamingEMTree_t bitTree(tsvq.getMWayTree());
+        {
+            tbb::task_scheduler_init init(1);
+            boost::timer::cpu_timer timer;
+            bitTree.insert(signatures);
+            insertSeconds = timer.elapsed().wall / 1e9;
+            means.reset(bitTree.meanTree(data, projection));
+        }
+        bitTree.clearAccumulators();
+        {
+            tbb::task_scheduler_init init(1);
+            boost::timer::cpu_timer timer;
+            if (isVectorFile(file)) {
+                MappedSVectorStream<vecType> vs(file, vectorLength);
+                bitTree.insert(vs, projection);
+            } else {
+                SVectorStream<vecType> vs(file, vectorLength, -1, NULL);
+                bitTree.insert(vs, projection);
+            }
+            pipelineSeconds = timer.elapsed().wall / 1e9;
+        }
+        StreamingEMTree_t refined(means.get());
+        refined.insert(data);
+        cout << bits << " bit signatures: project " << data.size() / projectSeconds / 1e6
+                << ", insert " << data.size() / insertSeconds / 1e6
+                << ", project and insert from file " << data.size() / pipelineSeconds / 1e6
+                << " million vectors/s, RMSE " << std::setprecision(8)
+                << refined.getRMSE() << endl;
+        Utils::purge(signatures);
+    }
+    Utils::purge(data);
+}
+
+/**
+ * Queries a trained streaming EM-tree for the 10 nearest leaf clusters of
+ * every vector in a file while expanding more and more nodes, and reports
+ * the throughput and the recall of the clusters found by an exhaustive
+ * search.
+ */
+void nearestClustersTradeoff(const string& file, size_t vectorLength) {
+    const size_t k = 10;
+    StreamingEMTree_t* emtree = streamingEMTreeInit<TSVQ_t, StreamingEMTree_t>(
+            file, vectorLength, 10, 3);
+    vector<vecType*> data;
+    {
+        SVectorStream<vecType> vs(file, vectorLength, -1, NULL);
+        emtree->insert(vs);
+        emtree->update();
+    }
+    SVectorStream<vecType> vs(file, vectorLength, -1, NULL);
+    while (vs.read(1000, &data) > 0) { }
+    vector<vector<RankedCluster<vecType>>> exact, ranked;
+    emtree->nearestClusters(data, k, std::numeric_limits<size_t>::max(), &exact);
+    for (size_t maxExpanded : {3, 6, 12, 24, 48}) {
+        boost::timer::cpu_timer timer;
+        emtree->nearestClusters(data, k, maxExpanded, &ranked);
+        double seconds = timer.elapsed().wall / 1e9;
+        size_t found = 0, total = 0;
+        for (size_t i = 0; i < data.size(); i++) {
+            for (auto& cluster : exact[i]) {
+                for (auto& other : ranked[i]) {
+                    if (other.key == cluster.key) {
+                        found++;
+                        break;
+                    }
+                }
+            }
+            total += exact[i].size();
+        }
+        cout << "expanding " << maxExpanded << " nodes: recall@" << k << " "
+                << double(found) / total << ", " << data.size() / seconds / 1e6
+                << " million queries/s" << endl;
+    }
+    Utils::purge(data);
+    delete emtree;
+}
+
+/**
+ * The fraction of the documents in exact that are also in matches.
+ */
+template <typename MATCH>
+double recall(const vector<vector<MATCH>>& exact, const vector<vector<MATCH>>& matches) {
+    size_t found = 0, total = 0;
+    for (size_t i = 0; i < exact.size(); i++) {
+        for (auto& match : exact[i]) {
+            for (auto& other : matches[i]) {
+                if (other.id == match.id) {
+                    found++;
+                    break;
+                }
+            }
+        }
+        total += exact[i].size();
+    }
+    return double(found) / total;
+}
+
+/**
+ * Indexes every vector in a file by the leaf clusters of a trained streaming
+ * EM-tree, then searches for the 10 documents nearest to 1000 of them while
+ * probing more and more leaves. Reports the recall of the documents found by
+ * probing every leaf and the latency of a query.
+ */
+void documentSearchTradeoff(const string& file, size_t vectorLength) {
+    typedef DocumentIndex<vecType, OPTIMIZER> Index;
+    const size_t k = 10, queryCount = 1000;
+    StreamingEMTree_t* emtree = streamingEMTreeInit<TSVQ_t, StreamingEMTree_t>(
+            file, vectorLength, 10, 3);
+    vector<vecType*> data;
+    {
+        SVectorStream<vecType> vs(file, vectorLength, -1, NULL);
+        emtree->insert(vs);
+        emtree->update();
+    }
+    SVectorStream<vecType> vs(file, vectorLength, -1, NULL);
+    while (vs.read(1000, &data) > 0) { }
+    Index index(vectorLength);
+    {
+        boost::timer::cpu_timer timer;
+        index.add(*emtree, data);
+        index.build();
+        cout << "indexed " << index.size() << " documents in " << index.leafCount()
+                << " leaves in " << timer.elapsed().wall / 1e9 << " seconds" << endl;
+    }
+    vector<vecType*> queries(data.begin(), data.begin() + std::min(queryCount, data.size()));
+    vector<vector<Index::Match>> exact, matches;
+    index.search(*emtree, queries, k, index.leafCount(), &exact);
+    for (size_t probes : {1, 2, 4, 8, 16}) {
+        boost::timer::cpu_timer timer;
+        index.search(*emtree, queries, k, probes, &matches);
+        double seconds = timer.elapsed().wall / 1e9;
+        cout << "probing " << probes << " leaves: recall@" << k << " "
+                << recall(exact, matches) << ", " << seconds / queries.size() * 1e6
+                << " us per query" << endl;
+    }
+    Utils::purge(data);
+    delete emtree;
+}
+
+/**
+ * Indexes a file by the leaf clusters of a trained streaming EM-tree with
+ * float vectors and with product quantized codes of about 16, 32 and 64
+ * bytes, and reports the memory, recall@10 against an exact search of the
+ * float vectors and the latency of a query probing 8 leaves.
+ */
+void productQuantizerTradeoff(const string& file, size_t vectorLength) {
+    typedef DocumentIndex<vecType, OPTIMIZER> Index;
+    const size_t k = 10, probes = 8, queryCount = 1000;
+    StreamingEMTree_t* emtree = streamingEMTreeInit<TSVQ_t, StreamingEMTree_t>(
+            file, vectorLength, 10, 3);
+    vector<vecType*> data;
+    {
+        SVectorStream<vecType> vs(file, vectorLength, -1, NULL);
+        emtree->insert(vs);
+        emtree->update();
+    }
+    SVectorStream<vecType> vs(file, vectorLength, -1, NULL);
+    while (vs.read(1000, &data) > 0) { }
+    vector<vecType*> sample(data.begin(), data.begin() + std::min(size_t(10000), data.size()));
+    vector<vecType*> queries(data.begin(), data.begin() + std::min(queryCount, data.size()));
+    Index exactIndex(vectorLength);
+    exactIndex.add(*emtree, data);
+    exactIndex.build();
+    vector<vector<Index::Match>> exact, matches;
+    exactIndex.search(*emtree, queries, k, exactIndex.leafCount(), &exact);
+    auto report = [&](const string& name, const Index& index) {
+        boost::timer::cpu_timer timer;
+        index.search(*emtree, queries, k, probes, &matches);
+        double seconds = timer.elapsed().wall / 1e9;
+        cout << name << ": " << index.memberBytes() / index.size()
+                << " bytes per document, recall@" << k << " " << recall(exact, matches)
+                << ", " << seconds / queries.size() * 1e6 << " us per query" << endl;
+    };
+    report("float", exactIndex);
+    for (size_t target : {16, 32, 64}) {
+        size_t bytes = std::min(target, vectorLength);
+        while (vectorLength % bytes != 0) {
+            bytes--;
+        }
+        ProductQuantizer<vecType> quantizer(vectorLength, bytes);
+        boost::timer::cpu_timer timer;
+        quantizer.train(sample);
+        double trainSeconds = timer.elapsed().wall / 1e9;
+        Index index(vectorLength);
+        index.setQuantizer(&quantizer);
+        index.add(*emtree, data);
+        index.build();
+        report(std::to_string(bytes) + " byte codes (trained in "
+                + std::to_string(trainSeconds) + " seconds)", index);
+    }
+    Utils::purge(data);
+    delete emtree;
+}
+
+/**
+ * Returns true when two trees have the same topology, key values and ids.
+ */
+bool sameTree(const Node<vecType>* a, const Node<vecType>* b) {
+    if (a->isLeaf() != b->isLeaf() || a->size() != b->size()) {
+        return false;
+    }
+    for (int i = 0; i < a->size(); i++) {
+        const vecType* x = a->getKey(i);
+        const vecType* y = b->getKey(i);
+        if (x->getID() != y->getID() || !std::equal(x->begin(), x->end(), y->begin())
+                || (!a->isLeaf() && !sameTree(a->getChild(i), b->getChild(i)))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Saves a TSVQ tree of a sample of a file, loads it back and resumes the
+ * iterations with an EMTree. KTree and TSVQ build a tree in one pass and can
+ * not be resumed, so a loaded Node tree continues as an EMTree.
+ */
+void treeFileRoundTrip(const string& file, size_t vectorLength) {
+    const string treeFile = "benchmark.tree";
+    vector<vecType*> data;
+    SVectorStream<vecType> vs(file, vectorLength, -1, NULL);
+    while (data.size() < 10000 && vs.read(1000, &data) > 0) { }
+    TSVQ_t tsvq(10, 3, 5);
+    tsvq.cluster(data);
+    boost::timer::cpu_timer timer;
+    saveTree(treeFile, tsvq.getMWayTree());
+    double saveSeconds = timer.elapsed().wall / 1e9;
+    timer.start();
+    MappedTreeFile mapped(treeFile);
+    EMTree_t emtree(loadTree<vecType>(mapped));
+    double loadSeconds = timer.elapsed().wall / 1e9;
+    cout << data.size() << " vectors saved in " << saveSeconds << " seconds and loaded in "
+            << loadSeconds << " seconds, " << (sameTree(tsvq.getMWayTree(),
+            emtree.getMWayTree()) ? "same tree" : "MISMATCH") << endl;
+    cout << "TSVQ RMSE " << tsvq.getRMSE() << ", loaded RMSE " << emtree.getRMSE() << endl;
+    for (int i = 0; i < 3; i++) {
+        emtree.EMStep();
+        cout << "resumed iteration " << i + 1 << " RMSE " << emtree.getRMSE() << endl;
+    }
+    Utils::purge(data);
+    std::remove(treeFile.c_str());
+}
+
+/**
+ * Assigns a file to a frozen copy of a trained streaming EM-tree in batches
+ * with 1, 2, 4, ... maxThreads threads and reports the latency of a batch.
+ * Every run must make the same assignments.
+ */
+void assignScaling(const string& file, size_t vectorLength, int maxThreads) {
+    const size_t batchSize = 1000;
+    const string treeFile = "benchmark.tree";
+    {
+        StreamingEMTree_t* emtree = streamingEMTreeInit<TSVQ_t, StreamingEMTree_t>(
+                file, vectorLength, 10, 3);
+        SVectorStream<vecType> vs(file, vectorLength, -1, NULL);
+        emtree->insert(vs);
+        emtree->update();
+        emtree->save(treeFile);
+        delete emtree;
+    }
+    MappedTreeFile mapped(treeFile);
+    FrozenTree<vecType, OPTIMIZER> tree(mapped);
+    vector<vecType*> data;
+    SVectorStream<vecType> vs(file, vectorLength, -1, NULL);
+    while (vs.read(batchSize, &data) > 0) { }
+    cout << "assigning " << data.size() << " vectors in batches of " << batchSize
+            << " to a frozen tree of depth " << tree.depth() << endl;
+    vector<int> threads;
+    for (int t = 1; t < maxThreads; t *= 2) {
+        threads.push_back(t);
+    }
+    threads.push_back(maxThreads);
+    double baseSeconds = 0;
+    vector<uint64_t> baseLeaves;
+    for (int t : threads) {
+        tbb::task_scheduler_init init(t);
+        vector<uint64_t> leaves;
+        vector<FrozenTree<vecType, OPTIMIZER>::Assignment> assignments;
+        double maxBatchSeconds = 0;
+        boost::timer::cpu_timer timer;
+        for (size_t first = 0; first < data.size(); first += batchSize) {
+            vector<vecType*> batch(data.begin() + first,
+                    data.begin() + std::min(first + batchSize, data.size()));
+            boost::timer::cpu_timer batchTimer;
+            tree.assign(batch, &assignments);
+            maxBatchSeconds = std::max(maxBatchSeconds, batchTimer.elapsed().wall / 1e9);
+            for (auto& assignment : assignments) {
+                leaves.push_back(assignment.leaf);
+            }
+        }
+        double seconds = timer.elapsed().wall / 1e9;
+        if (t == 1) {
+            baseSeconds = seconds;
+            baseLeaves = leaves;
+        }
+        size_t batches = (data.size() + batchSize - 1) / batchSize;
+        cout << t << " threads: " << data.size() / seconds / 1e6
+                << " million vectors/s, " << seconds / batches * 1e3
+                << " ms per batch, " << maxBatchSeconds * 1e3
+                << " ms slowest batch, speedup " << baseSeconds / seconds
+                << (leaves == baseLeaves ? "" : " MISMATCH") << endl;
+    }
+    Utils::purge(data);
+    std::remove(treeFile.c_str());
+}
+
+#endif	/* PERFORMANCEEXPERIMENTS_H */
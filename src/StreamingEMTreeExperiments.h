@@ -8,23 +8,27 @@
 #include "tbb/mutex.h"
 #include "tbb/task_scheduler_init.h"
 #include "lmw/StreamingEMTree.h"
+#include "lmw/CachedSVectorStream.h"
+#include "lmw/FrozenTree.h"
+#include "lmw/ProductQuantizer.h"
 
 
 /*
 StreamingEMTree_t* streamingEMTreeInit() {
     // load data
     vector < SVector<bool>*> vectors;
+    IdTable ids;
     int veccount = -1;
     {
         boost::timer::auto_cpu_timer load("loading signatures: %w seconds\n");
-        loadWikiSignatures(vectors, veccount);
+        loadWikiSignatures(vectors, ids, veccount);
     }
 
     // filter data to XML Mining subset
     vector < SVector<bool>*> subset;
     {
         boost::timer::auto_cpu_timer load("filtering subset: %w seconds\n");
-        loadSubset(vectors, subset, "data/inex_xml_mining_subset_2010.txt");
+        loadSubset(vectors, ids, subset, "data/inex_xml_mining_subset_2010.txt");
     }
 
     // run TSVQ to build tree on sample
@@ -51,20 +55,29 @@ StreamingEMTree_t* streamingEMTreeInit() {
 */
 
 // change by fantao at 2015-8-16;
-StreamingEMTree_t* streamingEMTreeInit(char * doc2vecFile, size_t vectorLength, int m=10, int depth=4) {
+/**
+ * TSVQ and STREAMINGEMTREE must use the same OPTIMIZER, for example, TSVQ_t
+ * and StreamingEMTree_t, or TSVQ_normalized_t and StreamingEMTree_normalized_t.
+ */
+template <typename TSVQ, typename STREAMINGEMTREE>
+STREAMINGEMTREE* streamingEMTreeInit(const string& doc2vecFile, size_t vectorLength, int m=10, int depth=4) {
     // load data
-    vector < SVector<double>*> vectors;
+    vector<vecType*> vectors;
     int max_samp_count = 10000;
     {
         boost::timer::auto_cpu_timer load("loading doc2vector: %w seconds\n");
-        loadSubset_doc2vec(doc2vecFile, vectorLength, vectors, max_samp_count);    
+        if (isVectorFile(doc2vecFile)) {
+            loadSubset_binary(doc2vecFile, vectorLength, vectors, max_samp_count);
+        } else {
+            loadSubset_doc2vec(doc2vecFile, vectorLength, vectors, max_samp_count);
+        }
     }
 
     // run TSVQ to build tree on sample
     //const int m = 10;
     //const int depth = 4;
     const int maxiter = 10;
-    TSVQ_t tsvq(m, depth, maxiter);
+    TSVQ tsvq(m, depth, maxiter);
 
     {
         boost::timer::auto_cpu_timer load("cluster subset using TSVQ: %w seconds\n");
@@ -73,7 +86,7 @@ StreamingEMTree_t* streamingEMTreeInit(char * doc2vecFile, size_t vectorLength,
 
     cout << "initializing streaming EM-tree based on TSVQ subset sample" << endl;
     cout << "TSVQ iterations = " << maxiter << endl;
-    auto tree = new StreamingEMTree_t(tsvq.getMWayTree());
+    auto tree = new STREAMINGEMTREE(tsvq.getMWayTree());
 
     return tree;
 }
@@ -91,7 +104,8 @@ StreamingEMTree_t* streamingEMTreeInit(char * doc2vecFile, size_t vectorLength,
 	
 
 
-void report(StreamingEMTree_t* emtree) {
+template <typename STREAMINGEMTREE>
+void report(STREAMINGEMTREE* emtree) {
     int maxDepth = emtree->getMaxLevelCount();
     cout << "max depth = " << maxDepth << endl;
     for (int i = 0; i < maxDepth; i++) {
@@ -99,6 +113,12 @@ void report(StreamingEMTree_t* emtree) {
                 << emtree->getClusterCount(i + 1) << endl;
     }
     cout << "streaming EM-tree had " << emtree->getObjCount() << " vectors inserted" << endl;
+    const vector<uint64_t>& distances = emtree->getDistanceCounts();
+    for (size_t i = 0; i < distances.size(); i++) {
+        cout << "distances calculated at level " << i + 1 << " = " << distances[i]
+                << " (" << double(distances[i]) / std::max(emtree->getObjCount(), uint64_t(1))
+                << " per vector, beam width " << emtree->getBeamWidth() << ")" << endl;
+    }
 
 	// change by fantao at 2015-8-23;
 	double rmse = emtree->getRMSE();
@@ -114,20 +134,37 @@ void report(StreamingEMTree_t* emtree) {
     cout << "RMSE = " << rmse << endl;
 }
 
-void insertWriteClusters(StreamingEMTree_t* emtree, char * doc2vecFile, size_t vectorLength) {
-    // open files
+/**
+ * Loads a streaming EM-tree saved by StreamingEMTree::save() to continue
+ * iterating. The statistics of the saved tree are reported first.
+ */
+template <typename STREAMINGEMTREE>
+STREAMINGEMTREE* streamingEMTreeLoad(const string& treeFile, size_t vectorLength) {
+    boost::timer::auto_cpu_timer load("loading streaming EM-tree: %w seconds\n");
+    MappedTreeFile file(treeFile);
+    if (file.dimensions() != vectorLength) {
+        throw runtime_error("vector length does not match " + treeFile);
+    }
+    auto tree = new STREAMINGEMTREE(file);
+    cout << "loaded streaming EM-tree from " << treeFile << endl;
+    report(tree);
+    tree->clearAccumulators();
+    return tree;
+}
 
+template <typename STREAMINGEMTREE, typename VECTORSTREAM>
+void insertWriteClusters(STREAMINGEMTREE* emtree, VECTORSTREAM& vs) {
+    typedef typename STREAMINGEMTREE::vector_type T;
 	// change by fantao at 2015-8-20; boo->double;
     //SVectorStream<SVector<bool>> vs(wikiDocidFile, wikiSignatureFile, wikiSignatureLength);
 
-	SVectorStream<SVector<double>> vs(doc2vecFile, vectorLength);
     // setup output streams for all levels in the tree
     const string prefix = "doc2vec_clusters";
 
     // insert and write cluster assignments
     {
         boost::timer::auto_cpu_timer insert("inserting and writing clusters: %w seconds\n");
-        ClusterWriter cw(emtree->getMaxLevelCount(), prefix);
+        ClusterWriter<T> cw(emtree->getMaxLevelCount(), prefix, vs.ids());
         emtree->visit(vs, cw);
     }
 
@@ -140,25 +177,36 @@ void insertWriteClusters(StreamingEMTree_t* emtree, char * doc2vecFile, size_t v
     // write out cluster statistics
     {
         boost::timer::auto_cpu_timer update("writing cluster stats: %w seconds\n");
-        ClusterStats cs(emtree->getMaxLevelCount(), prefix);
+        ClusterStats<T> cs(emtree->getMaxLevelCount(), prefix);
         emtree->visit(cs);
     }
 }
 
-void streamingEMTreeInsertPruneReport(StreamingEMTree_t* emtree, char * doc2vecFile, size_t vectorLength) {
-    // open files
-    
+template <typename STREAMINGEMTREE>
+void insertWriteClusters(STREAMINGEMTREE* emtree, const string& doc2vecFile, size_t vectorLength) {
+    // open files, binary vector files are memory mapped instead of parsed
+    if (isVectorFile(doc2vecFile)) {
+        MappedSVectorStream<vecType> vs(doc2vecFile, vectorLength);
+        insertWriteClusters(emtree, vs);
+    } else {
+        SVectorStream<vecType> vs(doc2vecFile, vectorLength);
+        insertWriteClusters(emtree, vs);
+    }
+}
+
+template <typename STREAMINGEMTREE, typename VECTORSTREAM>
+void streamingEMTreeInsertPruneReport(STREAMINGEMTREE* emtree, VECTORSTREAM& vs) {
 	//SVectorStream<SVector<bool>> vs(wikiDocidFile, wikiSignatureFile, wikiSignatureLength);
-	// change by fantao at 2015-8-19;
-	SVectorStream<SVector<double>> vs(doc2vecFile, vectorLength);
 
     // insert from stream
     boost::timer::auto_cpu_timer insert("inserting into streaming EM-tree: %w seconds\n");
     insert.start();
     size_t read = emtree->insert(vs);
     insert.stop();
-    cout << read << " vectors streamed from disk" << endl;
+    cout << read << " vectors streamed" << endl;
     insert.report();
+    cout << "input stalled for " << emtree->getInputStallSeconds()
+            << " seconds waiting for data" << endl;
 
     // prune
     cout << "pruning" << endl;
@@ -169,7 +217,102 @@ void streamingEMTreeInsertPruneReport(StreamingEMTree_t* emtree, char * doc2vecF
     report(emtree);
 }
 
-void streamingEMTree(char * doc2vecFile, size_t vectorLength, int m, int d) {
+template <typename STREAMINGEMTREE>
+void streamingEMTreeInsertPruneReport(STREAMINGEMTREE* emtree, const string& doc2vecFile, size_t vectorLength) {
+    // open files, binary vector files are memory mapped instead of parsed
+    if (isVectorFile(doc2vecFile)) {
+        MappedSVectorStream<vecType> vs(doc2vecFile, vectorLength);
+        streamingEMTreeInsertPruneReport(emtree, vs);
+    } else {
+        // IDs are only needed when writing clusters
+        SVectorStream<vecType> vs(doc2vecFile, vectorLength, -1, NULL);
+        streamingEMTreeInsertPruneReport(emtree, vs);
+    }
+}
+
+void reportCache(const CachedSVectorStream<vecType>& vs) {
+    if (vs.isCached()) {
+        cout << "replayed " << vs.cachedVectors() << " vectors from a "
+                << vs.cachedBytes() / (1024 * 1024) << " MB cache in "
+                << vs.passSeconds() << " seconds, saved "
+                << vs.firstPassSeconds() - vs.passSeconds()
+                << " seconds of reading and parsing" << endl;
+    } else if (vs.isSpilled()) {
+        double mb = vs.spilledBytes() / (1024.0 * 1024.0);
+        cout << "read " << vs.spilledVectors() << " vectors from the spill file in "
+                << vs.passSeconds() << " seconds (" << mb / vs.passSeconds()
+                << " MB/s), saved " << vs.firstPassSeconds() - vs.passSeconds()
+                << " seconds of reading and parsing" << endl;
+    } else if (vs.isOverBudget()) {
+        cout << "the data does not fit in the cache memory budget, "
+                << "reading from disk in every iteration" << endl;
+    } else {
+        cout << "read and parsed the data in " << vs.passSeconds()
+                << " seconds while filling the cache" << endl;
+    }
+}
+
+/**
+ * Trains a product quantizer with codes of codeBytes on a sample of a
+ * doc2vec text file.
+ */
+unique_ptr<ProductQuantizer<vecType>> trainQuantizer(const string& doc2vecFile,
+        size_t vectorLength, size_t codeBytes) {
+    vector<vecType*> sample;
+    loadSubset_doc2vec(doc2vecFile, vectorLength, sample, 10000);
+    unique_ptr<ProductQuantizer<vecType>> quantizer(
+            new ProductQuantizer<vecType>(vectorLength, codeBytes));
+    {
+        boost::timer::auto_cpu_timer train("training product quantizer: %w seconds\n");
+        quantizer->train(sample);
+    }
+    cout << "caching " << codeBytes << " byte codes instead of "
+            << vectorLength * sizeof (vecType::value_type) << " byte vectors" << endl;
+    Utils::purge(sample);
+    return quantizer;
+}
+
+/**
+ * How streamingEMTree() reads its input.
+ */
+struct StreamingOptions {
+    StreamingOptions() : cacheBudget(0), pqBytes(0), beamWidth(1), readSize(1000), maxTokens(1024),
+            prefetchChunks(2) { }
+
+    // When it is not 0, a doc2vec text file is kept in memory after the first
+    // iteration if it fits in this many bytes.
+    size_t cacheBudget;
+
+    // When it is not empty, a doc2vec text file that does not fit in
+    // cacheBudget is copied to this binary scratch file during the first
+    // iteration and read from it afterwards.
+    string spillFile;
+
+    // When it is not 0, the cache holds product quantized codes of this many
+    // bytes per vector instead of the values, see ProductQuantizer.h.
+    size_t pqBytes;
+
+    // When it is not empty, the tree is loaded from this tree file instead of
+    // being initialized with TSVQ.
+    string loadTree;
+
+    // When it is not empty, the tree is saved to this tree file after every
+    // iteration and at the end.
+    string saveTree;
+
+    // See StreamingEMTree::setBeamWidth().
+    int beamWidth;
+
+    // See StreamingEMTree::setReadSize(), setMaxTokens() and
+    // setPrefetchChunks().
+    int readSize;
+    int maxTokens;
+    int prefetchChunks;
+};
+
+template <typename TSVQ, typename STREAMINGEMTREE>
+void streamingEMTree(const string& doc2vecFile, size_t vectorLength, int m, int d,
+        const StreamingOptions& options = StreamingOptions()) {
     // initialize TBB
     const bool parallel = true;
     if (parallel) {
@@ -180,14 +323,42 @@ void streamingEMTree(char * doc2vecFile, size_t vectorLength, int m, int d) {
 
     // streaming EMTree
     const int maxIters = 100;
-    StreamingEMTree_t* emtree = streamingEMTreeInit(doc2vecFile, vectorLength, m, d);
+    STREAMINGEMTREE* emtree = options.loadTree.empty()
+            ? streamingEMTreeInit<TSVQ, STREAMINGEMTREE>(doc2vecFile, vectorLength, m, d)
+            : streamingEMTreeLoad<STREAMINGEMTREE>(options.loadTree, vectorLength);
+    emtree->setReadSize(options.readSize);
+    emtree->setMaxTokens(options.maxTokens);
+    emtree->setPrefetchChunks(options.prefetchChunks);
+    emtree->setBeamWidth(options.beamWidth);
     cout << endl << "Streaming EM-tree:" << endl;
+    unique_ptr<ProductQuantizer<vecType>> quantizer;
+    unique_ptr<CachedSVectorStream<vecType>> cache;
+    bool cached = options.cacheBudget > 0 || !options.spillFile.empty();
+    if (cached && isVectorFile(doc2vecFile)) {
+        cout << "binary vector files are memory mapped and not cached" << endl;
+    } else if (cached) {
+        cache.reset(new CachedSVectorStream<vecType>(doc2vecFile, vectorLength,
+                options.cacheBudget, options.spillFile));
+        if (options.pqBytes > 0) {
+            quantizer = trainQuantizer(doc2vecFile, vectorLength, options.pqBytes);
+            cache->setQuantizer(quantizer.get());
+        }
+    }
     for (int i = 0; i < maxIters - 1; i++) {
         cout << "ITERATION " << i << endl;
-        streamingEMTreeInsertPruneReport(emtree, doc2vecFile, vectorLength);
+        if (cache) {
+            streamingEMTreeInsertPruneReport(emtree, *cache);
+            reportCache(*cache);
+            cache->rewind();
+        } else {
+            streamingEMTreeInsertPruneReport(emtree, doc2vecFile, vectorLength);
+        }
         {
             boost::timer::auto_cpu_timer update("update streaming EM-tree: %w seconds\n");
             emtree->update();
+            if (!options.saveTree.empty()) {
+                emtree->save(options.saveTree);
+            }
             emtree->clearAccumulators();
         }
         cout << "-----" << endl << endl;
@@ -201,7 +372,211 @@ void streamingEMTree(char * doc2vecFile, size_t vectorLength, int m, int d) {
     }
 
     // last iteration writes cluster assignments and does not update accumulators
-    insertWriteClusters(emtree, doc2vecFile, vectorLength);
+    if (cache) {
+        insertWriteClusters(emtree, *cache);
+    } else {
+        insertWriteClusters(emtree, doc2vecFile, vectorLength);
+    }
+    if (!options.saveTree.empty()) {
+        boost::timer::auto_cpu_timer save("saving streaming EM-tree: %w seconds\n");
+        emtree->save(options.saveTree);
+        cout << "saved streaming EM-tree to " << options.saveTree << endl;
+    }
+}
+
+/**
+ * Builds a streaming EM-tree of bit signatures by clustering a sample of
+ * signatureFile with TSVQ, like streamingEMTreeInit() does for vectors.
+ */
+template <typename TSVQ, typename STREAMINGEMTREE>
+STREAMINGEMTREE* streamingEMTreeInit(const string& idFile, const string& signatureFile,
+        size_t signatureLength, int m, int depth) {
+    vector<SVector<bool>*> signatures;
+    const size_t maxSampleCount = 10000;
+    {
+        boost::timer::auto_cpu_timer load("loading signatures: %w seconds\n");
+        SVectorStream<SVector<bool>> vs(idFile, signatureFile, signatureLength,
+                maxSampleCount);
+        vs.read(maxSampleCount, &signatures);
+    }
+    if (signatures.empty()) {
+        throw runtime_error("no signatures in " + signatureFile);
+    }
+
+    const int maxiter = 10;
+    TSVQ tsvq(m, depth, maxiter);
+    {
+        boost::timer::auto_cpu_timer load("cluster subset using TSVQ: %w seconds\n");
+        tsvq.cluster(signatures);
+    }
+
+    cout << "initializing streaming EM-tree based on TSVQ subset sample" << endl;
+    cout << "TSVQ iterations = " << maxiter << endl;
+    auto tree = new STREAMINGEMTREE(tsvq.getMWayTree());
+    Utils::purge(signatures);
+    return tree;
+}
+
+/**
+ * Clusters bit signatures by Hamming distance, for example, those written by
+ * a RandomProjection. signatureFile holds signatureLength / 8 bytes for each
+ * line of idFile. Clusters are updated with a majority vote of their
+ * signatures, see majorityBitAccumulatorPrototype.
+ *
+ * Tree files hold dense vectors, so the caching, quantizing, saving and
+ * loading options of streamingEMTree() do not apply.
+ */
+template <typename TSVQ, typename STREAMINGEMTREE>
+void streamingEMTree(const string& idFile, const string& signatureFile,
+        size_t signatureLength, int m, int d,
+        const StreamingOptions& options = StreamingOptions()) {
+    tbb::task_scheduler_init init_parallel;
+
+    const int maxIters = 100;
+    unique_ptr<STREAMINGEMTREE> emtree(streamingEMTreeInit<TSVQ, STREAMINGEMTREE>(
+            idFile, signatureFile, signatureLength, m, d));
+    emtree->setReadSize(options.readSize);
+    emtree->setMaxTokens(options.maxTokens);
+    emtree->setPrefetchChunks(options.prefetchChunks);
+    emtree->setBeamWidth(options.beamWidth);
+    cout << endl << "Streaming EM-tree:" << endl;
+    for (int i = 0; i < maxIters - 1; i++) {
+        cout << "ITERATION " << i << endl;
+        {
+            SVectorStream<SVector<bool>> vs(idFile, signatureFile, signatureLength);
+            streamingEMTreeInsertPruneReport(emtree.get(), vs);
+        }
+        {
+            boost::timer::auto_cpu_timer update("update streaming EM-tree: %w seconds\n");
+            emtree->update();
+            emtree->clearAccumulators();
+        }
+        cout << "-----" << endl << endl;
+        if (emtree->getConverage()) {
+            cout << "-------clusters converage------" << endl;
+            break;
+        }
+    }
+
+    // last iteration writes cluster assignments and does not update accumulators
+    SVectorStream<SVector<bool>> vs(idFile, signatureFile, signatureLength);
+    insertWriteClusters(emtree.get(), vs);
+}
+
+/**
+ * Writes assignments from FrozenTree as lines of "id leaf distance path",
+ * where leaf is the key of the leaf cluster in the tree file and path is the
+ * keys from the root to the leaf separated by '/'.
+ */
+template <typename TREE, typename ID>
+void writeAssignments(const TREE& tree,
+        const vector<typename TREE::Assignment>& assignments, ID id) {
+    vector<uint64_t> path;
+    for (size_t i = 0; i < assignments.size(); i++) {
+        tree.path(assignments[i].leaf, &path);
+        IdTable::Range range = id(i);
+        cout.write(range.first, range.second - range.first);
+        cout << " " << assignments[i].leaf << " " << assignments[i].distance << " ";
+        for (size_t level = 0; level < path.size(); level++) {
+            cout << (level ? "/" : "") << path[level];
+        }
+        cout << "\n";
+    }
+    cout.flush();
+}
+
+/**
+ * Assigns the vectors in a binary vector file to the leaf clusters of a
+ * frozen tree a batch at a time.
+ */
+template <typename TREE>
+void assignVectorFile(const TREE& tree, const string& input, const size_t batchSize) {
+    MappedSVectorStream<vecType> vs(input, tree.dimensions());
+    vector<typename TREE::Assignment> assignments;
+    while (auto chunk = vs.readChunk(batchSize)) {
+        vs.parseChunk(chunk);
+        tree.assign(chunk->vectors, &assignments);
+        writeAssignments(tree, assignments, [&](size_t i) {
+            uint64_t ordinal = chunk->vectors[i]->getID();
+            const char* id = vs.ids().data(ordinal);
+            return IdTable::Range(id, id + vs.ids().length(ordinal));
+        });
+        vs.freeChunk(chunk);
+    }
+}
+
+/**
+ * Assigns doc2vec text read from in to the leaf clusters of a frozen tree.
+ * Batches of up to batchSize lines are parsed and assigned in parallel. A
+ * batch is assigned as soon as no more input is buffered, so vectors piped in
+ * one at a time are answered straight away.
+ */
+template <typename TREE>
+void assignDoc2Vec(const TREE& tree, std::istream& in, const size_t batchSize) {
+    Doc2VecParser parser(tree.dimensions());
+    vector<string> lines;
+    vector<size_t> lineNumbers;
+    vector<vecType> storage(batchSize, vecType(tree.dimensions()));
+    vector<vecType*> batch;
+    vector<IdTable::Range> ids(batchSize);
+    vector<typename TREE::Assignment> assignments;
+    size_t lineNumber = 0;
+    string line;
+    for (bool more = true; more; ) {
+        lines.clear();
+        lineNumbers.clear();
+        while (lines.size() < batchSize && (more = bool(getline(in, line)))) {
+            ++lineNumber;
+            if (!Doc2VecParser::isBlank(line.data(), line.data() + line.size())) {
+                lines.push_back(line);
+                lineNumbers.push_back(lineNumber);
+            }
+            if (in.rdbuf()->in_avail() <= 0) {
+                break;
+            }
+        }
+        if (lines.empty()) {
+            continue;
+        }
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, lines.size(), 16),
+                [&](const tbb::blocked_range<size_t>& range) {
+                    for (size_t i = range.begin(); i != range.end(); ++i) {
+                        const char* begin = lines[i].c_str();
+                        parser.parse(begin, begin + lines[i].size(), &storage[i],
+                                lineNumbers[i], &ids[i]);
+                    }
+                });
+        batch.clear();
+        for (size_t i = 0; i < lines.size(); i++) {
+            batch.push_back(&storage[i]);
+        }
+        tree.assign(batch, &assignments);
+        writeAssignments(tree, assignments, [&](size_t i) { return ids[i]; });
+    }
+}
+
+/**
+ * Assigns the vectors in input, a doc2vec text file, a binary vector file or
+ * "-" for doc2vec text on stdin, to the leaf clusters of a tree saved by
+ * StreamingEMTree::save(). The tree is not updated.
+ */
+template <typename OPTIMIZER>
+void assignFrozenTree(const string& treeFile, const string& input,
+        const size_t batchSize) {
+    MappedTreeFile file(treeFile);
+    FrozenTree<vecType, OPTIMIZER> tree(file);
+    std::ios::sync_with_stdio(false);
+    if (input == "-") {
+        assignDoc2Vec(tree, std::cin, batchSize);
+    } else if (isVectorFile(input)) {
+        assignVectorFile(tree, input, batchSize);
+    } else {
+        ifstream in(input);
+        if (!in) {
+            throw runtime_error("failed to open " + input);
+        }
+        assignDoc2Vec(tree, in, batchSize);
+    }
 }
 
 #endif
@@ -0,0 +1,104 @@
+/**
+ * BitCounter counts how many of the SVector<bool>s added to it have each bit
+ * set. StreamingEMTree uses it as the per thread accumulator of a leaf when
+ * clustering bit vectors, where adding an object used to unpack one bit at a
+ * time with SVector<bool>::at().
+ *
+ * Bits are added to 16 bit counters with VectorKernels::addBits(), which
+ * handles 16 or 32 bits per instruction. The 16 bit counters are moved into
+ * 32 bit counters every 65535 objects, before they can overflow, so the
+ * counts are exact.
+ *
+ * It has the ACCUMULATOR operations StreamingEMTree needs to reduce it,
+ * construction with the number of dimensions, setAll(0), size() and reading
+ * a dimension with operator[].
+ *
+ * For example,
+ *      BitCounter counter(256);
+ *      counter.add(*signature);
+ *      uint64_t setInDimension3 = counter[3];
+ */
+
+#ifndef BITCOUNTER_H
+#define	BITCOUNTER_H
+
+#include "StdIncludes.h"
+#include "SVector.h"
+#include "VectorKernels.h"
+
+namespace lmw {
+
+class BitCounter {
+public:
+    explicit BitCounter(const size_t dimensions) :
+        _dimensions(dimensions),
+        _blocks((dimensions + W_SIZE - 1) / W_SIZE),
+        _narrow(_blocks * W_SIZE, 0),
+        _wide(_blocks * W_SIZE, 0),
+        _pending(0) { }
+
+    void add(const SVector<bool>& object) {
+        if (object.getNumBlocks() != _blocks) {
+            throw runtime_error("bit vector has the wrong number of dimensions to count");
+        }
+        if (_pending == MAX_PENDING) {
+            flush();
+        }
+        VectorKernels::addBits(object.getData(), _blocks, &_narrow[0]);
+        _pending++;
+    }
+
+    /**
+     * The number of objects with bit i set.
+     */
+    uint64_t operator[](const size_t i) const {
+        return uint64_t(_wide[i]) + _narrow[i];
+    }
+
+    size_t size() const {
+        return _dimensions;
+    }
+
+    void setAll(const int value) {
+        std::fill(_narrow.begin(), _narrow.end(), 0);
+        std::fill(_wide.begin(), _wide.end(), value);
+        _pending = 0;
+    }
+
+private:
+    void flush() {
+        for (size_t i = 0; i < _narrow.size(); i++) {
+            _wide[i] += _narrow[i];
+            _narrow[i] = 0;
+        }
+        _pending = 0;
+    }
+
+    // the most objects the 16 bit counters can hold
+    static const uint32_t MAX_PENDING = 65535;
+
+    size_t _dimensions;
+    size_t _blocks;
+    vector<uint16_t> _narrow;
+    vector<uint32_t> _wide;
+    uint32_t _pending;
+};
+
+/**
+ * The per thread accumulator of StreamingEMTree for vectors of type T. Bit
+ * vectors are counted by a BitCounter, and are only added to ACCUMULATOR
+ * when the threads are reduced.
+ */
+template <typename T, typename ACCUMULATOR>
+struct ShardAccumulator {
+    typedef ACCUMULATOR type;
+};
+
+template <typename ACCUMULATOR>
+struct ShardAccumulator<SVector<bool>, ACCUMULATOR> {
+    typedef BitCounter type;
+};
+
+} // namespace lmw
+
+#endif	/* BITCOUNTER_H */
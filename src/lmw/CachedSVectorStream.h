@@ -0,0 +1,417 @@
+/**
+ * CachedSVectorStream reads a doc2vec text file like SVectorStream, and keeps
+ * the parsed vectors in one contiguous block of memory during the first pass.
+ * After rewind() the following passes replay the vectors from memory without
+ * reading or parsing the file again.
+ *
+ * If the vectors do not fit in the memory budget and a spill file is given,
+ * the first pass writes a binary copy of the parsed vectors to the spill file
+ * instead (see VectorFile.h). The following passes read it sequentially with
+ * ReadSVectorStream, so they are limited by the bandwidth of the disk rather
+ * than by parsing text. The spill file is deleted with the stream. Without a
+ * spill file the cache is discarded and every pass reads the text from disk.
+ *
+ * With a ProductQuantizer the cache holds a code per vector instead of its
+ * values, so many times more vectors fit in the budget. Replayed passes
+ * decode the codes, so they see the quantized approximation of each vector.
+ *
+ * It follows the VectorStream concept in SVectorStream.h, so it can be passed
+ * to StreamingEMTree::insert() and visit(). Vectors from a replayed pass point
+ * into the cache, so changing them, for example, when the OPTIMIZER prepares
+ * them, changes the cache.
+ *
+ * For example,
+ *      CachedSVectorStream<SVector<float>> vs("doc2vec.txt", 200, 1 << 30,
+ *              "/scratch/doc2vec.spill");
+ *      for (int i = 0; i < iterations; i++) {
+ *          emtree->insert(vs);
+ *          vs.rewind();
+ *      }
+ */
+
+#ifndef CACHEDSVECTORSTREAM_H
+#define	CACHEDSVECTORSTREAM_H
+
+#include "StdIncludes.h"
+#include "SVector.h"
+#include "SVectorStream.h"
+#include "ProductQuantizer.h"
+#include "tbb/mutex.h"
+
+namespace lmw {
+
+template <typename SVECTOR>
+class CachedSVectorStream;
+
+template <typename T>
+class CachedSVectorStream<SVector<T>> {
+public:
+    /**
+     * @param file A doc2vec text file.
+     * @param vectorLength The length of a vector.
+     * @param memoryBudget The maximum size of the cache in bytes.
+     * @param spillFile A scratch file for vectors that do not fit in the
+     *                  memory budget, or empty to read the text every pass.
+     */
+    CachedSVectorStream(const string& file, const size_t vectorLength,
+            const size_t memoryBudget, const string& spillFile = "")
+            : _file(file),
+            _vectorLength(vectorLength),
+            _memoryBudget(memoryBudget),
+            _spillFile(spillFile),
+            _stream(new SVectorStream<SVector<T>>(file, vectorLength, -1, &_ids)),
+            _spilledVectors(0),
+            _quantizer(NULL),
+            _state(FILLING),
+            _endOfStream(false),
+            _position(0),
+            _readNanoseconds(0),
+            _parseNanoseconds(0),
+            _firstPassNanoseconds(0) {
+    }
+
+    /**
+     * Caches codes of a trained quantizer instead of values. The quantizer
+     * must outlive the stream, and it must be set before the first read().
+     */
+    void setQuantizer(const ProductQuantizer<SVector<T>>* quantizer) {
+        if (_state != FILLING || cachedVectors() > 0) {
+            throw runtime_error("the quantizer must be set before the cache is filled");
+        }
+        if (!quantizer->isTrained() || quantizer->dimensions() != _vectorLength) {
+            throw runtime_error("the quantizer must be trained on vectors of the same length");
+        }
+        _quantizer = quantizer;
+    }
+
+    ~CachedSVectorStream() {
+        _spill.reset();
+        if (_spillWriter || _state == READING_SPILL) {
+            _spillWriter.reset();
+            std::remove(_spillFile.c_str());
+        }
+    }
+
+    size_t read(size_t n, vector<SVector<T>*>* data) {
+        for (;;) {
+            SVectorChunk<SVector<T>>* chunk = readChunk(n);
+            if (!chunk) {
+                return 0;
+            }
+            try {
+                parseChunk(chunk);
+            } catch (...) {
+                freeChunk(chunk);
+                throw;
+            }
+            for (auto view : chunk->vectors) {
+                data->push_back(new SVector<T>(*view));
+            }
+            size_t read = chunk->vectors.size();
+            freeChunk(chunk);
+            if (read > 0) {
+                return read;
+            }
+        }
+    }
+
+    void free(vector<SVector<T>*>* data) {
+        for (auto vector : *data) {
+            delete vector;
+        }
+    }
+
+    SVectorChunk<SVector<T>>* readChunk(size_t n) {
+        boost::timer::cpu_timer timer;
+        SVectorChunk<SVector<T>>* chunk;
+        if (_state == REPLAYING) {
+            chunk = replayChunk(n);
+        } else if (_state == READING_SPILL) {
+            chunk = _spill->readChunk(n);
+        } else {
+            chunk = _stream->readChunk(n);
+            _endOfStream = chunk == NULL;
+        }
+        _readNanoseconds += timer.elapsed().wall;
+        return chunk;
+    }
+
+    /**
+     * Parses a chunk read from disk and copies its vectors into the cache or
+     * the spill file. Chunks replayed from the cache are already parsed.
+     */
+    void parseChunk(SVectorChunk<SVector<T>>* chunk) const {
+        if (_state == REPLAYING) {
+            return;
+        }
+        boost::timer::cpu_timer timer;
+        if (_state == READING_SPILL) {
+            _spill->parseChunk(chunk);
+        } else {
+            _stream->parseChunk(chunk);
+            append(chunk->vectors);
+        }
+        _parseNanoseconds += timer.elapsed().wall;
+    }
+
+    /**
+     * Chunks go back to the stream that read them.
+     */
+    void freeChunk(SVectorChunk<SVector<T>>* chunk) {
+        if (_state == REPLAYING) {
+            _pool.recycle(chunk);
+        } else if (_state == READING_SPILL) {
+            _spill->freeChunk(chunk);
+        } else {
+            _stream->freeChunk(chunk);
+        }
+    }
+
+    /**
+     * The IDs of the current pass.
+     */
+    const IdTable& ids() const {
+        return _state == READING_SPILL ? _spill->ids() : _ids;
+    }
+
+    /**
+     * Starts the next pass over the stream. If the previous pass read the
+     * whole file into the cache or the spill file, the next pass reads it from
+     * there. Otherwise the file is opened again.
+     */
+    void rewind() {
+        if (_state == FILLING && _endOfStream) {
+            _state = REPLAYING;
+            _firstPassNanoseconds = _readNanoseconds + _parseNanoseconds;
+        } else if (_state == SPILLING && _endOfStream) {
+            _spillWriter->close();
+            _spillWriter.reset();
+            _stream.reset();
+            _ids.clear();
+            _spill.reset(new ReadSVectorStream<SVector<T>>(_spillFile, _vectorLength));
+            _state = READING_SPILL;
+            _firstPassNanoseconds = _readNanoseconds + _parseNanoseconds;
+        } else if (_state == READING_SPILL) {
+            _spill.reset(new ReadSVectorStream<SVector<T>>(_spillFile, _vectorLength));
+        } else if (_state != REPLAYING) {
+            // a partial pass or the budget was exceeded
+            _stream.reset();
+            _ids.clear();
+            _stream.reset(new SVectorStream<SVector<T>>(_file, _vectorLength, -1, &_ids));
+            if (_state == SPILLING) {
+                _spillWriter.reset();
+                std::remove(_spillFile.c_str());
+                _spilledVectors = 0;
+                _state = FILLING;
+            } else if (_state == FILLING) {
+                clearCache();
+            }
+        }
+        _endOfStream = false;
+        _position = 0;
+        _readNanoseconds = 0;
+        _parseNanoseconds = 0;
+    }
+
+    /**
+     * Is the current pass replayed from memory?
+     */
+    bool isCached() const {
+        return _state == REPLAYING;
+    }
+
+    /**
+     * Is the current pass read from the spill file?
+     */
+    bool isSpilled() const {
+        return _state == READING_SPILL;
+    }
+
+    /**
+     * Was the cache discarded because it exceeded the memory budget?
+     */
+    bool isOverBudget() const {
+        return _state == STREAMING;
+    }
+
+    size_t cachedBytes() const {
+        return _values.size() * sizeof (T) + _codes.size()
+                + _ordinals.size() * sizeof (uint64_t) + _ids.bytes();
+    }
+
+    size_t cachedVectors() const {
+        return _ordinals.size();
+    }
+
+    size_t spilledVectors() const {
+        return _spilledVectors;
+    }
+
+    /**
+     * The size of the vector data in the spill file.
+     */
+    size_t spilledBytes() const {
+        return _spilledVectors * _vectorLength * sizeof (T);
+    }
+
+    /**
+     * The seconds spent reading and parsing in the current pass. Parsing
+     * time is summed over all threads.
+     */
+    double passSeconds() const {
+        return (_readNanoseconds + _parseNanoseconds) / 1e9;
+    }
+
+    /**
+     * The seconds spent reading and parsing in the pass that filled the
+     * cache. Each replayed pass saves this time minus passSeconds().
+     */
+    double firstPassSeconds() const {
+        return _firstPassNanoseconds / 1e9;
+    }
+
+private:
+    enum State {
+        FILLING, // reading from disk and copying into the cache
+        REPLAYING, // reading from the cache
+        SPILLING, // reading from disk and writing to the spill file
+        READING_SPILL, // reading from the spill file
+        STREAMING // reading from disk without a cache
+    };
+
+    SVectorChunk<SVector<T>>* replayChunk(const size_t n) {
+        size_t count = std::min(n, cachedVectors() - _position);
+        if (count == 0) {
+            return NULL;
+        }
+        auto chunk = _pool.allocate();
+        chunk->records = count;
+        chunk->views.reserve(count);
+        if (_quantizer) {
+            chunk->arena.resize(count * _vectorLength * sizeof (T));
+        }
+        for (size_t i = _position; i < _position + count; i++) {
+            T* values;
+            if (_quantizer) {
+                values = reinterpret_cast<T*>(&chunk->arena[0]) + (i - _position) * _vectorLength;
+                _quantizer->decode(&_codes[i * _quantizer->codeBytes()], values);
+            } else {
+                values = &_values[i * _vectorLength];
+            }
+            chunk->views.emplace_back(values, _vectorLength);
+            chunk->views.back().setID(_ordinals[i]);
+            chunk->vectors.push_back(&chunk->views.back());
+        }
+        _position += count;
+        return chunk;
+    }
+
+    /**
+     * Copies vectors into the cache or the spill file. Chunks are parsed in
+     * parallel, so the cache is locked. The order of vectors in the cache
+     * does not matter. Their IDs are already in _ids.
+     */
+    void append(const vector<SVector<T>*>& vectors) const {
+        tbb::mutex::scoped_lock lock(_mutex);
+        if (_state == SPILLING) {
+            spill(vectors);
+            return;
+        }
+        if (_state != FILLING) {
+            return;
+        }
+        size_t vectorBytes = _quantizer ? _quantizer->codeBytes()
+                : _vectorLength * sizeof (T);
+        size_t required = cachedBytes() + vectors.size()
+                * (vectorBytes + sizeof (uint64_t));
+        if (required > _memoryBudget) {
+            if (_spillFile.empty()) {
+                _state = STREAMING;
+                clearCache();
+            } else {
+                startSpill();
+                spill(vectors);
+            }
+            return;
+        }
+        for (auto vector : vectors) {
+            if (_quantizer) {
+                _codes.resize(_codes.size() + _quantizer->codeBytes());
+                _quantizer->encode(vector->begin(),
+                        &_codes[_codes.size() - _quantizer->codeBytes()]);
+            } else {
+                _values.insert(_values.end(), vector->begin(), vector->end());
+            }
+            _ordinals.push_back(vector->getID());
+        }
+    }
+
+    /**
+     * Moves the vectors cached so far into a new spill file.
+     */
+    void startSpill() const {
+        _spillWriter.reset(new VectorFileWriter(_spillFile, _vectorLength,
+                static_cast<VectorFileHeader::Type>(VectorFileHeader::typeOf<T>())));
+        vector<T> decoded(_quantizer ? _vectorLength : 0);
+        for (size_t i = 0; i < cachedVectors(); i++) {
+            if (_quantizer) {
+                // the values read before spilling are only kept as codes
+                _quantizer->decode(&_codes[i * _quantizer->codeBytes()], &decoded[0]);
+                _spillWriter->write(_ids.get(_ordinals[i]), &decoded[0]);
+            } else {
+                _spillWriter->write(_ids.get(_ordinals[i]), &_values[i * _vectorLength]);
+            }
+        }
+        _spilledVectors = cachedVectors();
+        clearCache();
+        _state = SPILLING;
+    }
+
+    void spill(const vector<SVector<T>*>& vectors) const {
+        for (auto vector : vectors) {
+            _spillWriter->write(_ids.get(vector->getID()), *vector);
+        }
+        _spilledVectors += vectors.size();
+    }
+
+    /**
+     * Frees the cached values. The IDs are kept until rewind() as they
+     * belong to the current pass.
+     */
+    void clearCache() const {
+        vector<T>().swap(_values);
+        vector<uint8_t>().swap(_codes);
+        vector<uint64_t>().swap(_ordinals);
+    }
+
+    string _file;
+    size_t _vectorLength;
+    size_t _memoryBudget;
+    string _spillFile;
+    IdTable _ids; // filled by _stream
+    unique_ptr<SVectorStream<SVector<T>>> _stream;
+    ChunkPool<SVector<T>> _pool; // chunks replayed from the cache
+    unique_ptr<ReadSVectorStream<SVector<T>>> _spill;
+    mutable unique_ptr<VectorFileWriter> _spillWriter;
+    mutable size_t _spilledVectors;
+    const ProductQuantizer<SVector<T>>* _quantizer;
+
+    // The cache, vector i has values _values[i * _vectorLength] onwards, or
+    // code _codes[i * codeBytes()] onwards with a quantizer, and ordinal
+    // _ordinals[i] in _ids.
+    mutable vector<T> _values;
+    mutable vector<uint8_t> _codes;
+    mutable vector<uint64_t> _ordinals;
+    mutable tbb::mutex _mutex;
+    mutable atomic<State> _state;
+
+    bool _endOfStream;
+    size_t _position; // the next vector to replay
+    uint64_t _readNanoseconds;
+    mutable atomic<uint64_t> _parseNanoseconds;
+    uint64_t _firstPassNanoseconds;
+};
+
+} // namespace lmw
+
+#endif	/* CACHEDSVECTORSTREAM_H */
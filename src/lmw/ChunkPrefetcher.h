@@ -0,0 +1,200 @@
+/**
+ * ChunkPrefetcher reads chunks from a VectorStream on its own I/O thread, so
+ * the next chunks are read from disk while the current ones are parsed and
+ * processed. At most capacity chunks are read ahead, 2 is double buffering.
+ * A capacity of 0 reads each chunk when it is asked for without a thread.
+ *
+ * Only the I/O thread calls readChunk() on the stream, so streams do not need
+ * to be thread safe. next() is called by the serial input filter of a TBB
+ * pipeline, see StreamingEMTree::processStream(). The time it spends waiting
+ * for a chunk is reported as the stall time of the pipeline.
+ *
+ * Chunks returned by next() are given back with free(), which may be called
+ * from any thread. Chunks that were not given back when the prefetcher is
+ * destroyed, for example, because the pipeline threw, are freed then.
+ *
+ * For example,
+ *      ChunkPrefetcher<SVectorStream<SVector<float>>, SVector<float>>
+ *              prefetcher(vs, 1000, -1, 2);
+ *      while (auto chunk = prefetcher.next()) {
+ *          vs.parseChunk(chunk);
+ *          process(chunk->vectors);
+ *          prefetcher.free(chunk);
+ *      }
+ */
+
+#ifndef CHUNKPREFETCHER_H
+#define	CHUNKPREFETCHER_H
+
+#include "StdIncludes.h"
+#include "SVectorStream.h"
+#include "tbb/concurrent_queue.h"
+#include "tbb/spin_mutex.h"
+
+#include <exception>
+#include <thread>
+#include <unordered_set>
+
+namespace lmw {
+
+template <typename VECTORSTREAM, typename T>
+class ChunkPrefetcher {
+public:
+    typedef SVectorChunk<T> Chunk;
+
+    // maxToRead to read the whole stream
+    static const size_t NO_LIMIT = size_t(-1);
+
+    /**
+     * @param vs The stream to read from.
+     * @param chunkSize The number of records to read in each chunk.
+     * @param maxToRead The maximum number of records to read. NO_LIMIT, or
+     *                  -1, indicates to read all.
+     * @param capacity The number of chunks to read ahead.
+     */
+    ChunkPrefetcher(VECTORSTREAM& vs, const size_t chunkSize,
+            const size_t maxToRead, const size_t capacity)
+            : _vs(vs),
+            _chunkSize(chunkSize),
+            _maxToRead(maxToRead),
+            _capacity(capacity),
+            _totalRead(0),
+            _stop(false),
+            _finished(false),
+            _stallNanoseconds(0) {
+        if (_capacity > 0) {
+            _queue.set_capacity(_capacity);
+            _thread = std::thread(&ChunkPrefetcher::run, this);
+        }
+    }
+
+    /**
+     * Stops the I/O thread and frees the chunks it read ahead, and the chunks
+     * returned by next() that were not given back with free().
+     */
+    ~ChunkPrefetcher() {
+        if (_capacity > 0 && !_finished) {
+            _stop = true;
+            Chunk* chunk;
+            do {
+                _queue.pop(chunk);
+                if (chunk) {
+                    _vs.freeChunk(chunk);
+                }
+            } while (chunk);
+        }
+        if (_thread.joinable()) {
+            _thread.join();
+        }
+        for (Chunk* chunk : _outstanding) {
+            _vs.freeChunk(chunk);
+        }
+    }
+
+    /**
+     * Returns the next chunk or NULL at the end of the stream. An exception
+     * thrown while reading is rethrown here.
+     */
+    Chunk* next() {
+        if (_finished) {
+            return NULL;
+        }
+        boost::timer::cpu_timer timer;
+        Chunk* chunk;
+        if (_capacity > 0) {
+            _queue.pop(chunk);
+        } else {
+            chunk = read();
+        }
+        _stallNanoseconds += timer.elapsed().wall;
+        if (chunk) {
+            Mutex::scoped_lock lock(_outstandingMutex);
+            _outstanding.insert(chunk);
+        } else {
+            _finished = true;
+            if (_thread.joinable()) {
+                _thread.join();
+            }
+            if (_error) {
+                std::rethrow_exception(_error);
+            }
+        }
+        return chunk;
+    }
+
+    /**
+     * Gives back a chunk returned by next() to the stream. It is thread safe.
+     */
+    void free(Chunk* chunk) {
+        {
+            Mutex::scoped_lock lock(_outstandingMutex);
+            _outstanding.erase(chunk);
+        }
+        _vs.freeChunk(chunk);
+    }
+
+    /**
+     * The seconds next() spent waiting for chunks to be read.
+     */
+    double stallSeconds() const {
+        return _stallNanoseconds / 1e9;
+    }
+
+private:
+    Chunk* read() {
+        if (_maxToRead != NO_LIMIT && _totalRead >= _maxToRead) {
+            return NULL;
+        }
+        size_t n = _chunkSize;
+        if (_maxToRead != NO_LIMIT) {
+            n = std::min(n, _maxToRead - _totalRead);
+        }
+        Chunk* chunk = _vs.readChunk(n);
+        if (chunk) {
+            _totalRead += chunk->records;
+        }
+        return chunk;
+    }
+
+    /**
+     * The I/O thread. The end of the stream, an error or a request to stop
+     * is signalled with a NULL chunk.
+     */
+    void run() {
+        try {
+            while (!_stop) {
+                Chunk* chunk = read();
+                if (!chunk) {
+                    break;
+                }
+                _queue.push(chunk);
+            }
+        } catch (...) {
+            _error = std::current_exception();
+        }
+        _queue.push(NULL);
+    }
+
+    typedef tbb::spin_mutex Mutex;
+
+    ChunkPrefetcher(const ChunkPrefetcher&);
+    ChunkPrefetcher& operator=(const ChunkPrefetcher&);
+
+    VECTORSTREAM& _vs;
+    size_t _chunkSize;
+    size_t _maxToRead;
+    size_t _capacity;
+    size_t _totalRead; // only used by the thread reading the stream
+    tbb::concurrent_bounded_queue<Chunk*> _queue;
+    std::thread _thread;
+    std::exception_ptr _error; // written by the I/O thread before its last push
+    atomic<bool> _stop;
+    bool _finished;
+    uint64_t _stallNanoseconds;
+    std::unordered_set<Chunk*> _outstanding; // returned by next() and not freed
+    Mutex _outstandingMutex;
+};
+
+} // namespace lmw
+
+#endif	/* CHUNKPREFETCHER_H */
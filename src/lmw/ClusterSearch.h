@@ -0,0 +1,172 @@
+/**
+ * ClusterSearch finds the k leaf clusters nearest to a query vector in an
+ * m-way tree, so a trained tree can be used as an approximate nearest
+ * centroid index. Where OPTIMIZER::nearest() returns the single nearest key,
+ * this returns a ranked list.
+ *
+ * The search is best first. A priority queue holds the nodes reached so far,
+ * ordered by the distance from the query to the key pointing at them, and the
+ * nearest one is expanded next. The keys of an expanded node of clusters are
+ * offered to the k nearest found so far. At most maxExpanded nodes are
+ * expanded, which bounds the number of distances calculated. A maxExpanded
+ * of the depth of the tree is about the cost of greedy descent, and larger
+ * values visit the clusters that greedy descent misses. The search continues
+ * past maxExpanded until k clusters are found or the tree is exhausted.
+ *
+ * In the trees built by EMTree, KTree and TSVQ the leaves hold the data
+ * vectors, so the clusters are the keys of the nodes above the leaves. In
+ * StreamingEMTree the leaves hold the clusters.
+ *
+ * For example,
+ *      vector<RankedCluster<SVector<float>>> ranked;
+ *      nearestClusters(emtree.getMWayTree(), optimizer, query, 10, 50, &ranked);
+ *      // ranked[0] is the nearest cluster found
+ */
+
+#ifndef CLUSTERSEARCH_H
+#define	CLUSTERSEARCH_H
+
+#include "StdIncludes.h"
+#include "Node.h"
+#include "tbb/blocked_range.h"
+#include "tbb/enumerable_thread_specific.h"
+#include "tbb/parallel_for.h"
+
+namespace lmw {
+
+template <typename KEY>
+struct RankedCluster {
+    const KEY* key;
+    double distance; // from the query to key
+};
+
+/**
+ * The state of a search, reused for every query of one thread.
+ */
+template <typename KEY, typename CACHE, typename OPTIMIZER>
+class ClusterSearch {
+public:
+    typedef Node<KEY, CACHE> NodeType;
+
+    /**
+     * dataInLeaves is true for trees where the leaves hold data vectors
+     * instead of clusters.
+     */
+    explicit ClusterSearch(const bool dataInLeaves = false) :
+            _dataInLeaves(dataInLeaves) { }
+
+    /**
+     * Puts the k nearest clusters below root into ranked, nearest first.
+     * DISTANCES implements void operator()(const NodeType* node, double* out)
+     * and calculates the distance from the query to every key of node.
+     */
+    template <typename DISTANCES>
+    void search(const NodeType* root, const size_t k, const size_t maxExpanded,
+            const OPTIMIZER& optimizer, const DISTANCES& distances,
+            vector<RankedCluster<KEY>>* ranked) {
+        // ranked is a heap with the farthest of the k at the front
+        auto nearerCluster = [&optimizer](const RankedCluster<KEY>& a,
+                const RankedCluster<KEY>& b) {
+            return optimizer.nearer(a.distance, b.distance);
+        };
+        // _frontier is a heap with the nearest node at the front
+        auto fartherNode = [&optimizer](const Candidate& a, const Candidate& b) {
+            return optimizer.nearer(b.distance, a.distance);
+        };
+        ranked->clear();
+        _frontier.clear();
+        if (k == 0) {
+            return;
+        }
+        _frontier.push_back({root, 0});
+        size_t expanded = 0;
+        while (!_frontier.empty() && (expanded < maxExpanded || ranked->size() < k)) {
+            std::pop_heap(_frontier.begin(), _frontier.end(), fartherNode);
+            const NodeType* node = _frontier.back().node;
+            _frontier.pop_back();
+            if (node->isEmpty()) {
+                continue;
+            }
+            _distances.resize(node->size());
+            distances(node, &_distances[0]);
+            ++expanded;
+            if (isClusterNode(node)) {
+                for (size_t i = 0; i < _distances.size(); i++) {
+                    RankedCluster<KEY> cluster = {node->getKey(i), _distances[i]};
+                    if (ranked->size() < k) {
+                        ranked->push_back(cluster);
+                        std::push_heap(ranked->begin(), ranked->end(), nearerCluster);
+                    } else if (optimizer.nearer(cluster.distance, ranked->front().distance)) {
+                        std::pop_heap(ranked->begin(), ranked->end(), nearerCluster);
+                        ranked->back() = cluster;
+                        std::push_heap(ranked->begin(), ranked->end(), nearerCluster);
+                    }
+                }
+            } else {
+                for (size_t i = 0; i < _distances.size(); i++) {
+                    _frontier.push_back({node->getChild(i), _distances[i]});
+                    std::push_heap(_frontier.begin(), _frontier.end(), fartherNode);
+                }
+            }
+        }
+        std::sort_heap(ranked->begin(), ranked->end(), nearerCluster);
+    }
+
+private:
+    struct Candidate {
+        const NodeType* node;
+        double distance; // from the query to the key pointing at node
+    };
+
+    bool isClusterNode(const NodeType* node) const {
+        return node->isLeaf() || (_dataInLeaves && node->getChild(0)->isLeaf());
+    }
+
+    bool _dataInLeaves;
+    vector<Candidate> _frontier;
+    vector<double> _distances;
+};
+
+/**
+ * Finds the k clusters nearest to object in a tree built by EMTree, KTree or
+ * TSVQ. object must have been prepared by OPTIMIZER::prepare().
+ */
+template <typename T, typename CACHE, typename OPTIMIZER>
+void nearestClusters(const Node<T, CACHE>* root, const OPTIMIZER& optimizer,
+        const T* object, const size_t k, const size_t maxExpanded,
+        vector<RankedCluster<T>>* ranked) {
+    ClusterSearch<T, CACHE, OPTIMIZER> search(true);
+    search.search(root, k, maxExpanded, optimizer,
+            [&](const Node<T, CACHE>* node, double* out) {
+                optimizer.distances(object, node->getKeys(), out);
+            }, ranked);
+}
+
+/**
+ * Prepares a batch of vectors and finds the k nearest clusters of each in
+ * parallel. ranked[i] holds the clusters of objects[i].
+ */
+template <typename T, typename CACHE, typename OPTIMIZER>
+void nearestClusters(const Node<T, CACHE>* root, const OPTIMIZER& optimizer,
+        const vector<T*>& objects, const size_t k, const size_t maxExpanded,
+        vector<vector<RankedCluster<T>>>* ranked) {
+    typedef ClusterSearch<T, CACHE, OPTIMIZER> Search;
+    ranked->resize(objects.size());
+    tbb::enumerable_thread_specific<Search> searches(Search(true));
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, objects.size(), 16),
+            [&](const tbb::blocked_range<size_t>& range) {
+                Search& search = searches.local();
+                for (size_t i = range.begin(); i != range.end(); ++i) {
+                    const T* object = objects[i];
+                    optimizer.prepare(objects[i]);
+                    search.search(root, k, maxExpanded, optimizer,
+                            [&](const Node<T, CACHE>* node, double* out) {
+                                optimizer.distances(object, node->getKeys(), out);
+                            }, &(*ranked)[i]);
+                }
+            });
+}
+
+} // namespace lmw
+
+#endif	/* CLUSTERSEARCH_H */
@@ -24,7 +24,8 @@ public:
 
 
 // change by fantao at 2015-8-20, bool->double;
-class ClusterStats : public ClusterVisitor<SVector<double>> {
+template <typename T>
+class ClusterStats : public ClusterVisitor<T> {
 public:
     ClusterStats(const int levels, const string& filenamePrefix) {
         for (int level = 1; level <= levels; level++) {
@@ -40,8 +41,8 @@ public:
         }
     }
 
-    void accept(const int level, const SVector<double>* parentCluster,
-            const SVector<double>* cluster, const double RMSE, const uint64_t objectCount) {
+    void accept(const int level, const T* parentCluster, const T* cluster,
+            const double RMSE, const uint64_t objectCount) {
         *_levels[level - 1] << hex << size_t(parentCluster) << ","
             << size_t(cluster) << dec << "," << RMSE << "," << objectCount << endl;
     }
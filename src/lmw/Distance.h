@@ -14,6 +14,25 @@
  *      // based on the squared error such as RMSE.
  *      double squared(T*, T*)      
  * 
+ *      // Puts an object into the form the distance expects before it is
+ *      // compared, for example, unit length. It is called on input vectors
+ *      // and on prototypes after they are updated. Most distances do nothing.
+ *      void prepare(T*)
+ * 
+ *      // Returns a norm of the object that the distance can reuse, so that
+ *      // it is only calculated once for an object compared many times. The
+ *      // dense distances return the L2 norm, and hammingDistance returns 0.
+ *      double norm(T*)
+ * 
+ *      // Returns the distance given the norms of both objects.
+ *      double operator()(T*, double, T*, double)
+ * 
+ * Distances for which DotProductDistance<DISTANCE>::value is true can also be
+ * calculated from a dot product and the two norms, which is how KeyMatrix
+ * compares a vector with many keys at once. For the Euclidean distances this
+ * is |a|^2 + |b|^2 - 2 a.b, which suffers from cancellation when a and b are
+ * close, so it is clamped at 0 by std::max(0.0, ...) rather than being exact.
+ *
  * For example,
  *      SVector<bool> a, b;
  *      hammingDistance hamming;
@@ -25,6 +44,7 @@
 #define	DISTANCE_H
 
 #include "SVector.h"
+#include "VectorKernels.h"
 
 namespace lmw {
 
@@ -37,6 +57,17 @@ struct hammingDistance {
         double distance = operator()(v1, v2);
         return distance * distance;
     }    
+
+    void prepare(SVector<bool> *) const { }
+
+    double norm(const SVector<bool> *) const {
+        return 0;
+    }
+
+    double operator()(const SVector<bool> *v1, double,
+            const SVector<bool> *v2, double) const {
+        return operator()(v1, v2);
+    }
 };
 
 template <typename T>
@@ -55,66 +86,34 @@ struct euclideanDistanceSq {
     double squared(const T *t1, const T *t2) const {
         return operator()(t1, t2);
     }    
+
+    void prepare(T *) const { }
+
+    double norm(const T *t) const {
+        return sqrt(VectorKernels::dot(t->begin(), t->begin(), t->size()));
+    }
+
+    double operator()(const T *t1, double, const T *t2, double) const {
+        return operator()(t1, t2);
+    }
 };
 
 
 // add by fantao at 2015-8-6;
+/**
+ * Cosine similarity of dense vectors, T is SVector<float> or SVector<double>.
+ * The dot product and both norms are calculated in one pass by a SIMD kernel.
+ */
 template <typename T>
 struct cosinedistance {  
-	/*
-    double operator()(const T *t1, const T *t2) const {
-        typename T::const_iterator it1 = t1->begin();
-        typename T::const_iterator it2 = t2->begin();
-        double d, sum = 0.0f;
-		double norm1 = 0.0f, norm2 = 0.0f;
-		double cosdis = 0.0f;
-        for (it1 = t1->begin(), it2 = t2->begin(); it1 != t1->end(), it2 != t2->end(); it1++, it2++) {
-            d = (*it1) * (*it2);
-            sum = sum + (d * d);
-			norm1 += (*it1) * (*it1);
-			norm2 += (*it2) * (*it2);
-        }
-
-		if (norm1 < 1e-6 || norm2 < 1e-6){
-			return 0.0f;
-		}
-		
-		cosdis = sum / sqrt(norm1 * norm2);	
-		
-        return cosdis;
-		
-    }
-    */
-
 	double operator()(const T *t1, const T *t2) const {
-        ;
-        double d, sum = 0.0f;
-		double norm1 = 0.0f, norm2 = 0.0f;
-		double cosdis = 0.0f;
-		size_t length = t1->size();
-        //cout<<endl;
-        //cout<<"length:"<<length<<endl;
-        //cout<<"t1[0]:"<<(*t1)[0]<<endl;
-        //cout<<"t1[1]:"<<(*t1)[1]<<endl;
-        for (int i = 0; i < length; i++) {
-           // cout<<"t1: "<<i<<(*t1)[i]<<endl;
-            d = (*t1)[i] * (*t2)[i];
-            sum = sum + d;
-			norm1 += (*t1)[i] * (*t1)[i];
-			norm2 += (*t2)[i] * (*t2)[i];
-        }
-        
-        //cout<<"norm1:\t"<<norm1<<endl;
-        //cout<<"norm2:\t"<<norm2<<endl;
+		double sum, norm1, norm2;
+		VectorKernels::cosineTerms(t1->begin(), t2->begin(), t1->size(),
+				&sum, &norm1, &norm2);
 		if (norm1 < 0.0000001 || norm2 < 0.0000001){
 			return 0.0f;
 		}
-		
-		cosdis = sum / sqrt(norm1 * norm2);	
-	//    cout<<"sum:"<<sum<<endl;
-      //  cout<<"cos:"<<cosdis<<endl;	
-        return cosdis;
-		
+		return sum / sqrt(norm1 * norm2);
     }
 	
     double squared(const T *t1, const T *t2) const {
@@ -122,9 +121,105 @@ struct cosinedistance {
 		distance = 1.0 / (distance * distance + 0.00001);
         return distance;
     }    
+
+    void prepare(T *) const { }
+
+    /**
+     * The L2 norm. Cluster centroids cache it, so only the dot product is
+     * calculated when comparing a vector with many centroids.
+     */
+    double norm(const T *t) const {
+        return sqrt(VectorKernels::dot(t->begin(), t->begin(), t->size()));
+    }
+
+    double operator()(const T *t1, double norm1, const T *t2, double norm2) const {
+        if (norm1 * norm1 < 0.0000001 || norm2 * norm2 < 0.0000001) {
+            return 0.0f;
+        }
+        return VectorKernels::dot(t1->begin(), t2->begin(), t1->size()) / (norm1 * norm2);
+    }
+};
+
+/**
+ * Cosine similarity of vectors that have been scaled to unit length by
+ * prepare(), so it is only a dot product. Both the input vectors and the
+ * prototypes are prepared by the Optimizer, so the norms are never calculated
+ * when comparing. It gives the same result as cosinedistance.
+ */
+template <typename T>
+struct normalizedCosineDistance {
+    double operator()(const T *t1, const T *t2) const {
+        return VectorKernels::dot(t1->begin(), t2->begin(), t1->size());
+    }
+
+    double squared(const T *t1, const T *t2) const {
+        double distance = operator()(t1, t2);
+        return 1.0 / (distance * distance + 0.00001);
+    }
+
+    /**
+     * Scales t to unit length. Vectors that are already unit length, for
+     * example, from a normalized vector file, are not written to.
+     */
+    void prepare(T *t) const {
+        double norm = sqrt(VectorKernels::dot(t->begin(), t->begin(), t->size()));
+        if (norm < 0.0000001 || fabs(norm - 1) < 0.00001) {
+            return;
+        }
+        t->scale(1.0 / norm);
+    }
+
+    double norm(const T *) const {
+        return 1;
+    }
+
+    double operator()(const T *t1, double, const T *t2, double) const {
+        return operator()(t1, t2);
+    }
 };
 
 
+/**
+ * DotProductDistance<DISTANCE>::value is true when the distance between two
+ * dense vectors can be calculated from their dot product and their norms as
+ * returned by DISTANCE::norm(). This allows many distances to be calculated
+ * at once with matrix multiplication, for example, by KeyMatrix.
+ */
+template <typename DISTANCE>
+struct DotProductDistance {
+    static const bool value = false;
+};
+
+template <typename T>
+struct DotProductDistance<cosinedistance<T>> {
+    static const bool value = true;
+
+    static double distance(double dot, double norm1, double norm2) {
+        if (norm1 * norm1 < 0.0000001 || norm2 * norm2 < 0.0000001) {
+            return 0.0f;
+        }
+        return dot / (norm1 * norm2);
+    }
+};
+
+template <typename T>
+struct DotProductDistance<normalizedCosineDistance<T>> {
+    static const bool value = true;
+
+    static double distance(double dot, double, double) {
+        return dot;
+    }
+};
+
+template <typename T>
+struct DotProductDistance<euclideanDistanceSq<T>> {
+    static const bool value = true;
+
+    static double distance(double dot, double norm1, double norm2) {
+        return std::max(0.0, norm1 * norm1 + norm2 * norm2 - 2 * dot);
+    }
+};
+
 template <typename T>
 struct euclideanDistance {
     double operator()(const T *t1, const T *t2) const {
@@ -134,10 +229,30 @@ struct euclideanDistance {
     double squared(T *t1, T *t2) const {
         return _squared(t1, t2);
     }
+
+    void prepare(T *) const { }
+
+    double norm(const T *t) const {
+        return _squared.norm(t);
+    }
+
+    double operator()(const T *t1, double, const T *t2, double) const {
+        return operator()(t1, t2);
+    }
     
     euclideanDistanceSq<T> _squared;
 };
 
+template <typename T>
+struct DotProductDistance<euclideanDistance<T>> {
+    static const bool value = true;
+
+    static double distance(double dot, double norm1, double norm2) {
+        return sqrt(DotProductDistance<euclideanDistanceSq<T>>::distance(dot,
+                norm1, norm2));
+    }
+};
+
 } // namespace lmw
 
 #endif	/* DISTANCE_H */
@@ -0,0 +1,322 @@
+/**
+ * This file contains a fast reader for doc2vec text files. Each line contains
+ * an object ID followed by the values of the vector, all separated by spaces,
+ *      doc1 0.0123 -0.4567 ...
+ *
+ * LineBlockReader reads large blocks of a file into a reusable buffer and
+ * hands out lines in place. Doc2VecParser parses a line into an SVector
+ * without creating any temporary strings.
+ *
+ * For example,
+ *      LineBlockReader reader("doc2vec.txt");
+ *      Doc2VecParser parser(200);
+ *      const char* begin;
+ *      const char* end;
+ *      while (reader.nextLine(&begin, &end)) {
+ *          SVector<double>* vector = new SVector<double>(200);
+ *          parser.parse(begin, end, vector, reader.lineNumber());
+ *      }
+ */
+
+#ifndef DOC2VECPARSER_H
+#define	DOC2VECPARSER_H
+
+#include "StdIncludes.h"
+#include "SVector.h"
+
+#include <cstring>
+
+namespace lmw {
+
+class LineBlockReader {
+public:
+    explicit LineBlockReader(const string& file, const size_t blockSize = 4 << 20)
+            : _stream(file, ios::in | ios::binary),
+            _buffer(blockSize + 1),
+            _begin(0),
+            _end(0),
+            _lineNumber(0),
+            _eof(false) {
+        if (!_stream) {
+            throw runtime_error("failed to open " + file);
+        }
+        _buffer[0] = '\0';
+    }
+
+    /**
+     * Points begin and end at the next line, excluding the newline. The line
+     * is followed by either a newline or a null character, so it can be
+     * passed to C functions such as strtod. It is only valid until the next
+     * call to nextLine().
+     *
+     * Returns false at the end of the file.
+     */
+    bool nextLine(const char** begin, const char** end) {
+        for (;;) {
+            char* first = &_buffer[_begin];
+            char* newline = static_cast<char*>(memchr(first, '\n', _end - _begin));
+            if (newline) {
+                *begin = first;
+                *end = newline;
+                _begin = newline - &_buffer[0] + 1;
+                ++_lineNumber;
+                return true;
+            }
+            if (!_eof) {
+                fill();
+                continue;
+            }
+            if (_begin < _end) {
+                // last line without a trailing newline
+                *begin = first;
+                *end = &_buffer[_end];
+                _begin = _end;
+                ++_lineNumber;
+                return true;
+            }
+            return false;
+        }
+    }
+
+    /**
+     * Points begin and end at a block of up to n complete lines including
+     * their newlines. Fewer lines are returned at the end of the file or when
+     * the buffer is full. The block is only valid until the next read.
+     *
+     * Returns the number of lines in the block, 0 at the end of the file.
+     */
+    size_t nextLines(const size_t n, const char** begin, const char** end) {
+        size_t lines = 0;
+        size_t scan = _begin;
+        for (;;) {
+            while (lines < n) {
+                char* newline = static_cast<char*>(memchr(&_buffer[scan], '\n', _end - scan));
+                if (!newline) {
+                    break;
+                }
+                scan = newline - &_buffer[0] + 1;
+                ++lines;
+            }
+            bool full = _begin == 0 && _end == _buffer.size() - 1;
+            if (lines == n || _eof || (lines > 0 && full)) {
+                break;
+            }
+            size_t scanned = scan - _begin;
+            fill();
+            scan = _begin + scanned;
+        }
+        if (lines < n && _eof && scan < _end) {
+            // last line without a trailing newline
+            scan = _end;
+            ++lines;
+        }
+        *begin = &_buffer[_begin];
+        *end = &_buffer[scan];
+        _begin = scan;
+        _lineNumber += lines;
+        return lines;
+    }
+
+    /**
+     * The line number of the last line returned starting at 1.
+     */
+    size_t lineNumber() const {
+        return _lineNumber;
+    }
+
+private:
+    /**
+     * Moves the partial line at the end of the buffer to the front and reads
+     * the next block after it. The buffer grows if a single line does not fit.
+     */
+    void fill() {
+        size_t remaining = _end - _begin;
+        if (remaining > 0 && _begin > 0) {
+            memmove(&_buffer[0], &_buffer[_begin], remaining);
+        }
+        _begin = 0;
+        _end = remaining;
+        if (_end == _buffer.size() - 1) {
+            _buffer.resize(_buffer.size() * 2);
+        }
+        _stream.read(&_buffer[_end], _buffer.size() - 1 - _end);
+        _end += _stream.gcount();
+        _buffer[_end] = '\0';
+        if (!_stream) {
+            _eof = true;
+        }
+    }
+
+    ifstream _stream;
+    vector<char> _buffer; // always has space for a null character after _end
+    size_t _begin; // start of the unread bytes in _buffer
+    size_t _end; // end of the valid bytes in _buffer
+    size_t _lineNumber;
+    bool _eof;
+};
+
+class Doc2VecParser {
+public:
+    explicit Doc2VecParser(const size_t vectorLength) : _vectorLength(vectorLength) { }
+
+    static bool isSeparator(const char c) {
+        return c == ' ' || c == '\t' || c == '\r';
+    }
+
+    static bool isBlank(const char* begin, const char* end) {
+        while (begin != end && isSeparator(*begin)) {
+            ++begin;
+        }
+        return begin == end;
+    }
+
+    /**
+     * Returns the object ID at the start of the line without parsing values.
+     */
+    static void parseID(const char* begin, const char* end, const char** idBegin,
+            const char** idEnd) {
+        while (begin != end && isSeparator(*begin)) {
+            ++begin;
+        }
+        *idBegin = begin;
+        while (begin != end && !isSeparator(*begin)) {
+            ++begin;
+        }
+        *idEnd = begin;
+    }
+
+    /**
+     * Parses the values on a line into vector. The number of values on the
+     * line must equal the vector length. Vectors carry an ordinal rather than
+     * the object ID, so the ID is only returned.
+     *
+     * @param lineNumber Only used for error messages.
+     * @param id When it is not NULL, it is set to the object ID in the line.
+     */
+    template <typename T>
+    void parse(const char* begin, const char* end, SVector<T>* vector,
+            const size_t lineNumber, pair<const char*, const char*>* id = NULL) const {
+        const char* idBegin;
+        const char* p;
+        parseID(begin, end, &idBegin, &p);
+        if (id) {
+            *id = make_pair(idBegin, p);
+        }
+        size_t count = 0;
+        for (;;) {
+            while (p != end && isSeparator(*p)) {
+                ++p;
+            }
+            if (p == end) {
+                break;
+            }
+            if (count == _vectorLength) {
+                error("more than", lineNumber);
+            }
+            (*vector)[count++] = parseDouble(&p, end);
+            if (p != end && !isSeparator(*p)) {
+                error("a malformed value instead of", lineNumber);
+            }
+        }
+        if (count != _vectorLength) {
+            error("fewer than", lineNumber);
+        }
+    }
+
+    /**
+     * Parses a decimal floating point number such as -1.25e-3 and advances p
+     * past it. Numbers with up to 19 significant digits and small exponents
+     * are handled directly, anything else falls back to strtod, which is why
+     * the text must be followed by a character that is not part of a number.
+     *
+     * The direct path is not correctly rounded. Converting the digits and
+     * scaling by a power of 10 are two roundings, so the result can be one
+     * unit in the last place away from strtod, far below float precision.
+     */
+    static double parseDouble(const char** p, const char* end) {
+        static const double powersOf10[] = {
+            1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+            1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+        };
+        const int maxPower = 22;
+        const char* start = *p;
+        const char* s = start;
+        bool negative = false;
+        if (s != end && (*s == '-' || *s == '+')) {
+            negative = *s == '-';
+            ++s;
+        }
+        uint64_t mantissa = 0;
+        int digits = 0; // significant digits in mantissa
+        int exponent = 0;
+        bool anyDigits = false;
+        for (; s != end && unsigned(*s - '0') < 10; ++s) {
+            anyDigits = true;
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (*s - '0');
+                digits += mantissa != 0;
+            } else {
+                ++exponent;
+            }
+        }
+        if (s != end && *s == '.') {
+            ++s;
+            for (; s != end && unsigned(*s - '0') < 10; ++s) {
+                anyDigits = true;
+                if (digits < 19) {
+                    mantissa = mantissa * 10 + (*s - '0');
+                    digits += mantissa != 0;
+                    --exponent;
+                }
+            }
+        }
+        if (s != end && (*s == 'e' || *s == 'E')) {
+            ++s;
+            bool negativeExponent = false;
+            if (s != end && (*s == '-' || *s == '+')) {
+                negativeExponent = *s == '-';
+                ++s;
+            }
+            int e = 0;
+            for (; s != end && unsigned(*s - '0') < 10; ++s) {
+                if (e < 10000) {
+                    e = e * 10 + (*s - '0');
+                }
+            }
+            exponent += negativeExponent ? -e : e;
+        }
+        if (!anyDigits || exponent > maxPower || exponent < -maxPower
+                || (s != end && !isSeparator(*s))) {
+            char* strtodEnd;
+            double value = strtod(start, &strtodEnd);
+            *p = strtodEnd;
+            return value;
+        }
+        double value = double(mantissa);
+        if (exponent < 0) {
+            value /= powersOf10[-exponent];
+        } else {
+            value *= powersOf10[exponent];
+        }
+        *p = s;
+        return negative ? -value : value;
+    }
+
+    size_t getVectorLength() const {
+        return _vectorLength;
+    }
+
+private:
+    void error(const char* problem, const size_t lineNumber) const {
+        stringstream ss;
+        ss << "line " << lineNumber << " has " << problem << " " << _vectorLength
+                << " values";
+        throw runtime_error(ss.str());
+    }
+
+    size_t _vectorLength;
+};
+
+} // namespace lmw
+
+#endif	/* DOC2VECPARSER_H */
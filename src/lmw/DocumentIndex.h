@@ -0,0 +1,317 @@
+/**
+ * DocumentIndex finds the documents nearest to a query using the leaf
+ * clusters of a trained tree as an inverted index. Each document is added to
+ * the list of its nearest leaf cluster. A query probes the few leaf clusters
+ * nearest to it and ranks their members by their exact distance to the
+ * query, so only a small part of the collection is compared with the query.
+ * Probing more clusters finds more of the true nearest documents at the cost
+ * of more distances.
+ *
+ * The vectors of the members of a leaf are contiguous rows of one KeyMatrix
+ * with their norms cached, so ranking the members of a leaf is a scan over
+ * contiguous memory. Documents are identified by the ordinal they carry, see
+ * IdTable.h.
+ *
+ * With a ProductQuantizer the members are stored as codes instead, see
+ * ProductQuantizer.h, and ranked by asymmetric distances from one table of
+ * dot products per query. The ranking is then approximate.
+ *
+ * TREE is any tree with a nearestClusters() method like
+ * StreamingEMTree::nearestClusters(). The tree must not change between adding
+ * documents and searching, as the leaf clusters are identified by their keys.
+ *
+ * For example,
+ *      DocumentIndex<SVector<float>, OPTIMIZER> index(200);
+ *      index.add(*emtree, vectors);
+ *      index.build();
+ *      vector<DocumentIndex<SVector<float>, OPTIMIZER>::Match> matches;
+ *      index.search(*emtree, query, 10, 4, &matches);
+ */
+
+#ifndef DOCUMENTINDEX_H
+#define	DOCUMENTINDEX_H
+
+#include "StdIncludes.h"
+#include "ClusterSearch.h"
+#include "KeyMatrix.h"
+#include "ProductQuantizer.h"
+#include "tbb/blocked_range.h"
+#include "tbb/enumerable_thread_specific.h"
+#include "tbb/parallel_for.h"
+
+namespace lmw {
+
+template <typename T, typename OPTIMIZER>
+class DocumentIndex {
+public:
+    typedef typename T::value_type V;
+
+    struct Match {
+        uint64_t id; // the ordinal of the document
+        double distance; // from the query to the document
+    };
+
+    explicit DocumentIndex(const size_t dimensions) :
+            _dimensions(dimensions), _maxExpanded(0), _quantizer(NULL) {
+        static_assert(DotProductDistance<typename OPTIMIZER::distance_type>::value,
+                "DocumentIndex requires a DISTANCE calculated from a dot product");
+    }
+
+    /**
+     * The number of tree nodes expanded to find the nearest leaf clusters,
+     * see ClusterSearch.h. 0 expands only as many as needed to reach them.
+     */
+    void setMaxExpanded(const size_t maxExpanded) {
+        _maxExpanded = maxExpanded;
+    }
+
+    size_t getMaxExpanded() const {
+        return _maxExpanded;
+    }
+
+    /**
+     * Stores the members as codes of a trained quantizer, which must outlive
+     * the index. It must be set before the first build().
+     */
+    void setQuantizer(const ProductQuantizer<T>* quantizer) {
+        if (size() > 0) {
+            throw runtime_error("the quantizer must be set before the index is built");
+        }
+        if (!quantizer->isTrained() || quantizer->dimensions() != _dimensions) {
+            throw runtime_error("the quantizer must be trained on vectors of the same dimensions");
+        }
+        _quantizer = quantizer;
+    }
+
+    /**
+     * Prepares a batch of documents and adds each one to the list of its
+     * nearest leaf cluster in tree. The vectors are copied, and they are not
+     * searched until build() is called.
+     */
+    template <typename TREE>
+    void add(const TREE& tree, const vector<T*>& objects) {
+        vector<vector<RankedCluster<T>>> ranked;
+        tree.nearestClusters(objects, 1, _maxExpanded, &ranked);
+        for (size_t i = 0; i < objects.size(); i++) {
+            if (ranked[i].empty()) {
+                throw runtime_error("cannot index documents in an empty tree");
+            }
+            if (objects[i]->size() != _dimensions) {
+                throw runtime_error("document has the wrong number of dimensions");
+            }
+            auto leaf = _leaves.insert(make_pair(ranked[i][0].key, _leaves.size()));
+            _stagedLeaves.push_back(leaf.first->second);
+            _stagedIds.push_back(objects[i]->getID());
+            _stagedNorms.push_back(_optimizer.norm(objects[i]));
+            _staged.insert(_staged.end(), objects[i]->begin(),
+                    objects[i]->begin() + _dimensions);
+        }
+    }
+
+    /**
+     * Groups the documents added so far by leaf cluster so they can be
+     * searched. Documents can still be added, but they need another build().
+     */
+    void build() {
+        const size_t documents = _ids.size() + _stagedIds.size();
+        vector<uint64_t> ids(documents);
+        // counting sort of the documents by leaf, the built ones first so
+        // their order within a leaf does not change
+        vector<uint64_t> offsets(_leaves.size() + 1, 0);
+        for (size_t leaf = 0; leaf + 1 < _offsets.size(); leaf++) {
+            offsets[leaf + 1] += _offsets[leaf + 1] - _offsets[leaf];
+        }
+        for (uint32_t leaf : _stagedLeaves) {
+            offsets[leaf + 1]++;
+        }
+        for (size_t leaf = 0; leaf < _leaves.size(); leaf++) {
+            offsets[leaf + 1] += offsets[leaf];
+        }
+        vector<uint64_t> next(offsets.begin(), offsets.end() - 1);
+        vector<uint64_t> builtRows(_ids.size()), stagedRows(_stagedIds.size());
+        for (size_t leaf = 0; leaf + 1 < _offsets.size(); leaf++) {
+            for (uint64_t i = _offsets[leaf]; i < _offsets[leaf + 1]; i++) {
+                builtRows[i] = next[leaf]++;
+                ids[builtRows[i]] = _ids[i];
+            }
+        }
+        for (size_t i = 0; i < _stagedIds.size(); i++) {
+            stagedRows[i] = next[_stagedLeaves[i]]++;
+            ids[stagedRows[i]] = _stagedIds[i];
+        }
+        if (_quantizer) {
+            const size_t bytes = _quantizer->codeBytes();
+            vector<uint8_t> codes(documents * bytes);
+            vector<double> codeNorms(documents);
+            for (size_t i = 0; i < builtRows.size(); i++) {
+                std::copy(&_codes[i * bytes], &_codes[i * bytes] + bytes,
+                        &codes[builtRows[i] * bytes]);
+                codeNorms[builtRows[i]] = _codeNorms[i];
+            }
+            for (size_t i = 0; i < stagedRows.size(); i++) {
+                uint8_t* code = &codes[stagedRows[i] * bytes];
+                _quantizer->encode(&_staged[i * _dimensions], code);
+                codeNorms[stagedRows[i]] = _quantizer->norm(code);
+            }
+            _codes.swap(codes);
+            _codeNorms.swap(codeNorms);
+        } else {
+            KeyMatrix<V> members;
+            members.resize(documents, _dimensions);
+            for (size_t i = 0; i < builtRows.size(); i++) {
+                members.setRow(builtRows[i], _members.row(i), _members.norm(i));
+            }
+            for (size_t i = 0; i < stagedRows.size(); i++) {
+                members.setRow(stagedRows[i], &_staged[i * _dimensions], _stagedNorms[i]);
+            }
+            _members.swap(members);
+        }
+        _ids.swap(ids);
+        _offsets.swap(offsets);
+        vector<V>().swap(_staged);
+        vector<uint32_t>().swap(_stagedLeaves);
+        vector<uint64_t>().swap(_stagedIds);
+        vector<double>().swap(_stagedNorms);
+    }
+
+    /**
+     * The number of documents that can be searched.
+     */
+    size_t size() const {
+        return _ids.size();
+    }
+
+    /**
+     * The number of leaf clusters with documents.
+     */
+    size_t leafCount() const {
+        return _leaves.size();
+    }
+
+    /**
+     * The bytes used to store the vectors or codes of the members.
+     */
+    size_t memberBytes() const {
+        return _quantizer ? _codes.size() + _codeNorms.size() * sizeof (double)
+                : _members.size() * (_dimensions * sizeof (V) + sizeof (double));
+    }
+
+    /**
+     * Puts the k documents nearest to query found in its probes nearest leaf
+     * clusters into matches, nearest first. query must have been prepared by
+     * OPTIMIZER::prepare(). Any number of threads can search at once.
+     */
+    template <typename TREE>
+    void search(const TREE& tree, const T* query, const size_t k,
+            const size_t probes, vector<Match>* matches) const {
+        auto nearerMatch = [this](const Match& a, const Match& b) {
+            return _optimizer.nearer(a.distance, b.distance);
+        };
+        Scratch& scratch = _scratch.local();
+        matches->clear();
+        if (k == 0) {
+            return;
+        }
+        tree.nearestClusters(query, probes, _maxExpanded, &scratch.clusters);
+        const double queryNorm = _optimizer.norm(query);
+        if (_quantizer) {
+            scratch.table.resize(_quantizer->tableSize());
+            _quantizer->dotTable(query->begin(), &scratch.table[0]);
+        }
+        for (auto& cluster : scratch.clusters) {
+            auto leaf = _leaves.find(cluster.key);
+            if (leaf == _leaves.end() || leaf->second + 1 >= _offsets.size()) {
+                continue;
+            }
+            const uint64_t first = _offsets[leaf->second];
+            const uint64_t count = _offsets[leaf->second + 1] - first;
+            if (count == 0) {
+                continue;
+            }
+            scratch.distances.resize(count);
+            if (_quantizer) {
+                typedef DotProductDistance<typename OPTIMIZER::distance_type> Dot;
+                double* distances = &scratch.distances[0];
+                _quantizer->dots(&scratch.table[0],
+                        &_codes[first * _quantizer->codeBytes()], count, distances);
+                for (size_t i = 0; i < count; i++) {
+                    distances[i] = Dot::distance(distances[i], queryNorm,
+                            _codeNorms[first + i]);
+                }
+            } else {
+                _optimizer.distances(query, queryNorm, _members, first, count,
+                        &scratch.distances[0]);
+            }
+            for (size_t i = 0; i < count; i++) {
+                Match match = {_ids[first + i], scratch.distances[i]};
+                if (matches->size() < k) {
+                    matches->push_back(match);
+                    std::push_heap(matches->begin(), matches->end(), nearerMatch);
+                } else if (_optimizer.nearer(match.distance, matches->front().distance)) {
+                    std::pop_heap(matches->begin(), matches->end(), nearerMatch);
+                    matches->back() = match;
+                    std::push_heap(matches->begin(), matches->end(), nearerMatch);
+                }
+            }
+        }
+        std::sort_heap(matches->begin(), matches->end(), nearerMatch);
+    }
+
+    /**
+     * Prepares a batch of queries and searches for each in parallel.
+     * matches[i] holds the documents found for queries[i].
+     */
+    template <typename TREE>
+    void search(const TREE& tree, const vector<T*>& queries, const size_t k,
+            const size_t probes, vector<vector<Match>>* matches) const {
+        matches->resize(queries.size());
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, queries.size(), 16),
+                [&](const tbb::blocked_range<size_t>& range) {
+                    for (size_t i = range.begin(); i != range.end(); ++i) {
+                        _optimizer.prepare(queries[i]);
+                        search(tree, queries[i], k, probes, &(*matches)[i]);
+                    }
+                });
+    }
+
+private:
+    /**
+     * The buffers of one thread, reused for every query.
+     */
+    struct Scratch {
+        vector<RankedCluster<T>> clusters;
+        vector<double> distances;
+        vector<float> table; // of the ProductQuantizer
+    };
+
+    DocumentIndex(const DocumentIndex&);
+    DocumentIndex& operator=(const DocumentIndex&);
+
+    OPTIMIZER _optimizer;
+    size_t _dimensions;
+    size_t _maxExpanded;
+
+    // The position of every leaf cluster with documents
+    unordered_map<const T*, uint32_t> _leaves;
+
+    // The documents of leaf l are rows _offsets[l] to _offsets[l + 1] of
+    // _members, or of _codes and _codeNorms with a quantizer
+    KeyMatrix<V> _members;
+    const ProductQuantizer<T>* _quantizer;
+    vector<uint8_t> _codes;
+    vector<double> _codeNorms;
+    vector<uint64_t> _ids;
+    vector<uint64_t> _offsets;
+
+    // Documents added since the last build()
+    vector<V> _staged;
+    vector<uint32_t> _stagedLeaves;
+    vector<uint64_t> _stagedIds;
+    vector<double> _stagedNorms;
+
+    mutable tbb::enumerable_thread_specific<Scratch> _scratch;
+};
+
+} // namespace lmw
+
+#endif	/* DOCUMENTINDEX_H */
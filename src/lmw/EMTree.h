@@ -21,6 +21,10 @@ public:
         delete _root;
     }
 
+    Node<T>* getMWayTree() {
+        return _root;
+    }
+
     int getClusterCount() {
         return clusterCount(_root);
     }
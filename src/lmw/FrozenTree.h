@@ -0,0 +1,172 @@
+/**
+ * FrozenTree is a read only copy of a tree saved by StreamingEMTree::save()
+ * that only assigns vectors to clusters. It has no accumulators or locks, so
+ * any number of threads can assign vectors at the same time.
+ *
+ * The keys of every node are rows of a single KeyMatrix in the breadth first
+ * order of the tree file, so the keys of a node are contiguous rows and
+ * finding the nearest key is a scan over contiguous memory. The topology is
+ * a flat array of nodes and the node index of the child of each key.
+ *
+ * A cluster is identified by the index of its key in the tree file. The
+ * leaf returned by assign() identifies the leaf cluster, and path() gives the
+ * clusters at every level above it.
+ *
+ * For example,
+ *      MappedTreeFile file("doc2vec.tree");
+ *      FrozenTree<SVector<float>, OPTIMIZER> tree(file);
+ *      vector<FrozenTree<SVector<float>, OPTIMIZER>::Assignment> assignments;
+ *      tree.assign(vectors, &assignments);
+ *      vector<uint64_t> path;
+ *      tree.path(assignments[0].leaf, &path);
+ */
+
+#ifndef FROZENTREE_H
+#define	FROZENTREE_H
+
+#include "StdIncludes.h"
+#include "KeyMatrix.h"
+#include "TreeFile.h"
+#include "tbb/blocked_range.h"
+#include "tbb/parallel_for.h"
+
+namespace lmw {
+
+template <typename T, typename OPTIMIZER>
+class FrozenTree {
+public:
+    typedef typename T::value_type V;
+
+    struct Assignment {
+        uint64_t leaf; // the key of the leaf cluster in the tree file
+        double distance; // from the vector to the leaf cluster
+    };
+
+    explicit FrozenTree(const MappedTreeFile& file) : _depth(0) {
+        static_assert(DotProductDistance<typename OPTIMIZER::distance_type>::value,
+                "FrozenTree requires a DISTANCE calculated from a dot product");
+        const size_t dimensions = file.dimensions();
+        _nodes.resize(file.nodeCount());
+        _children.resize(file.keyCount());
+        _parents.assign(file.nodeCount(), TreeFileKey::NO_CHILD);
+        _keys.resize(file.keyCount(), dimensions);
+        T key(dimensions);
+        for (size_t i = 0; i < file.nodeCount(); i++) {
+            const TreeFileNode& node = file.node(i);
+            if (node.keyCount == 0) {
+                throw runtime_error("cannot assign vectors to a tree with an empty node");
+            }
+            _nodes[i].firstKey = node.firstKey;
+            _nodes[i].keyCount = node.keyCount;
+            _nodes[i].leaf = node.flags & TreeFileNode::LEAF;
+            for (size_t k = node.firstKey; k < node.firstKey + node.keyCount; k++) {
+                file.copyValues(k, key.begin());
+                _keys.setRow(k, key.begin(), _optimizer.norm(&key));
+                _children[k] = file.key(k).child;
+                if (_children[k] != TreeFileKey::NO_CHILD) {
+                    _parents[_children[k]] = k;
+                }
+            }
+        }
+        for (size_t node = 0; ; node = _children[_nodes[node].firstKey]) {
+            ++_depth;
+            if (_nodes[node].leaf) {
+                break;
+            }
+        }
+    }
+
+    size_t dimensions() const {
+        return _keys.dimensions();
+    }
+
+    /**
+     * The number of levels from the root to the first leaf.
+     */
+    size_t depth() const {
+        return _depth;
+    }
+
+    /**
+     * Assigns a vector that has been prepared by OPTIMIZER::prepare() to the
+     * nearest leaf cluster by following the nearest key at each level.
+     */
+    Assignment assign(const T* object) const {
+        const double norm = _optimizer.norm(object);
+        size_t index = 0;
+        for (;;) {
+            const FlatNode& node = _nodes[index];
+            Nearest<void> nearest = _optimizer.nearestRow(object, norm, _keys,
+                    node.firstKey, node.keyCount);
+            uint64_t key = node.firstKey + nearest.index;
+            if (node.leaf) {
+                return {key, nearest.distance};
+            }
+            index = _children[key];
+        }
+    }
+
+    /**
+     * Prepares and assigns a batch of vectors in parallel. assignments[i] is
+     * the assignment of objects[i].
+     */
+    void assign(const vector<T*>& objects, vector<Assignment>* assignments) const {
+        assignments->resize(objects.size());
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, objects.size(), 16),
+                [&](const tbb::blocked_range<size_t>& range) {
+                    for (size_t i = range.begin(); i != range.end(); ++i) {
+                        _optimizer.prepare(objects[i]);
+                        (*assignments)[i] = assign(objects[i]);
+                    }
+                });
+    }
+
+    /**
+     * The keys of the clusters from the root down to key.
+     */
+    void path(const uint64_t key, vector<uint64_t>* path) const {
+        path->clear();
+        for (uint64_t k = key; ; ) {
+            path->push_back(k);
+            size_t node = nodeOf(k);
+            if (_parents[node] == TreeFileKey::NO_CHILD) {
+                break;
+            }
+            k = _parents[node];
+        }
+        std::reverse(path->begin(), path->end());
+    }
+
+private:
+    struct FlatNode {
+        uint64_t firstKey;
+        uint32_t keyCount;
+        bool leaf;
+    };
+
+    /**
+     * The node holding key. Nodes are in breadth first order, so their first
+     * keys are increasing.
+     */
+    size_t nodeOf(const uint64_t key) const {
+        auto it = std::upper_bound(_nodes.begin(), _nodes.end(), key,
+                [](const uint64_t k, const FlatNode& node) {
+                    return k < node.firstKey;
+                });
+        return it - _nodes.begin() - 1;
+    }
+
+    FrozenTree(const FrozenTree&);
+    FrozenTree& operator=(const FrozenTree&);
+
+    OPTIMIZER _optimizer;
+    KeyMatrix<V> _keys; // row k is key k of the tree file
+    vector<FlatNode> _nodes;
+    vector<uint64_t> _children; // the node index of the child of each key
+    vector<uint64_t> _parents; // the key pointing at each node
+    size_t _depth;
+};
+
+} // namespace lmw
+
+#endif	/* FROZENTREE_H */
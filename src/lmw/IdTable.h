@@ -0,0 +1,139 @@
+/**
+ * IdTable maps the 64 bit ordinals carried by vectors to their object IDs.
+ * IDs are only needed when writing results, for example, by ClusterWriter, so
+ * vectors, centroids and samples do not carry a string.
+ *
+ * A table either owns its IDs, which are appended a chunk at a time while a
+ * stream is parsed, or it is a view of the ID section of a vector file (see
+ * VectorFile.h), which may be memory mapped.
+ *
+ * append() can be called from many threads, and IDs that have been appended
+ * can be looked up while other threads append. An ID never moves once it has
+ * been appended.
+ *
+ * For example,
+ *      IdTable ids;
+ *      vector<pair<const char*, const char*>> ranges = ...;
+ *      uint64_t first = ids.append(ranges);
+ *      cout << ids.get(first) << endl;
+ */
+
+#ifndef IDTABLE_H
+#define	IDTABLE_H
+
+#include "StdIncludes.h"
+#include "tbb/concurrent_vector.h"
+
+namespace lmw {
+
+class IdTable {
+public:
+    typedef pair<const char*, const char*> Range;
+
+    IdTable() : _bytes(NULL), _offsets(NULL), _count(0), _byteCount(0) { }
+
+    /**
+     * A view of count IDs stored one after another in bytes, where ID i is
+     * bytes[offsets[i]] to bytes[offsets[i + 1]]. The memory is not copied,
+     * so it must outlive the table.
+     */
+    IdTable(const char* bytes, const uint64_t* offsets, const size_t count)
+            : _bytes(bytes), _offsets(offsets), _count(count),
+            _byteCount(offsets[count] + (count + 1) * sizeof (uint64_t)) { }
+
+    ~IdTable() {
+        clear();
+    }
+
+    /**
+     * Copies IDs into the table and returns the ordinal of the first one.
+     * The IDs are given ordinals first, first + 1, ... in order. The bytes of
+     * all the IDs are kept in a single allocation.
+     */
+    uint64_t append(const vector<Range>& ids) {
+        if (_offsets) {
+            throw runtime_error("cannot append to a view of IDs");
+        }
+        size_t length = 0;
+        for (auto& id : ids) {
+            length += id.second - id.first;
+        }
+        char* block = new char[std::max(length, size_t(1))];
+        _blocks.push_back(block);
+        auto entry = _entries.grow_by(ids.size());
+        uint64_t first = entry - _entries.begin();
+        for (auto& id : ids) {
+            entry->begin = block;
+            entry->length = id.second - id.first;
+            block = std::copy(id.first, id.second, block);
+            ++entry;
+        }
+        _byteCount += length + ids.size() * sizeof (Entry);
+        return first;
+    }
+
+    uint64_t append(const string& id) {
+        vector<Range> ids(1, Range(id.data(), id.data() + id.size()));
+        return append(ids);
+    }
+
+    const char* data(const uint64_t i) const {
+        return _offsets ? _bytes + _offsets[i] : _entries[i].begin;
+    }
+
+    size_t length(const uint64_t i) const {
+        return _offsets ? _offsets[i + 1] - _offsets[i] : _entries[i].length;
+    }
+
+    string get(const uint64_t i) const {
+        return string(data(i), length(i));
+    }
+
+    size_t size() const {
+        return _offsets ? _count : _entries.size();
+    }
+
+    /**
+     * The memory used by the IDs and their index.
+     */
+    size_t bytes() const {
+        return _byteCount;
+    }
+
+    /**
+     * Removes all the IDs. It is not thread safe.
+     */
+    void clear() {
+        for (char* block : _blocks) {
+            delete[] block;
+        }
+        _blocks.clear();
+        _entries.clear();
+        if (!_offsets) {
+            _byteCount = 0;
+        }
+    }
+
+private:
+    IdTable(const IdTable&);
+    IdTable& operator=(const IdTable&);
+
+    struct Entry {
+        const char* begin;
+        size_t length;
+    };
+
+    // a view of IDs owned by someone else
+    const char* _bytes;
+    const uint64_t* _offsets;
+    size_t _count;
+
+    // IDs owned by the table
+    tbb::concurrent_vector<Entry> _entries;
+    tbb::concurrent_vector<char*> _blocks;
+    atomic<size_t> _byteCount;
+};
+
+} // namespace lmw
+
+#endif	/* IDTABLE_H */
@@ -2,6 +2,7 @@
 #define	INSERTVISITOR_H
 
 #include "StdIncludes.h"
+#include "IdTable.h"
 #include "tbb/mutex.h"
 
 namespace lmw {
@@ -23,10 +24,17 @@ public:
 };
 
 // change by fantao at 2015-8-20, bool->double;
-class ClusterWriter : public InsertVisitor<SVector<double>> {
+/**
+ * Writes the cluster of each object at every level. Objects carry ordinals,
+ * which are resolved to object IDs with the IdTable of the stream being
+ * visited.
+ */
+template <typename T>
+class ClusterWriter : public InsertVisitor<T> {
 public:
 
-    ClusterWriter(const int levels, const string& filenamePrefix) {
+    ClusterWriter(const int levels, const string& filenamePrefix,
+            const IdTable& ids) : _ids(ids) {
         _mutexes.resize(levels);
         for (int level = 1; level <= levels; level++) {
             stringstream ss;
@@ -41,21 +49,23 @@ public:
         }
     }
 
-    void accept(const int level, const SVector<double>* object,
-            const SVector<double>* cluster, const double distance) {
+    void accept(const int level, const T* object, const T* cluster,
+            const double distance) {
         Mutex::scoped_lock lock(_mutexes[level - 1]);
         // add by fantao at 2015-9-7;
         if (distance < 0.2){
             return;
         }
         // using endl here causes the buffer to flush and sync() to be called which slows it down
-        *_levels[level - 1] << object->getID() << "," << hex << size_t(cluster)
-            << dec << "," << distance << "\n";
+        ofstream& out = *_levels[level - 1];
+        out.write(_ids.data(object->getID()), _ids.length(object->getID()));
+        out << "," << hex << size_t(cluster) << dec << "," << distance << "\n";
         return;
     }
 
 private:
     typedef tbb::mutex Mutex;
+    const IdTable& _ids;
     vector<Mutex> _mutexes;
     vector<unique_ptr<ofstream>> _levels;
 };
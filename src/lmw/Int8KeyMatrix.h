@@ -0,0 +1,212 @@
+/**
+ * This file contains Int8KeyMatrix, a copy of the keys in a Node quantized to
+ * 8 bit integers with a scale per key. Scanning the keys of a node then reads
+ * a byte per dimension instead of 4 for float or 8 for double, and the dot
+ * products are calculated with integer SIMD, see VectorKernels::dotRowsInt8().
+ *
+ * A key is quantized symmetrically, value = scale * q with q in [-127, 127]
+ * and scale = max |value| / 127. A query is quantized the same way into an
+ * Int8Query, so the dot product of the original vectors is approximately
+ * the integer dot product times both scales. The error is small enough to
+ * choose between keys, but not to report distances, so the nearest keys are
+ * reranked with the exact float keys where it matters.
+ *
+ * Int8KeyCache is the Node CACHE holding both the exact KeyMatrix and the
+ * quantized keys. The quantized keys are only filled when a tree asks for
+ * them, for example, StreamingEMTree::setInt8Keys().
+ *
+ * For example,
+ *      Int8KeyMatrix keys;
+ *      keys.resize(m, 200);
+ *      keys.setRow(i, key->begin());
+ *      Int8Query query;
+ *      query.quantize(object->begin(), 200, keys.stride());
+ *      double dots[m];
+ *      keys.dot(query, 0, m, dots);
+ */
+
+#ifndef INT8KEYMATRIX_H
+#define	INT8KEYMATRIX_H
+
+#include "StdIncludes.h"
+#include "Distance.h"
+#include "KeyMatrix.h"
+#include "VectorKernels.h"
+
+#include <cstdlib>
+#include <cstring>
+
+namespace lmw {
+
+/**
+ * Quantizes values into q, which must have space for padded values, and
+ * returns the scale. The values after n are zero.
+ */
+template <typename V>
+float quantizeInt8(const V* values, const size_t n, const size_t padded, int8_t* q) {
+    // A query is quantized on every insert, so the maximum is found in 8
+    // independent lanes rather than one chain of dependent comparisons.
+    float lanes[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        for (size_t j = 0; j < 8; j++) {
+            float value = fabsf(float(values[i + j]));
+            lanes[j] = value > lanes[j] ? value : lanes[j];
+        }
+    }
+    for (; i < n; i++) {
+        float value = fabsf(float(values[i]));
+        lanes[0] = value > lanes[0] ? value : lanes[0];
+    }
+    float maxAbs = *std::max_element(lanes, lanes + 8);
+    float scale = maxAbs > 0 ? maxAbs / 127 : 1;
+    float inverse = 1 / scale;
+    for (i = 0; i < n; i++) {
+        float value = float(values[i]) * inverse;
+        q[i] = static_cast<int8_t>(value + (value < 0 ? -0.5f : 0.5f));
+    }
+    std::fill(q + n, q + padded, 0);
+    return scale;
+}
+
+/**
+ * A query vector quantized for Int8KeyMatrix::dot(). source is the object it
+ * was quantized from so a query can be reused while descending a tree.
+ */
+struct Int8Query {
+    Int8Query() : scale(1), source(NULL) { }
+
+    template <typename V>
+    void quantize(const V* values, const size_t n, const size_t padded) {
+        q.resize(padded);
+        scale = quantizeInt8(values, n, padded, &q[0]);
+        source = values;
+    }
+
+    vector<int8_t> q;
+    float scale;
+    const void* source;
+};
+
+class Int8KeyMatrix {
+public:
+    Int8KeyMatrix() : _data(NULL), _capacity(0), _rows(0), _dimensions(0),
+            _stride(0) { }
+
+    ~Int8KeyMatrix() {
+        free(_data);
+    }
+
+    /**
+     * Sets the shape of the matrix. The rows are zeroed, including the
+     * padding at the end of each row.
+     */
+    void resize(const size_t rows, const size_t dimensions) {
+        const size_t alignment = VectorKernels::ROW_ALIGNMENT;
+        _rows = rows;
+        _dimensions = dimensions;
+        _stride = (dimensions + alignment - 1) / alignment * alignment;
+        size_t required = _rows * _stride;
+        if (required > _capacity) {
+            free(_data);
+            _data = NULL;
+            _capacity = 0;
+            void* memory;
+            if (posix_memalign(&memory, alignment, required) != 0) {
+                throw std::bad_alloc();
+            }
+            _data = static_cast<int8_t*>(memory);
+            _capacity = required;
+        }
+        if (required > 0) {
+            memset(_data, 0, required);
+        }
+        _scales.assign(rows, 0);
+    }
+
+    template <typename V>
+    void setRow(const size_t i, const V* values) {
+        _scales[i] = quantizeInt8(values, _dimensions, _stride, row(i));
+    }
+
+    int8_t* row(const size_t i) {
+        return _data + i * _stride;
+    }
+
+    const int8_t* row(const size_t i) const {
+        return _data + i * _stride;
+    }
+
+    /**
+     * Calculates the approximate dot products of query with count rows
+     * starting at first. query must be quantized with stride() values.
+     */
+    void dot(const Int8Query& query, const size_t first, const size_t count,
+            double* out) const {
+        const size_t block = 64;
+        int32_t dots[block];
+        for (size_t offset = 0; offset < count; offset += block) {
+            size_t n = std::min(block, count - offset);
+            VectorKernels::dotRowsInt8(&query.q[0], row(first + offset), n,
+                    _dimensions, _stride, dots);
+            for (size_t i = 0; i < n; i++) {
+                out[offset + i] = double(dots[i]) * query.scale
+                        * _scales[first + offset + i];
+            }
+        }
+    }
+
+    size_t size() const {
+        return _rows;
+    }
+
+    size_t dimensions() const {
+        return _dimensions;
+    }
+
+    /**
+     * The padded length of a row in bytes.
+     */
+    size_t stride() const {
+        return _stride;
+    }
+
+private:
+    Int8KeyMatrix(const Int8KeyMatrix&);
+    Int8KeyMatrix& operator=(const Int8KeyMatrix&);
+
+    int8_t* _data; // _rows * _stride values aligned to VectorKernels::ROW_ALIGNMENT
+    size_t _capacity;
+    size_t _rows;
+    size_t _dimensions;
+    size_t _stride;
+    vector<float> _scales;
+};
+
+/**
+ * The exact keys of a node, and optionally its keys quantized to 8 bits.
+ * Functions taking a KeyMatrix use the exact keys.
+ */
+template <typename V>
+struct Int8KeyCache : public KeyMatrix<V> {
+    Int8KeyMatrix quantized; // empty unless quantized keys are used
+};
+
+/**
+ * Like KeyCache in KeyMatrix.h, but the cache of dense vectors compared by a
+ * DotProductDistance is an Int8KeyCache.
+ */
+template <typename T, typename DISTANCE,
+        bool DOT = DotProductDistance<DISTANCE>::value>
+struct QuantizedKeyCache {
+    typedef NoNodeCache type;
+};
+
+template <typename T, typename DISTANCE>
+struct QuantizedKeyCache<T, DISTANCE, true> {
+    typedef Int8KeyCache<typename T::value_type> type;
+};
+
+} // namespace lmw
+
+#endif	/* INT8KEYMATRIX_H */
@@ -3,6 +3,7 @@
 
 #include "Cluster.h"
 #include "Clusterer.h"
+#include "KeyMatrix.h"
 #include "Seeder.h"
 #include "StdIncludes.h"
 #include "tbb/atomic.h"
@@ -39,6 +40,15 @@ public:
         _maxIters = maxIters;
     }
     
+    /**
+     * The smallest number of clusters where vectors are assigned to centroids
+     * using matrix multiplication. It only applies to dense vectors with a
+     * DotProductDistance.
+     */
+    void setMinMatrixClusters(size_t minMatrixClusters) {
+        _minMatrixClusters = minMatrixClusters;
+    }
+
     void setEnforceNumClusters(bool enforceNumClusters) {
         _enforceNumClusters = enforceNumClusters;
     }
@@ -47,7 +57,14 @@ public:
         return _numClusters;
     }
 
+    /**
+     * The data is prepared for the OPTIMIZER in place, for example, scaled to
+     * unit length for normalizedCosineDistance.
+     */
     vector<Cluster<T>*>& cluster(vector<T*> &data) {
+        for (T* object : data) {
+            _optimizer.prepare(object);
+        }
         Utils::purge(_clusters);
         _clusters.clear();
         _finalClusters.clear();
@@ -173,6 +190,24 @@ private:
 
 
         // Parallel
+        nearestCentroids(data, _centroidMatrix);
+        tbb::atomic_fence(); // make sure all writes are visible on all CPUs
+
+        // Serial
+        // Clear the nearest vectors in each cluster
+        for (Cluster<T> *c : _clusters) {
+            c->clearNearest();
+        }
+        // Accumlate into clusters
+        for (size_t i = 0; i < data.size(); i++) {
+            size_t nearest = _nearestCentroid[i];
+            _clusters[nearest]->addNearest(data[i]);
+        }
+
+
+    }
+
+    void nearestCentroids(vector<T*> &data, NoNodeCache&) {
         tbb::parallel_for(tbb::blocked_range<size_t>(0, data.size(), 1000),
                 [&](const tbb::blocked_range<size_t>& r) {
                     for (size_t i = r.begin(); i != r.end(); ++i) {
@@ -185,20 +220,43 @@ private:
                     }
                 }
         );
-        tbb::atomic_fence(); // make sure all writes are visible on all CPUs
+    }
 
-        // Serial
-        // Clear the nearest vectors in each cluster
-        for (Cluster<T> *c : _clusters) {
-            c->clearNearest();
+    /**
+     * Dense vectors are copied into a KeyMatrix a block at a time, and the
+     * distances between the block and all centroids are calculated with
+     * matrix multiplication.
+     */
+    template <typename V>
+    void nearestCentroids(vector<T*> &data, KeyMatrix<V>& centroids) {
+        if (_centroids.size() < _minMatrixClusters || data.empty()) {
+            NoNodeCache none;
+            nearestCentroids(data, none);
+            return;
         }
-        // Accumlate into clusters
-        for (size_t i = 0; i < data.size(); i++) {
-            size_t nearest = _nearestCentroid[i];
-            _clusters[nearest]->addNearest(data[i]);
+        const size_t dimensions = data[0]->size();
+        centroids.resize(_centroids.size(), dimensions);
+        for (size_t i = 0; i < _centroids.size(); ++i) {
+            centroids.setRow(i, _centroids[i]->begin(), _optimizer.norm(_centroids[i]));
         }
-
-
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, data.size(), 256),
+                [&](const tbb::blocked_range<size_t>& r) {
+                    KeyMatrix<V> objects;
+                    objects.resize(r.size(), dimensions);
+                    for (size_t i = r.begin(); i != r.end(); ++i) {
+                        objects.setRow(i - r.begin(), data[i]->begin(),
+                                _optimizer.norm(data[i]));
+                    }
+                    vector<size_t> nearest(r.size());
+                    _optimizer.nearest(objects, centroids, &nearest[0]);
+                    for (size_t i = r.begin(); i != r.end(); ++i) {
+                        if (nearest[i - r.begin()] != _nearestCentroid[i]) {
+                            _converged = false;
+                        }
+                        _nearestCentroid[i] = nearest[i - r.begin()];
+                    }
+                }
+        );
     }
 
     /**
@@ -241,6 +299,12 @@ private:
     int _numClusters = 0;
 
     vector<T*> _centroids;
+
+    // The centroids in contiguous memory for dense vectors
+    typename KeyCache<T, typename OPTIMIZER::distance_type>::type _centroidMatrix;
+
+    // Use matrix multiplication for at least this many clusters
+    size_t _minMatrixClusters = 8;
     vector<Cluster<T>*> _clusters;
     vector<Cluster<T>*> _finalClusters;
 
@@ -43,6 +43,10 @@ public:
         delete _root;
     }
 
+    Node<T>* getMWayTree() {
+        return _root;
+    }
+
     void setUpdateDelay(int updateDelay) {
         _updateDelay = updateDelay;
     }
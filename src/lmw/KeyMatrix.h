@@ -0,0 +1,154 @@
+/**
+ * This file contains KeyMatrix, a copy of the keys in a Node stored in one
+ * aligned row-major block of memory along with their norms. Finding the
+ * nearest key is then a scan over contiguous memory instead of following a
+ * pointer to each key and its data.
+ *
+ * A KeyMatrix is used as the CACHE of a Node when the DISTANCE can be
+ * calculated from a dot product and norms, see DotProductDistance in
+ * Distance.h. KeyCache chooses the CACHE type for a vector type and DISTANCE.
+ *
+ * For example,
+ *      KeyMatrix<float> matrix;
+ *      matrix.resize(keys.size(), 200);
+ *      for (size_t i = 0; i < keys.size(); i++) {
+ *          matrix.setRow(i, keys[i]->begin(), norms[i]);
+ *      }
+ *      double dots[10];
+ *      matrix.dot(vector->begin(), 0, 10, dots);
+ */
+
+#ifndef KEYMATRIX_H
+#define	KEYMATRIX_H
+
+#include "StdIncludes.h"
+#include "Distance.h"
+#include "Node.h"
+#include "VectorKernels.h"
+
+#include <cstdlib>
+#include <cstring>
+
+namespace lmw {
+
+template <typename V>
+class KeyMatrix {
+public:
+    KeyMatrix() : _data(NULL), _capacity(0), _rows(0), _dimensions(0),
+            _stride(0) { }
+
+    ~KeyMatrix() {
+        free(_data);
+    }
+
+    /**
+     * Sets the shape of the matrix. The rows are zeroed, including the
+     * padding at the end of each row.
+     */
+    void resize(const size_t rows, const size_t dimensions) {
+        const size_t perAlignment = VectorKernels::ROW_ALIGNMENT / sizeof (V);
+        _rows = rows;
+        _dimensions = dimensions;
+        _stride = (dimensions + perAlignment - 1) / perAlignment * perAlignment;
+        size_t required = _rows * _stride;
+        if (required > _capacity) {
+            free(_data);
+            _data = NULL;
+            _capacity = 0;
+            void* memory;
+            if (posix_memalign(&memory, VectorKernels::ROW_ALIGNMENT,
+                    required * sizeof (V)) != 0) {
+                throw std::bad_alloc();
+            }
+            _data = static_cast<V*>(memory);
+            _capacity = required;
+        }
+        if (required > 0) {
+            memset(_data, 0, required * sizeof (V));
+        }
+        _norms.assign(rows, 0);
+    }
+
+    void swap(KeyMatrix& other) {
+        std::swap(_data, other._data);
+        std::swap(_capacity, other._capacity);
+        std::swap(_rows, other._rows);
+        std::swap(_dimensions, other._dimensions);
+        std::swap(_stride, other._stride);
+        _norms.swap(other._norms);
+    }
+
+    void setRow(const size_t i, const V* values, const double norm) {
+        std::copy(values, values + _dimensions, row(i));
+        _norms[i] = norm;
+    }
+
+    V* row(const size_t i) {
+        return _data + i * _stride;
+    }
+
+    const V* row(const size_t i) const {
+        return _data + i * _stride;
+    }
+
+    double norm(const size_t i) const {
+        return _norms[i];
+    }
+
+    /**
+     * Calculates the dot product of x with count rows starting at first.
+     */
+    void dot(const V* x, const size_t first, const size_t count,
+            double* out) const {
+        VectorKernels::dotRows(x, row(first), count, _dimensions, _stride, out);
+    }
+
+    /**
+     * Calculates the dot product of every row with count rows of keys
+     * starting at first. out is row-major with size() rows of count values.
+     */
+    void dot(const KeyMatrix& keys, const size_t first, const size_t count,
+            double* out) const {
+        VectorKernels::dotRowsBlock(_data, _rows, _stride, keys.row(first),
+                count, keys._stride, _dimensions, out, count);
+    }
+
+    size_t size() const {
+        return _rows;
+    }
+
+    size_t dimensions() const {
+        return _dimensions;
+    }
+
+private:
+    KeyMatrix(const KeyMatrix&);
+    KeyMatrix& operator=(const KeyMatrix&);
+
+    V* _data; // _rows * _stride values aligned to VectorKernels::ROW_ALIGNMENT
+    size_t _capacity;
+    size_t _rows;
+    size_t _dimensions;
+    size_t _stride;
+    vector<double> _norms;
+};
+
+/**
+ * The Node CACHE for keys of type T compared using DISTANCE. It is a
+ * KeyMatrix for dense vectors compared by a DotProductDistance, otherwise
+ * nothing is cached.
+ */
+template <typename T, typename DISTANCE,
+        bool DOT = DotProductDistance<DISTANCE>::value>
+struct KeyCache {
+    typedef NoNodeCache type;
+};
+
+template <typename T, typename DISTANCE>
+struct KeyCache<T, DISTANCE, true> {
+    typedef KeyMatrix<typename T::value_type> type;
+};
+
+} // namespace lmw
+
+#endif	/* KEYMATRIX_H */
@@ -5,7 +5,17 @@
 
 namespace lmw {
 
-template <typename T>
+/**
+ * The default CACHE for a Node, which stores nothing.
+ */
+struct NoNodeCache { };
+
+/**
+ * CACHE is extra state about the keys kept in each node, for example, a
+ * KeyMatrix with a copy of the keys in contiguous memory. The Node does not
+ * maintain it, so it must be rebuilt by the tree whenever the keys change.
+ */
+template <typename T, typename CACHE = NoNodeCache>
 class Node {
 public:
     Node() : _isLeaf(true), _ownsKeys(false) { }
@@ -74,6 +84,14 @@ public:
         return _children;
     }
 
+    CACHE& getCache() {
+        return _cache;
+    }
+
+    const CACHE& getCache() const {
+        return _cache;
+    }
+
     void clearKeysAndChildren() {
         _children.clear();
         _keys.clear();
@@ -105,7 +123,7 @@ public:
         }
     }
 
-    void removeData(vector<T*>& keys, vector<Node<T>*>& children) {
+    void removeData(vector<T*>& keys, vector<Node*>& children) {
         std::copy(_keys.begin(), _keys.end(), std::back_inserter(keys));
         _keys.clear();
         std::copy(_children.begin(), _children.end(), std::back_inserter(children));
@@ -170,6 +188,8 @@ private:
 
     // Will the keys be deleted?
     bool _ownsKeys;
+
+    CACHE _cache;
 };
 
 } // namespace lmw
@@ -16,6 +16,7 @@
 #define	OPTIMIZER_H
 
 #include "StdIncludes.h"
+#include "Distance.h"
 
 namespace lmw {
 
@@ -41,10 +42,20 @@ struct Nearest {
 template <typename T, typename DISTANCE, typename COMPARATOR, typename PROTOTYPE>
 class Optimizer {
 public:
+    typedef DISTANCE distance_type;
 
     void updatePrototype(T* prototype, const vector<T*>& neighbours,
             const vector<int>& weights) const {
         _prototype(prototype, neighbours, weights);
+        _distance.prepare(prototype);
+    }
+
+    /**
+     * Puts an object into the form expected by the DISTANCE function. It must
+     * be called on every object before it is compared to a prototype.
+     */
+    void prepare(T* object) const {
+        _distance.prepare(object);
     }
 
     Nearest<T> nearest(const T* object, const vector<T*>& others) const {
@@ -65,6 +76,224 @@ public:
         return nearestAccessor(object, others, accessor);
     }
 
+    /**
+     * The norm of object used by the DISTANCE function. It can be cached and
+     * passed to the norm aware nearest().
+     */
+    double norm(const T* object) const {
+        return _distance.norm(object);
+    }
+
+    /**
+     * A version of nearest() where the norms of the object and the keys have
+     * already been calculated by norm(). NORM_ACCESSOR implements
+     * double operator()(KEY* key) and returns the cached norm of the key.
+     *
+     * For example, StreamingEMTree caches the norm of each key, so comparing
+     * a vector with a key using cosine similarity is only a dot product.
+     */
+    template <typename KEY, typename ACCESSOR, typename NORM_ACCESSOR>
+    Nearest<KEY> nearest(const T* object, const double objectNorm,
+            const vector<KEY*>& others, const ACCESSOR& accessor,
+            const NORM_ACCESSOR& normAccessor) const {
+        size_t nearestIndex = 0;
+        double nearestDistance = _distance(object, objectNorm,
+                accessor(others[0]), normAccessor(others[0]));
+        for (size_t i = 1; i < others.size(); ++i) {
+            double currentDistance = _distance(object, objectNorm,
+                    accessor(others[i]), normAccessor(others[i]));
+            if (_comp(currentDistance, nearestDistance)) {
+                nearestDistance = currentDistance;
+                nearestIndex = i;
+            }
+        }
+        return {others[nearestIndex], nearestIndex, nearestDistance};
+    }
+
+    /**
+     * A version of the norm aware nearest() where the keys are also stored in
+     * a KeyMatrix. Only available when DotProductDistance<DISTANCE>::value is
+     * true. The rows of matrix must match others.
+     */
+    template <typename KEY, typename MATRIX>
+    Nearest<KEY> nearest(const T* object, const double objectNorm,
+            const vector<KEY*>& others, const MATRIX& matrix) const {
+        Nearest<void> row = nearestRow(object, objectNorm, matrix, 0, matrix.size());
+        return {others[row.index], row.index, row.distance};
+    }
+
+    /**
+     * Finds the nearest of count rows of a KeyMatrix starting at row first.
+     * The index returned is relative to first and key is NULL. count must not
+     * be 0. Only available when DotProductDistance<DISTANCE>::value is true.
+     *
+     * For example, FrozenTree stores the keys of all nodes in one KeyMatrix
+     * and searches the rows of one node at a time.
+     */
+    template <typename MATRIX>
+    Nearest<void> nearestRow(const T* object, const double objectNorm,
+            const MATRIX& matrix, const size_t first, const size_t count) const {
+        typedef DotProductDistance<DISTANCE> Dot;
+        const size_t block = 64;
+        double dots[block];
+        size_t nearestIndex = 0;
+        double nearestDistance = 0;
+        for (size_t offset = 0; offset < count; offset += block) {
+            size_t n = std::min(block, count - offset);
+            matrix.dot(object->begin(), first + offset, n, dots);
+            for (size_t j = 0; j < n; ++j) {
+                size_t i = offset + j;
+                double currentDistance = Dot::distance(dots[j], objectNorm,
+                        matrix.norm(first + i));
+                if (i == 0 || _comp(currentDistance, nearestDistance)) {
+                    nearestDistance = currentDistance;
+                    nearestIndex = i;
+                }
+            }
+        }
+        return {NULL, nearestIndex, nearestDistance};
+    }
+
+    /**
+     * The most rows compared again by nearestQuantizedRow().
+     */
+    static const size_t MAX_RERANK = 16;
+
+    /**
+     * Finds the nearest row of a KeyMatrix using the approximate dot
+     * products of query with the same rows quantized in an Int8KeyMatrix,
+     * see Int8KeyMatrix.h. When rerank is not 0, the rerank nearest rows by
+     * approximate distance are compared again with the exact rows, otherwise
+     * the distance returned is approximate. key is NULL. matrix must not be
+     * empty. Only available when DotProductDistance<DISTANCE>::value is true.
+     */
+    template <typename MATRIX, typename QUANTIZED, typename QUERY>
+    Nearest<void> nearestQuantizedRow(const T* object, const double objectNorm,
+            const MATRIX& matrix, const QUANTIZED& quantized,
+            const QUERY& query, const size_t rerank) const {
+        typedef DotProductDistance<DISTANCE> Dot;
+        if (matrix.size() == 0) {
+            throw runtime_error("no rows to find the nearest of");
+        }
+        const size_t block = 64;
+        const size_t keep = std::min(std::max(rerank, size_t(1)), size_t(MAX_RERANK));
+        double dots[block];
+        Nearest<void> candidates[MAX_RERANK] = {}; // nearest first
+        size_t found = 0;
+        for (size_t first = 0; first < matrix.size(); first += block) {
+            size_t count = std::min(block, matrix.size() - first);
+            quantized.dot(query, first, count, dots);
+            for (size_t j = 0; j < count; ++j) {
+                double distance = Dot::distance(dots[j], objectNorm,
+                        matrix.norm(first + j));
+                if (found == keep && !_comp(distance, candidates[found - 1].distance)) {
+                    continue;
+                }
+                size_t position = found < keep ? found++ : found - 1;
+                for (; position > 0 && _comp(distance, candidates[position - 1].distance);
+                        --position) {
+                    candidates[position] = candidates[position - 1];
+                }
+                candidates[position] = {NULL, first + j, distance};
+            }
+        }
+        if (rerank == 0) {
+            return candidates[0];
+        }
+        Nearest<void> nearest = candidates[0];
+        for (size_t i = 0; i < found; ++i) {
+            double dot;
+            matrix.dot(object->begin(), candidates[i].index, 1, &dot);
+            double distance = Dot::distance(dot, objectNorm,
+                    matrix.norm(candidates[i].index));
+            if (i == 0 || _comp(distance, nearest.distance)) {
+                nearest = {NULL, candidates[i].index, distance};
+            }
+        }
+        return nearest;
+    }
+
+    /**
+     * Is distance1 nearer than distance2 according to the COMPARATOR?
+     */
+    bool nearer(const double distance1, const double distance2) const {
+        return _comp(distance1, distance2);
+    }
+
+    /**
+     * Calculates the distance from object to every object in others, out
+     * must have space for others.size() values.
+     */
+    void distances(const T* object, const vector<T*>& others,
+            double* out) const {
+        for (size_t i = 0; i < others.size(); ++i) {
+            out[i] = _distance(object, others[i]);
+        }
+    }
+
+    /**
+     * Calculates the distance from object to every key in others, out must
+     * have space for others.size() values. The norms are cached as for the
+     * norm aware nearest().
+     */
+    template <typename KEY, typename ACCESSOR, typename NORM_ACCESSOR>
+    void distances(const T* object, const double objectNorm,
+            const vector<KEY*>& others, const ACCESSOR& accessor,
+            const NORM_ACCESSOR& normAccessor, double* out) const {
+        for (size_t i = 0; i < others.size(); ++i) {
+            out[i] = _distance(object, objectNorm, accessor(others[i]),
+                    normAccessor(others[i]));
+        }
+    }
+
+    /**
+     * Calculates the distance from object to count rows of a KeyMatrix
+     * starting at row first. Only available when
+     * DotProductDistance<DISTANCE>::value is true.
+     */
+    template <typename MATRIX>
+    void distances(const T* object, const double objectNorm,
+            const MATRIX& matrix, const size_t first, const size_t count,
+            double* out) const {
+        typedef DotProductDistance<DISTANCE> Dot;
+        matrix.dot(object->begin(), first, count, out);
+        for (size_t i = 0; i < count; ++i) {
+            out[i] = Dot::distance(out[i], objectNorm, matrix.norm(first + i));
+        }
+    }
+
+    /**
+     * Finds the nearest row of keys for every row of objects using matrix
+     * multiplication. The norms stored in both matrices must come from
+     * norm(). Only available when DotProductDistance<DISTANCE>::value is true.
+     *
+     * nearestIndex must have space for objects.size() values.
+     */
+    template <typename MATRIX>
+    void nearest(const MATRIX& objects, const MATRIX& keys,
+            size_t* nearestIndex) const {
+        typedef DotProductDistance<DISTANCE> Dot;
+        const size_t block = 64;
+        vector<double> dots(objects.size() * block);
+        vector<double> nearestDistance(objects.size());
+        for (size_t first = 0; first < keys.size(); first += block) {
+            size_t count = std::min(block, keys.size() - first);
+            objects.dot(keys, first, count, &dots[0]);
+            for (size_t i = 0; i < objects.size(); ++i) {
+                const double* row = &dots[i * count];
+                for (size_t j = 0; j < count; ++j) {
+                    double currentDistance = Dot::distance(row[j],
+                            objects.norm(i), keys.norm(first + j));
+                    if ((first == 0 && j == 0)
+                            || _comp(currentDistance, nearestDistance[i])) {
+                        nearestDistance[i] = currentDistance;
+                        nearestIndex[i] = first + j;
+                    }
+                }
+            }
+        }
+    }
+
     double squaredDistance(const T* object1, const T* object2) const {
         return _distance.squared(object1, object2);
     }
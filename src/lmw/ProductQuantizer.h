@@ -0,0 +1,223 @@
+/**
+ * ProductQuantizer compresses dense vectors to a few bytes each. The
+ * dimensions are split into subspaces, and each subspace has a codebook of up
+ * to 256 centroids trained with KMeans on the sub-vectors of a sample. A
+ * vector is encoded as the index of the nearest centroid in each subspace,
+ * so a code is one byte per subspace. A 200 dimensional float vector of 800
+ * bytes encodes to 16 to 64 bytes.
+ *
+ * Distances to codes are asymmetric. The query is not quantized, and a table
+ * of the dot products between the query and every centroid is built once.
+ * The dot product with a code is then a sum of one table entry per subspace.
+ * The subspaces are disjoint, so the norm of a decoded vector is the root of
+ * the sum of the squared norms of its centroids, and DotProductDistance
+ * turns the dot products and norms into a distance.
+ *
+ * For example,
+ *      ProductQuantizer<SVector<float>> pq(200, 32);
+ *      pq.train(sample);
+ *      vector<uint8_t> code(pq.codeBytes());
+ *      pq.encode(vector->begin(), &code[0]);
+ *      vector<float> table(pq.tableSize());
+ *      pq.dotTable(query->begin(), &table[0]);
+ *      double dot = pq.dot(&table[0], &code[0]);
+ */
+
+#ifndef PRODUCTQUANTIZER_H
+#define	PRODUCTQUANTIZER_H
+
+#include "StdIncludes.h"
+#include "Distance.h"
+#include "KeyMatrix.h"
+#include "KMeans.h"
+#include "Optimizer.h"
+#include "Prototype.h"
+#include "RandomSeeder.h"
+
+namespace lmw {
+
+template <typename T>
+class ProductQuantizer {
+public:
+    typedef typename T::value_type V;
+
+    static const size_t CENTROIDS = 256;
+
+    /**
+     * subspaces must divide dimensions and is the size of a code in bytes.
+     */
+    ProductQuantizer(const size_t dimensions, const size_t subspaces) :
+            _dimensions(dimensions), _subspaces(subspaces), _trained(false) {
+        if (subspaces == 0 || dimensions % subspaces != 0) {
+            throw runtime_error("the number of subspaces must divide the dimensions");
+        }
+        _subDimensions = dimensions / subspaces;
+        _codebooks.resize(_subspaces * CENTROIDS, _subDimensions);
+        _sizes.assign(_subspaces, 0);
+        _squaredNorms.assign(_subspaces * CENTROIDS, 0);
+    }
+
+    /**
+     * Trains the codebook of every subspace with maxIters of KMeans on the
+     * sub-vectors of sample.
+     */
+    void train(const vector<T*>& sample, const int maxIters = 10) {
+        if (sample.size() < CENTROIDS) {
+            throw runtime_error("a product quantizer needs a sample of at least 256 vectors");
+        }
+        vector<T*> subVectors;
+        for (size_t s = 0; s < _subspaces; s++) {
+            for (T* object : sample) {
+                T* subVector = new T(_subDimensions);
+                std::copy(object->begin() + s * _subDimensions,
+                        object->begin() + (s + 1) * _subDimensions,
+                        subVector->begin());
+                subVectors.push_back(subVector);
+            }
+            SubspaceKMeans kmeans(CENTROIDS);
+            kmeans.setMaxIters(maxIters);
+            vector<Cluster<T>*>& clusters = kmeans.cluster(subVectors);
+            _sizes[s] = clusters.size();
+            // clusters do not own their centroids
+            vector<T*> centroids;
+            for (size_t c = 0; c < clusters.size(); c++) {
+                T* centroid = clusters[c]->getCentroid();
+                double squaredNorm = VectorKernels::dot(centroid->begin(),
+                        centroid->begin(), _subDimensions);
+                _codebooks.setRow(s * CENTROIDS + c, centroid->begin(), sqrt(squaredNorm));
+                _squaredNorms[s * CENTROIDS + c] = squaredNorm;
+                centroids.push_back(centroid);
+            }
+            Utils::purge(centroids);
+            Utils::purge(subVectors);
+            subVectors.clear();
+        }
+        _trained = true;
+    }
+
+    bool isTrained() const {
+        return _trained;
+    }
+
+    size_t dimensions() const {
+        return _dimensions;
+    }
+
+    size_t subspaces() const {
+        return _subspaces;
+    }
+
+    size_t codeBytes() const {
+        return _subspaces;
+    }
+
+    /**
+     * The number of floats in a table built by dotTable().
+     */
+    size_t tableSize() const {
+        return _subspaces * CENTROIDS;
+    }
+
+    /**
+     * Writes the code of the nearest centroids to values into code, which
+     * must have space for codeBytes().
+     */
+    void encode(const V* values, uint8_t* code) const {
+        double dots[CENTROIDS];
+        for (size_t s = 0; s < _subspaces; s++) {
+            const size_t first = s * CENTROIDS;
+            _codebooks.dot(values + s * _subDimensions, first, _sizes[s], dots);
+            // |x - c|^2 = |x|^2 - 2 x.c + |c|^2 and |x|^2 is the same for all c
+            size_t nearest = 0;
+            double nearestDistance = 0;
+            for (size_t c = 0; c < _sizes[s]; c++) {
+                double distance = _squaredNorms[first + c] - 2 * dots[c];
+                if (c == 0 || distance < nearestDistance) {
+                    nearestDistance = distance;
+                    nearest = c;
+                }
+            }
+            code[s] = static_cast<uint8_t>(nearest);
+        }
+    }
+
+    /**
+     * Writes the centroids of code into values, which must have space for
+     * dimensions().
+     */
+    void decode(const uint8_t* code, V* values) const {
+        for (size_t s = 0; s < _subspaces; s++) {
+            const V* centroid = _codebooks.row(s * CENTROIDS + code[s]);
+            std::copy(centroid, centroid + _subDimensions, values + s * _subDimensions);
+        }
+    }
+
+    /**
+     * The L2 norm of the decoded vector.
+     */
+    double norm(const uint8_t* code) const {
+        double squaredNorm = 0;
+        for (size_t s = 0; s < _subspaces; s++) {
+            squaredNorm += _squaredNorms[s * CENTROIDS + code[s]];
+        }
+        return sqrt(squaredNorm);
+    }
+
+    /**
+     * Builds the table of dot products between query and every centroid.
+     * table must have space for tableSize() floats.
+     */
+    void dotTable(const V* query, float* table) const {
+        double dots[CENTROIDS];
+        for (size_t s = 0; s < _subspaces; s++) {
+            _codebooks.dot(query + s * _subDimensions, s * CENTROIDS, _sizes[s], dots);
+            std::copy(dots, dots + _sizes[s], table + s * CENTROIDS);
+        }
+    }
+
+    /**
+     * The dot product of the query of table with the decoded vector of code.
+     */
+    double dot(const float* table, const uint8_t* code) const {
+        float sum = 0;
+        for (size_t s = 0; s < _subspaces; s++) {
+            sum += table[s * CENTROIDS + code[s]];
+        }
+        return sum;
+    }
+
+    /**
+     * Calculates the dot product of the query of table with count codes
+     * stored one after another.
+     */
+    void dots(const float* table, const uint8_t* codes, const size_t count,
+            double* out) const {
+        for (size_t i = 0; i < count; i++) {
+            out[i] = dot(table, codes + i * _subspaces);
+        }
+    }
+
+private:
+    // Sub-vectors are clustered by squared Euclidean distance, which is the
+    // error of the quantization.
+    typedef Optimizer<T, euclideanDistanceSq<T>, Minimize, meanPrototype<T>>
+            SubspaceOptimizer;
+    typedef KMeans<T, RandomSeeder<T>, SubspaceOptimizer> SubspaceKMeans;
+
+    ProductQuantizer(const ProductQuantizer&);
+    ProductQuantizer& operator=(const ProductQuantizer&);
+
+    size_t _dimensions;
+    size_t _subspaces;
+    size_t _subDimensions;
+    bool _trained;
+
+    // Centroid c of subspace s is row s * CENTROIDS + c
+    KeyMatrix<V> _codebooks;
+    vector<size_t> _sizes; // the number of centroids of each subspace
+    vector<double> _squaredNorms;
+};
+
+} // namespace lmw
+
+#endif	/* PRODUCTQUANTIZER_H */
@@ -310,6 +310,57 @@ struct meanBitPrototype8 {
 
 };
 
+/**
+ * ACCUMULATOR_PROTOTYPE functions turn the accumulator of a cluster in
+ * StreamingEMTree, the sum of count objects, into the prototype of the
+ * cluster. They must be thread safe like a PROTOTYPE.
+ *
+ * The only required operation is,
+ *      void operator()(T* result, const ACCUMULATOR& sum, uint64_t count)
+ *
+ * AccumulatorPrototype<T>::type is the usual one for vectors of type T, the
+ * mean for dense vectors and a majority vote for bit vectors.
+ */
+struct meanAccumulatorPrototype {
+    template <typename T, typename ACCUMULATOR>
+    void operator()(T* t1, const ACCUMULATOR& sum, const uint64_t count) const {
+        for (size_t i = 0; i < t1->size(); i++) {
+            t1->set(i, sum[i] / double(count));
+        }
+    }
+};
+
+/**
+ * Sets the bits that are set in more than half of the objects, like
+ * meanBitPrototype2. The bits of a block are collected in a register and
+ * written once.
+ */
+struct majorityBitAccumulatorPrototype {
+    template <typename ACCUMULATOR>
+    void operator()(SVector<bool>* t1, const ACCUMULATOR& sum,
+            const uint64_t count) const {
+        const uint64_t halfCount = count / 2;
+        block_type* data = t1->getData();
+        for (size_t block = 0; block < t1->getNumBlocks(); block++) {
+            block_type bits = 0;
+            for (size_t i = 0; i < W_SIZE; i++) {
+                bits |= block_type(uint64_t(sum[block * W_SIZE + i]) > halfCount) << i;
+            }
+            data[block] = bits;
+        }
+    }
+};
+
+template <typename T>
+struct AccumulatorPrototype {
+    typedef meanAccumulatorPrototype type;
+};
+
+template <>
+struct AccumulatorPrototype<SVector<bool>> {
+    typedef majorityBitAccumulatorPrototype type;
+};
+
 } // namespace lmw
 
 #endif	/* PROTOTYPE_H */
@@ -0,0 +1,109 @@
+/**
+ * RandomProjection turns dense vectors into bit signatures with random
+ * hyperplanes, also known as SimHash. Bit b of a signature is set when the
+ * vector is on the positive side of hyperplane b. The hyperplanes have
+ * normally distributed components, so two vectors at an angle theta differ
+ * in each bit with probability theta / pi, and the Hamming distance between
+ * signatures estimates the cosine distance between the vectors.
+ *
+ * Signatures are compared with hammingDistance, which reads a bit per
+ * dimension instead of 32 or 64, so clustering doc2vec vectors in Hamming
+ * space costs a fraction of clustering them with cosine similarity. The
+ * hyperplanes are rows of a KeyMatrix, so projecting a vector is one scan
+ * over contiguous memory with the dot product kernels.
+ *
+ * A RandomProjection is also a FILTER for StreamingEMTree::insert(), so a
+ * stream of dense vectors is projected in the pipeline while it is inserted
+ * into a tree of signatures.
+ *
+ * For example,
+ *      RandomProjection<SVector<float>> projection(200, 1024);
+ *      SVector<bool>* signature = projection.allocate();
+ *      projection(vector, signature);
+ */
+
+#ifndef RANDOMPROJECTION_H
+#define	RANDOMPROJECTION_H
+
+#include "StdIncludes.h"
+#include "KeyMatrix.h"
+#include "SVector.h"
+
+namespace lmw {
+
+template <typename T>
+class RandomProjection {
+public:
+    typedef T source_type;
+    typedef SVector<bool> target_type;
+    typedef typename T::value_type V;
+
+    /**
+     * bits must be a multiple of 64, the block size of SVector<bool>. The
+     * same seed always gives the same hyperplanes.
+     */
+    RandomProjection(const size_t dimensions, const size_t bits,
+            const uint32_t seed = 1) : _dimensions(dimensions), _bits(bits) {
+        if (bits == 0 || bits % W_SIZE != 0) {
+            throw runtime_error("the number of bits must be a multiple of 64");
+        }
+        RND_ENG eng(seed);
+        RND_NORMAL normal(0, 1);
+        RND_NORM_GEN_01 gen(eng, normal);
+        vector<V> plane(dimensions);
+        _planes.resize(bits, dimensions);
+        for (size_t b = 0; b < bits; b++) {
+            for (size_t i = 0; i < dimensions; i++) {
+                plane[i] = gen();
+            }
+            _planes.setRow(b, &plane[0], 1);
+        }
+    }
+
+    size_t dimensions() const {
+        return _dimensions;
+    }
+
+    size_t bits() const {
+        return _bits;
+    }
+
+    /**
+     * A new signature of bits() length for operator().
+     */
+    SVector<bool>* allocate() const {
+        return new SVector<bool>(_bits);
+    }
+
+    /**
+     * Writes the signature of object into signature, which must have bits()
+     * length.
+     */
+    void operator()(const T* object, SVector<bool>* signature) const {
+        if (object->size() != _dimensions) {
+            throw runtime_error("vector has the wrong number of dimensions to project");
+        }
+        double dots[W_SIZE];
+        block_type* blocks = signature->getData();
+        for (size_t block = 0; block < _bits / W_SIZE; block++) {
+            _planes.dot(object->begin(), block * W_SIZE, W_SIZE, dots);
+            block_type bits = 0;
+            for (size_t i = 0; i < W_SIZE; i++) {
+                bits |= block_type(dots[i] >= 0) << i;
+            }
+            blocks[block] = bits;
+        }
+    }
+
+private:
+    RandomProjection(const RandomProjection&);
+    RandomProjection& operator=(const RandomProjection&);
+
+    size_t _dimensions;
+    size_t _bits;
+    KeyMatrix<V> _planes; // hyperplane b is row b
+};
+
+} // namespace lmw
+
+#endif	/* RANDOMPROJECTION_H */
@@ -16,12 +16,22 @@ typedef uint64_t block_type;
 template <class T>
 class SVector {
 public:
-    SVector(const size_t length) {
+    SVector(const size_t length) : _id(0), _ownsData(true) {
         _length = length;
         _data = new T[_length];
     }
 
-    SVector(const SVector<T>& other) {
+    /**
+     * Wraps memory owned by someone else, for example, a memory mapped vector
+     * file. The memory is not copied or freed, so it must outlive the vector.
+     * Copies of the vector own their own memory.
+     */
+    SVector(T* data, const size_t length) : _id(0), _ownsData(false) {
+        _length = length;
+        _data = data;
+    }
+
+    SVector(const SVector<T>& other) : _id(other._id), _ownsData(true) {
         _length = other._length;
         _data = new T[_length];
         for (size_t i = 0; i < _length; i++) {
@@ -30,9 +40,12 @@ public:
     }
 
     ~SVector() {
-        delete[] _data;
+        if (_ownsData) {
+            delete[] _data;
+        }
     }
 
+    typedef T value_type;
     typedef T * iterator;
     typedef const T * const_iterator;
 
@@ -41,7 +54,7 @@ public:
     }
     
     const_iterator begin() const {
-        return begin();
+        return &_data[0];
     }
 
     iterator end() {
@@ -49,7 +62,7 @@ public:
     }
 
     const_iterator end() const {
-        return end();
+        return &_data[_length];
     }    
 
     T& operator[](size_t i) {
@@ -68,13 +81,17 @@ public:
         return _data[i];
     }
 
-	void setID(const string& id) {
-		_id = id;
-	}
+    /**
+     * The ordinal of the object in its stream. Streams resolve it to the
+     * object ID with an IdTable when it is needed, see IdTable.h.
+     */
+    void setID(const uint64_t id) {
+        _id = id;
+    }
 
-	const string& getID() const {
-		return _id;
-	}
+    uint64_t getID() const {
+        return _id;
+    }
 
     void set(const size_t i, const T& val) {
         _data[i] = val;
@@ -118,20 +135,21 @@ public:
 protected:
     T* _data;
     size_t _length;
-	string _id;
+    uint64_t _id; // ordinal of the object, not its ID
+    bool _ownsData; // false when wrapping memory owned by someone else
 };
 
 /// Template specialization for bit vector
 template <>
 class SVector <bool> {
 public:
-    SVector(const size_t length) {
+    SVector(const size_t length) : _id(0) {
         _length = length;
         _numBlocks = _length >> BITS_WS;
-        _data = new block_type[_numBlocks];
+        _data = new block_type[_numBlocks]();
     }
 
-    SVector(void* bytes, const size_t length) {
+    SVector(void* bytes, const size_t length) : _id(0) {
         size_t numBytes = length / 8;
         _length = length;
         _numBlocks = _length >> BITS_WS;
@@ -143,10 +161,11 @@ public:
         _length = vec._length;
         _numBlocks = vec._numBlocks;
         _data = new block_type[_numBlocks];
+        _id = vec._id;
 
         // initialise bit vector
         for (int i = 0; i < _numBlocks; i++) {
-            setBlock(i, vec._data[i]);
+            _data[i] = vec._data[i];
         }
     }
 
@@ -154,11 +173,14 @@ public:
         delete[] _data;
     }
 
-    void setID(const string& id) {
+    /**
+     * The ordinal of the object in its stream, see SVector<T>::setID().
+     */
+    void setID(const uint64_t id) {
         _id = id;
     }
 
-    const string& getID() const {
+    uint64_t getID() const {
         return _id;
     }
 
@@ -367,7 +389,7 @@ private:
     block_type* _data;
     int _numBlocks;
     size_t _length;
-    string _id;
+    uint64_t _id; // ordinal of the object, not its ID
 };
 
 } // namespace lmw
@@ -3,6 +3,12 @@
 
 #include "StdIncludes.h"
 #include "SVector.h"
+#include "Doc2VecParser.h"
+#include "VectorFile.h"
+#include "IdTable.h"
+#include "tbb/concurrent_queue.h"
+
+#include <cerrno>
 
 namespace lmw {
 
@@ -29,7 +35,121 @@ namespace lmw {
  *          process(&data);
  *          bvs.free(&data);
  *      }
+ *
+ * For parallel processing a stream is also read in chunks. Reading a chunk is
+ * cheap and happens in serial, parsing the chunk into vectors is expensive
+ * and can happen for many chunks in parallel.
+ *
+ * SVectorChunk<SVECTOR>* VectorStream<T>.readChunk(size_t n)
+ *      reads the raw data for up to n vectors, returns NULL at the end
+ *
+ * void VectorStream<T>.parseChunk(SVectorChunk<SVECTOR>* chunk)
+ *      fills chunk->vectors, must be thread safe
+ *
+ * void VectorStream<T>.freeChunk(SVectorChunk<SVECTOR>* chunk)
+ *      frees the chunk and its vectors, must be thread safe
+ *
+ * Streams that do not need parsing read vectors directly in readChunk.
+ * Streams of dense vectors keep the values and the SVector objects of a chunk
+ * in arenas owned by the chunk, and recycle chunks through a ChunkPool.
+ *
+ * Vectors carry an ordinal instead of their object ID. The stream resolves
+ * ordinals to IDs with an IdTable,
+ *
+ * const IdTable& VectorStream<T>.ids()
+ *      the IDs of the vectors read so far, indexed by SVector::getID()
  */
+template <typename SVECTOR>
+struct SVectorChunk {
+    SVectorChunk() : records(0), firstLine(0) { }
+
+    /**
+     * Empties the chunk and keeps the capacity of its buffers.
+     */
+    void clear() {
+        records = 0;
+        firstLine = 0;
+        bytes.clear();
+        arena.clear();
+        vectors.clear();
+        views.clear();
+        ids.clear();
+    }
+
+    // The number of records read from the stream, including blank lines.
+    size_t records;
+
+    // Raw line aligned text followed by a null character, or the rows of a
+    // binary stream. It is empty when the stream reads vectors directly.
+    vector<char> bytes;
+
+    // The line number of the first line in bytes, used for error messages.
+    size_t firstLine;
+
+    vector<SVECTOR*> vectors;
+
+    // The values of vectors parsed from bytes, so all the vectors in a chunk
+    // share one allocation.
+    vector<char> arena;
+
+    // When it is not empty, the vectors point at these views into bytes,
+    // arena or memory owned by the stream, and are not deleted one by one.
+    vector<SVECTOR> views;
+
+    // The object IDs in bytes while a chunk is parsed.
+    vector<pair<const char*, const char*>> ids;
+};
+
+/**
+ * A free list of chunks shared by the threads of a pipeline. A recycled chunk
+ * keeps the capacity of its buffers, so once a pipeline is full reading and
+ * parsing chunks does not allocate memory. At most maxFree chunks are kept.
+ */
+template <typename SVECTOR>
+class ChunkPool {
+public:
+    typedef SVectorChunk<SVECTOR> Chunk;
+
+    explicit ChunkPool(const size_t maxFree = 64) : _maxFree(maxFree), _free(0) { }
+
+    ~ChunkPool() {
+        Chunk* chunk;
+        while (_chunks.try_pop(chunk)) {
+            delete chunk;
+        }
+    }
+
+    Chunk* allocate() {
+        Chunk* chunk;
+        if (_chunks.try_pop(chunk)) {
+            --_free;
+            return chunk;
+        }
+        return new Chunk();
+    }
+
+    /**
+     * Returns a chunk to the free list. Its vectors must be views.
+     */
+    void recycle(Chunk* chunk) {
+        if (_free >= _maxFree) {
+            delete chunk;
+            return;
+        }
+        chunk->clear();
+        ++_free;
+        _chunks.push(chunk);
+    }
+
+private:
+    ChunkPool(const ChunkPool&);
+    ChunkPool& operator=(const ChunkPool&);
+
+    size_t _maxFree;
+    atomic<size_t> _free;
+    tbb::concurrent_queue<Chunk*> _chunks;
+};
+
 template <typename SVECTOR>
 class SVectorStream {
     size_t read(size_t n, vector<SVECTOR*>* data) {
@@ -85,25 +205,60 @@ public:
         string id;
         size_t read = 0;
 		if (_maxToRead != -1 && _count >= _maxToRead) return 0;
+        size_t first = data->size();
+        _readIds.clear();
 		while (getline(_idStream, id)) {
             _signatureStream.read(&_buffer[0], _buffer.size());
-            SVector<bool>* vector = new SVector<bool>(&_buffer[0], _signatureLength);
-            vector->setID(id);
-            data->push_back(vector);
+            data->push_back(new SVector<bool>(&_buffer[0], _signatureLength));
+            _readIds.push_back(id);
 			++_count;
 			if (_maxToRead != -1 && _count >= _maxToRead) break;
             if (++read == n) {
                 break;
             }
         }
+        if (_readIds.empty()) {
+            return read;
+        }
+        // append the IDs of the batch at once so they share an allocation
+        vector<IdTable::Range> ranges;
+        ranges.reserve(_readIds.size());
+        for (const string& readId : _readIds) {
+            ranges.push_back(IdTable::Range(readId.data(), readId.data() + readId.size()));
+        }
+        uint64_t ordinal = _ids.append(ranges);
+        for (size_t i = first; i < data->size(); i++) {
+            (*data)[i]->setID(ordinal++);
+        }
         return read;
     }
+
+    const IdTable& ids() const {
+        return _ids;
+    }
     
     void free(vector<SVector<bool>*>* data) {
         for (auto vector : *data) {
             delete vector;
         }
     }
+
+    SVectorChunk<SVector<bool>>* readChunk(size_t n) {
+        auto chunk = new SVectorChunk<SVector<bool>>();
+        chunk->records = read(n, &chunk->vectors);
+        if (chunk->records == 0) {
+            delete chunk;
+            return NULL;
+        }
+        return chunk;
+    }
+
+    void parseChunk(SVectorChunk<SVector<bool>>* chunk) const { }
+
+    void freeChunk(SVectorChunk<SVector<bool>>* chunk) {
+        free(&chunk->vectors);
+        delete chunk;
+    }
     
 private:
     vector<char> _buffer; // temporary buffer for reading a signature
@@ -112,13 +267,18 @@ private:
     size_t _signatureLength; // the length of signatures in _signatureStream
 	size_t _maxToRead;
 	size_t _count; // Number of vectors read so far
+    vector<string> _readIds; // the IDs of the vectors being read
+    IdTable _ids;
 };
 
 
 // add by fantao at 2015-8-19; 
 // reading doc2vector file;
-template <>
-class SVectorStream<SVector<double>> {
+// Dense vectors of float or double values parsed from doc2vec text.
+// The object IDs are appended to an IdTable as chunks are parsed, so ordinals
+// follow the order chunks are parsed in rather than the order of the file.
+template <typename T>
+class SVectorStream<SVector<T>> {
 public:   
 	
     /**
@@ -136,82 +296,430 @@ public:
 	
 	SVectorStream(const string& doc_vector_file,
             const size_t vector_length, const size_t maxToRead) 
+            : SVectorStream(doc_vector_file, vector_length, maxToRead, NULL) {
+        _ownedIds.reset(new IdTable());
+        _ids = _ownedIds.get();
+	}
+
+    /**
+     * @param ids The table to append IDs to. When it is NULL the IDs are
+     *            discarded and the ordinal of a vector is its line index,
+     *            which saves memory when the IDs are not needed.
+     */
+	SVectorStream(const string& doc_vector_file,
+            const size_t vector_length, const size_t maxToRead, IdTable* ids) 
             :
-            _vectorStream(doc_vector_file),
-			_count(0),
-			 _maxToRead(maxToRead),
-            _vector_length(vector_length){       
-       
-        if (!_vectorStream) {
-            throw runtime_error("failed to open " + doc_vector_file);
-        }
+            _reader(doc_vector_file),
+            _parser(vector_length),
+            _vector_length(vector_length),
+            _maxToRead(maxToRead),
+            _count(0),
+            _ids(ids) {
 	}
 
-    size_t read(size_t n, vector<SVector<double>*>* data) {
-        string docid;
-		string v1;
-        size_t read = 0;
-		if (_maxToRead != -1 && _count >= _maxToRead) return 0;
-		string vec_str;
-		while (getline(_vectorStream, vec_str)) {
-			int size = vec_str.size();
-			int flag = 0;
-			int vec_pos = 0;			
-			SVector<double>* vector = new SVector<double>(_vector_length);
-			
-			for(int i = 0; i < size; i++){
-				int pos = vec_str.find(" ", i);
-				if (pos < size && pos >= 0 ){
-					v1 = vec_str.substr(i, pos - i); 			
-					i = pos;						   
-					}
-				
-				else{				 
-					v1 = vec_str.substr(i, size-i);				
-					i=size; 		   
-					}
-				
-				if (flag == 0){
-					docid = v1;
-					flag = 1;				
-					
-					vector->setID(docid);				
-					}
-				
-				else{					
-					double vec = atof(v1.c_str());
-					vector->set(vec_pos, vec);
-					vec_pos++;
-					}
-				
-				}
-			
-            data->push_back(vector);
-			
-			++_count;
-			if (_maxToRead != -1 && _count >= _maxToRead) break;
-            if (++read == n) {
-                break;
+    const IdTable& ids() const {
+        if (!_ids) {
+            throw runtime_error("the IDs of this stream were discarded");
+        }
+        return *_ids;
+    }
+
+    /**
+     * Blank lines are skipped. A line with a different number of values than
+     * vector_length throws runtime_error.
+     */
+    size_t read(size_t n, vector<SVector<T>*>* data) {
+        for (;;) {
+            SVectorChunk<SVector<T>>* chunk = readChunk(n);
+            if (!chunk) {
+                return 0;
+            }
+            try {
+                parseChunk(chunk);
+            } catch (...) {
+                freeChunk(chunk);
+                throw;
+            }
+            size_t read = copyVectors(*chunk, data);
+            freeChunk(chunk);
+            if (read > 0) {
+                return read;
             }
         }
-		
-        return read;
-		
     }
     
-    void free(vector<SVector<double>*>* data) {
+    void free(vector<SVector<T>*>* data) {
         for (auto vector : *data) {
             delete vector;
         }
     }
+
+    /**
+     * Copies up to n lines of raw text into a chunk without parsing them.
+     */
+    SVectorChunk<SVector<T>>* readChunk(size_t n) {
+        if (_maxToRead != -1) {
+            if (_count >= _maxToRead) return NULL;
+            n = std::min(n, _maxToRead - _count);
+        }
+        const char* begin;
+        const char* end;
+        size_t firstLine = _reader.lineNumber() + 1;
+        size_t lines = _reader.nextLines(n, &begin, &end);
+        if (lines == 0) {
+            return NULL;
+        }
+        _count += lines;
+        auto chunk = _pool.allocate();
+        chunk->records = lines;
+        chunk->firstLine = firstLine;
+        chunk->bytes.assign(begin, end);
+        chunk->bytes.push_back('\0');
+        return chunk;
+    }
+
+    /**
+     * Parses the lines of a chunk into views of the chunk arena. Apart from
+     * appending to the IdTable, it only touches the chunk so it is thread
+     * safe.
+     */
+    void parseChunk(SVectorChunk<SVector<T>>* chunk) const {
+        const char* begin = &chunk->bytes[0];
+        const char* last = begin + chunk->bytes.size() - 1; // null character
+        size_t line = chunk->firstLine;
+        // there are at most records vectors, so the views never move
+        chunk->arena.resize(chunk->records * _vector_length * sizeof (T));
+        chunk->views.reserve(chunk->records);
+        T* values = reinterpret_cast<T*>(&chunk->arena[0]);
+        while (begin < last) {
+            const char* end = static_cast<const char*>(memchr(begin, '\n', last - begin));
+            if (!end) {
+                end = last;
+            }
+            if (!Doc2VecParser::isBlank(begin, end)) {
+                chunk->views.emplace_back(values, _vector_length);
+                values += _vector_length;
+                chunk->ids.emplace_back();
+                _parser.parse(begin, end, &chunk->views.back(), line,
+                        &chunk->ids.back());
+                chunk->views.back().setID(line - 1);
+                chunk->vectors.push_back(&chunk->views.back());
+            }
+            begin = end + 1;
+            ++line;
+        }
+        if (_ids && !chunk->ids.empty()) {
+            uint64_t ordinal = _ids->append(chunk->ids);
+            for (auto& view : chunk->views) {
+                view.setID(ordinal++);
+            }
+        }
+    }
+
+    void freeChunk(SVectorChunk<SVector<T>>* chunk) {
+        _pool.recycle(chunk);
+    }
     
 private:    
-    ifstream _vectorStream;    
+    /**
+     * Copies the vectors of a chunk into vectors that own their memory.
+     */
+    static size_t copyVectors(const SVectorChunk<SVector<T>>& chunk,
+            vector<SVector<T>*>* data) {
+        for (auto view : chunk.vectors) {
+            data->push_back(new SVector<T>(*view));
+        }
+        return chunk.vectors.size();
+    }
+
+    ChunkPool<SVector<T>> _pool;
+    LineBlockReader _reader;
+    Doc2VecParser _parser;
     size_t _vector_length; // the length of signatures in _signatureStream
     size_t _maxToRead;
 	size_t _count; // Number of vectors read so far
+    IdTable* _ids;
+    unique_ptr<IdTable> _ownedIds;
+};
+
+
+/**
+ * Streams dense vectors from a binary vector file (see VectorFile.h). The file
+ * is memory mapped and vectors point directly into the mapping, so there is no
+ * parsing and the vector data is never copied.
+ *
+ * The element type of the file must match the element type of SVECTOR.
+ * Use the convertdoc2vec tool to create a vector file from doc2vec output.
+ */
+template <typename SVECTOR>
+class MappedSVectorStream;
+
+template <typename T>
+class MappedSVectorStream<SVector<T>> {
+public:
+    /**
+     * @param vectorFile A binary vector file.
+     * @param vectorLength The length of a vector. It must match the file.
+     */
+    MappedSVectorStream(const string& vectorFile, const size_t vectorLength)
+            : MappedSVectorStream(vectorFile, vectorLength, -1) { }
+
+    /**
+     * @param vectorFile A binary vector file.
+     * @param vectorLength The length of a vector. It must match the file.
+     * @param maxToRead The maximum number of vectors to read. A value of -1
+     *                  indicates to read all.
+     */
+    MappedSVectorStream(const string& vectorFile, const size_t vectorLength,
+            const size_t maxToRead)
+            : _file(vectorFile),
+            _ids(_file.idBytes(), _file.idIndex(), _file.size()),
+            _maxToRead(maxToRead),
+            _count(0) {
+        if (_file.dimensions() != vectorLength) {
+            throw runtime_error("vector length does not match " + vectorFile);
+        }
+        if (_file.type() != VectorFileHeader::typeOf<T>()) {
+            throw runtime_error(string("vector file stores ")
+                    + VectorFileHeader::typeName(_file.type()) + " values " + vectorFile);
+        }
+        _file.adviseSequential();
+    }
+
+    /**
+     * The ordinal of a vector is its row in the file, and the IDs are read
+     * from the mapping.
+     */
+    const IdTable& ids() const {
+        return _ids;
+    }
+
+    size_t read(size_t n, vector<SVector<T>*>* data) {
+        size_t read = 0;
+        size_t dimensions = _file.dimensions();
+        while (_count < _file.size()) {
+            if (_maxToRead != -1 && _count >= _maxToRead) break;
+            SVector<T>* vector = new SVector<T>(_file.row<T>(_count), dimensions);
+            vector->setID(_count);
+            data->push_back(vector);
+            ++_count;
+            if (++read == n) {
+                break;
+            }
+        }
+        return read;
+    }
+
+    void free(vector<SVector<T>*>* data) {
+        for (auto vector : *data) {
+            delete vector;
+        }
+    }
+
+    /**
+     * The vectors of a chunk are views into the mapped file.
+     */
+    SVectorChunk<SVector<T>>* readChunk(size_t n) {
+        size_t last = _file.size();
+        if (_maxToRead != -1) {
+            last = std::min(last, _maxToRead);
+        }
+        if (_count >= last) {
+            return NULL;
+        }
+        size_t count = std::min(n, last - _count);
+        size_t dimensions = _file.dimensions();
+        auto chunk = _pool.allocate();
+        chunk->records = count;
+        chunk->views.reserve(count);
+        for (size_t i = _count; i < _count + count; i++) {
+            chunk->views.emplace_back(_file.row<T>(i), dimensions);
+            chunk->views.back().setID(i);
+            chunk->vectors.push_back(&chunk->views.back());
+        }
+        _count += count;
+        return chunk;
+    }
+
+    void parseChunk(SVectorChunk<SVector<T>>* chunk) const { }
+
+    void freeChunk(SVectorChunk<SVector<T>>* chunk) {
+        _pool.recycle(chunk);
+    }
+
+private:
+    ChunkPool<SVector<T>> _pool;
+    MappedVectorFile _file;
+    IdTable _ids;
+    size_t _maxToRead;
+    size_t _count; // Number of vectors read so far
 };
 
+/**
+ * Streams dense vectors from a binary vector file (see VectorFile.h) with
+ * sequential read() calls instead of mmap. Each chunk owns a copy of its rows
+ * and the pages that have been read are dropped from the page cache, so a file
+ * much larger than memory streams at the bandwidth of the disk without
+ * evicting anything else. The IDs are loaded into memory when it is opened,
+ * and the ordinal of a vector is its row in the file.
+ *
+ * readChunk() copies the rows into chunk->bytes and parseChunk() points the
+ * vectors into them, so the vectors are only valid until freeChunk().
+ */
+template <typename SVECTOR>
+class ReadSVectorStream;
+
+template <typename T>
+class ReadSVectorStream<SVector<T>> {
+public:
+    /**
+     * @param vectorFile A binary vector file.
+     * @param vectorLength The length of a vector. It must match the file.
+     */
+    ReadSVectorStream(const string& vectorFile, const size_t vectorLength)
+            : _path(vectorFile),
+            _fd(open(vectorFile.c_str(), O_RDONLY)),
+            _count(0) {
+        if (_fd < 0) {
+            throw runtime_error("failed to open " + vectorFile);
+        }
+        try {
+            readHeader(vectorLength);
+        } catch (...) {
+            ::close(_fd);
+            throw;
+        }
+        _rowBytes = _header.dimensions * sizeof (T);
+        _idTable.reset(new IdTable(_ids.data(), _idIndex.data(), _header.count));
+        posix_fadvise(_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+
+    ~ReadSVectorStream() {
+        ::close(_fd);
+    }
+
+    const IdTable& ids() const {
+        return *_idTable;
+    }
+
+    size_t read(size_t n, vector<SVector<T>*>* data) {
+        unique_ptr<SVectorChunk<SVector<T>>> chunk(readChunk(n));
+        if (!chunk) {
+            return 0;
+        }
+        const T* values = reinterpret_cast<const T*>(&chunk->bytes[0]);
+        for (size_t i = 0; i < chunk->records; i++) {
+            SVector<T>* vector = new SVector<T>(_header.dimensions);
+            std::copy(values + i * _header.dimensions,
+                    values + (i + 1) * _header.dimensions, vector->begin());
+            vector->setID(chunk->firstLine + i);
+            data->push_back(vector);
+        }
+        return chunk->records;
+    }
+
+    void free(vector<SVector<T>*>* data) {
+        for (auto vector : *data) {
+            delete vector;
+        }
+    }
+
+    /**
+     * Reads the rows of up to n vectors. firstLine is the index of the first
+     * vector in the file.
+     */
+    SVectorChunk<SVector<T>>* readChunk(size_t n) {
+        size_t count = std::min(n, size_t(_header.count) - _count);
+        if (count == 0) {
+            return NULL;
+        }
+        auto chunk = _pool.allocate();
+        chunk->records = count;
+        chunk->firstLine = _count;
+        chunk->bytes.resize(count * _rowBytes);
+        off_t offset = _header.dataOffset + _count * _rowBytes;
+        try {
+            readFully(&chunk->bytes[0], chunk->bytes.size(), offset);
+        } catch (...) {
+            _pool.recycle(chunk);
+            throw;
+        }
+        posix_fadvise(_fd, offset, chunk->bytes.size(), POSIX_FADV_DONTNEED);
+        _count += count;
+        return chunk;
+    }
+
+    void parseChunk(SVectorChunk<SVector<T>>* chunk) const {
+        T* values = reinterpret_cast<T*>(&chunk->bytes[0]);
+        chunk->views.reserve(chunk->records);
+        for (size_t i = 0; i < chunk->records; i++) {
+            chunk->views.emplace_back(values + i * _header.dimensions,
+                    _header.dimensions);
+            chunk->views.back().setID(chunk->firstLine + i);
+            chunk->vectors.push_back(&chunk->views.back());
+        }
+    }
+
+    void freeChunk(SVectorChunk<SVector<T>>* chunk) {
+        _pool.recycle(chunk);
+    }
+
+    size_t size() const {
+        return _header.count;
+    }
+
+private:
+    void readHeader(const size_t vectorLength) {
+        struct stat st;
+        if (fstat(_fd, &st) != 0 || size_t(st.st_size) < sizeof (VectorFileHeader)) {
+            throw runtime_error("not a vector file " + _path);
+        }
+        readFully(reinterpret_cast<char*>(&_header), sizeof (_header), 0);
+        validateVectorFile(_header, st.st_size, _path);
+        if (_header.dimensions != vectorLength) {
+            throw runtime_error("vector length does not match " + _path);
+        }
+        if (_header.type != VectorFileHeader::typeOf<T>()) {
+            throw runtime_error(string("vector file stores ")
+                    + VectorFileHeader::typeName(_header.type) + " values " + _path);
+        }
+        _ids.resize(_header.idIndexOffset - _header.idOffset);
+        _idIndex.resize(_header.count + 1);
+        readFully(&_ids[0], _ids.size(), _header.idOffset);
+        readFully(reinterpret_cast<char*>(&_idIndex[0]),
+                _idIndex.size() * sizeof (uint64_t), _header.idIndexOffset);
+        validateIdIndex(_header, &_idIndex[0], _path);
+    }
+
+    void readFully(char* buffer, size_t length, off_t offset) const {
+        while (length > 0) {
+            ssize_t bytes = pread(_fd, buffer, length, offset);
+            if (bytes < 0 && errno == EINTR) {
+                continue;
+            }
+            if (bytes <= 0) {
+                throw runtime_error("failed reading " + _path);
+            }
+            buffer += bytes;
+            length -= bytes;
+            offset += bytes;
+        }
+    }
+
+    // Copying would close the file twice.
+    ReadSVectorStream(const ReadSVectorStream&);
+    ReadSVectorStream& operator=(const ReadSVectorStream&);
+
+    ChunkPool<SVector<T>> _pool;
+    string _path;
+    int _fd;
+    VectorFileHeader _header;
+    size_t _rowBytes;
+    vector<char> _ids;
+    vector<uint64_t> _idIndex;
+    unique_ptr<IdTable> _idTable; // a view of _ids and _idIndex
+    size_t _count; // Number of vectors read so far
+};
 
 } // namespace lmw
 
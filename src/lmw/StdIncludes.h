@@ -55,6 +55,8 @@ using std::dec;
 using std::ends;
 using std::move;
 using std::unique_ptr;
+using std::pair;
+using std::make_pair;
 
 using boost::format;
 
@@ -3,9 +3,19 @@
 
 #include "StdIncludes.h"
 #include "SVectorStream.h"
+#include "ChunkPrefetcher.h"
+#include "ClusterSearch.h"
 #include "ClusterVisitor.h"
+#include "BitCounter.h"
 #include "InsertVisitor.h"
-#include "tbb/mutex.h"
+#include "Int8KeyMatrix.h"
+#include "KeyMatrix.h"
+#include "Prototype.h"
+#include "TreeFile.h"
+#include "tbb/blocked_range.h"
+#include "tbb/enumerable_thread_specific.h"
+#include "tbb/parallel_for.h"
+#include "tbb/parallel_reduce.h"
 #include "tbb/pipeline.h"
 
 namespace lmw {
@@ -31,113 +41,270 @@ namespace lmw {
  * a[i] += 1;
  *
  * OPTIMIZER provides the functions necessary for optimization.
+ *
+ * ACCUMULATOR_PROTOTYPE turns an accumulator into a key when the tree is
+ * updated, see Prototype.h. By default dense vectors take the mean and bit
+ * vectors take a majority vote, so the same tree streams doc2vec vectors
+ * and bit signatures.
+ *
+ * Inserting does not lock. Each thread adds to its own shard of accumulators,
+ * and the shards are added into the accumulators of the leaves when a call to
+ * insert() or visit() finishes.
+ *
+ * By default a vector follows the nearest key at each level. With a beam
+ * width b greater than 1, insert() and visit() keep the b nearest keys at
+ * each level and choose the nearest leaf key reached by any of them, which
+ * costs up to b times as many distance calculations.
+ *
+ * With setInt8Keys() the nearest key at each level is found by scanning the
+ * keys quantized to 8 bits, see Int8KeyMatrix.h, and the nearest leaf keys
+ * are compared again with the exact keys. It can not be combined with a beam
+ * width greater than 1, and nearestClusters() always uses the exact keys.
+ *
+ * A stream of another type of vector can be inserted through a FILTER that
+ * turns each one into a T in the pipeline, for example, a RandomProjection
+ * of dense vectors into bit signatures clustered by Hamming distance.
+ * meanTree() then gives a tree of dense keys for the same clusters, which
+ * can be refined on the original vectors.
  */
-template <typename T, typename ACCUMULATOR, typename OPTIMIZER>
+template <typename T, typename ACCUMULATOR, typename OPTIMIZER,
+        typename ACCUMULATOR_PROTOTYPE = typename AccumulatorPrototype<T>::type>
 class StreamingEMTree {
 public:
+    typedef T vector_type;
+
     explicit StreamingEMTree(const Node<T>* root) :
-        _root(new Node<AccumulatorKey>()) {
+        _root(new KeyNode()) {
             _root->setOwnsKeys(true);
             deepCopy(root, _root);
+            indexLeaves();
+            rebuildCaches(_root);
 			
 			// add by fantao at 2015-08-23;
 			_lastrmse = 0.0;
 			_converage = false;			
     }
 
+    /**
+     * Loads a tree written by save(). The counts and sum of squared errors of
+     * the clusters are restored, so it can be reported on or used to assign
+     * vectors straight away. Call clearAccumulators() before inserting to
+     * continue iterating.
+     */
+    explicit StreamingEMTree(const MappedTreeFile& file) :
+        _root(new KeyNode()),
+        _lastrmse(0.0),
+        _converage(false) {
+            _root->setOwnsKeys(true);
+            load(file, 0, _root);
+            indexLeaves();
+            rebuildCaches(_root);
+    }
+
     ~StreamingEMTree() {
         delete _root;
     }
 
-	// change by fantao at 2015-8-20, bool->double;
-    size_t visit(SVectorStream<T>& vs, InsertVisitor<T>& visitor) {
-        size_t totalRead = 0;
-
-        // setup parallel processing pipeline
-        tbb::parallel_pipeline(_maxtokens,
-                // Input filter reads readsize chunks of vectors in serial
-                tbb::make_filter<void, vector < SVector<double>*>*>(
-                tbb::filter::serial_out_of_order,
-                inputFilter(vs, totalRead)
-                ) &
-                // Visit filter visits readsize chunks of vectors into streaming EM-tree in parallel
-                tbb::make_filter < vector < SVector<double>*>*, void>(
-                tbb::filter::parallel,
-                [&] (vector < SVector<double>*>* data) -> void {
-                    visit(*data, visitor);
-                    vs.free(data);
-                    delete data;
-                }
-        )
-        );
-
-        return totalRead;
+    /**
+     * VECTORSTREAM is any stream of T following the VectorStream concept in
+     * SVectorStream.h, for example, SVectorStream or MappedSVectorStream.
+     */
+    template <typename VECTORSTREAM>
+    size_t visit(VECTORSTREAM& vs, InsertVisitor<T>& visitor) {
+        size_t read = processStream<T>(vs, -1, [&] (vector<T*>& data) -> void {
+            for (T* object : data) {
+                visit(_root, object, visitor);
+            }
+        });
+        reduceShards();
+        return read;
     }
 
     void visit(ClusterVisitor<T>& visitor) const {
         visit(NULL, _root, visitor);
     }
 
-    void visit(vector<T*>& data, InsertVisitor<T>& visitor) const {
+    void visit(vector<T*>& data, InsertVisitor<T>& visitor) {
         for (T* object : data) {
+            _optimizer.prepare(object);
             visit(_root, object, visitor);
         }
+        reduceShards();
     }
 
-    size_t insert(SVectorStream<T>& vs) {
+    template <typename VECTORSTREAM>
+    size_t insert(VECTORSTREAM& vs) {
         return insert(vs, -1);
     }
 
     /** Returns the total number of vectors read from the stream.
      *  Returns 0 if the end of the stream has been reached.
      */
-    size_t insert(SVectorStream<T>& vs, const size_t maxToRead) {
-        size_t totalRead = 0;
-
-        // setup parallel processing pipeline
-        tbb::parallel_pipeline(_maxtokens,
-                // Input filter reads readsize chunks of vectors in serial
-                // change by fantao at 2015-8-19;bool->double;
-                //tbb::make_filter<void, vector < SVector<bool>*>*>
-                tbb::make_filter<void, vector < SVector<double>*>*>(
-                tbb::filter::serial_out_of_order,
-                inputFilter(vs, totalRead, maxToRead)
-                ) &
-                // Insert filter inserts readsize chunks of vectors into streaming EM-tree in parallel
-                // change by fantao at 2015-8-19;bool->double;
-                //tbb::make_filter < vector < SVector<bool>*>*, void>
-                tbb::make_filter < vector < SVector<double>*>*, void>(
-                tbb::filter::parallel,
-                [&] (vector < SVector<double>*>* data) -> void {
-                    insert(*data);
-                    vs.free(data);
-                    delete data;
-                }
-        )
-        );
-
-        return totalRead;
+    template <typename VECTORSTREAM>
+    size_t insert(VECTORSTREAM& vs, const size_t maxToRead) {
+        size_t read = processStream<T>(vs, maxToRead, [&] (vector<T*>& data) -> void {
+            for (T* object : data) {
+                insert(_root, object);
+            }
+        });
+        reduceShards();
+        return read;
     }
 
     /**
-     * Insert is thread safe. Shared accumulators are locked.
+     * Insert is not thread safe with respect to other calls on this tree.
      */
     void insert(vector<T*>& data) {
         for (T* object : data) {
+            _optimizer.prepare(object);
             insert(_root, object);
         }
+        reduceShards();
+    }
+
+    /**
+     * Inserts a stream of another type of vector, which FILTER turns into T
+     * in the pipeline, for example, RandomProjection turns dense vectors into
+     * bit signatures. VECTORSTREAM is a stream of FILTER::source_type.
+     *
+     * FILTER must support
+     *      typedef ... source_type;
+     *      T* allocate() const;
+     *      void operator()(const source_type* source, T* target) const;
+     * and operator() must be thread safe. The vectors it fills are reused.
+     */
+    template <typename VECTORSTREAM, typename FILTER,
+            typename S = typename FILTER::source_type>
+    size_t insert(VECTORSTREAM& vs, const FILTER& filter) {
+        tbb::enumerable_thread_specific<FilterScratch> scratch;
+        size_t read = processStream<S>(vs, -1, [&] (vector<S*>& data) -> void {
+            for (T* object : filterChunk(data, filter, scratch.local())) {
+                insert(_root, object);
+            }
+        });
+        reduceShards();
+        return read;
+    }
+
+    /**
+     * Builds a tree of the same shape as this one with keys of
+     * FILTER::source_type. Each key is the mean of the source vectors in vs
+     * whose filtered vector reaches its cluster by following the nearest key
+     * at each level. Clusters that no vector reaches are left out. Leaf keys
+     * have an empty child like the leaves of a TSVQ tree, so the result can
+     * initialize a StreamingEMTree of the source type.
+     *
+     * For example, a tree clustered in Hamming space on the signatures of a
+     * RandomProjection is refined on the original dense vectors by
+     * initializing a dense StreamingEMTree with meanTree(vs, projection).
+     * The caller owns the tree.
+     */
+    template <typename VECTORSTREAM, typename FILTER,
+            typename = decltype(std::declval<VECTORSTREAM&>().readChunk(0))>
+    Node<typename FILTER::source_type>* meanTree(VECTORSTREAM& vs,
+            const FILTER& filter) const {
+        typedef typename FILTER::source_type S;
+        tbb::enumerable_thread_specific<FilterScratch> scratch;
+        tbb::enumerable_thread_specific<MeanShard> shards;
+        processStream<S>(vs, -1, [&] (vector<S*>& data) -> void {
+            addMeans(data, filter, scratch.local(), shards.local());
+        });
+        return meanTree<S>(shards);
+    }
+
+    /**
+     * A version of meanTree() for vectors in memory.
+     */
+    template <typename FILTER>
+    Node<typename FILTER::source_type>* meanTree(
+            const vector<typename FILTER::source_type*>& data,
+            const FILTER& filter) const {
+        typedef typename FILTER::source_type S;
+        tbb::enumerable_thread_specific<FilterScratch> scratch;
+        tbb::enumerable_thread_specific<MeanShard> shards;
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, data.size(), 1000),
+                [&](const tbb::blocked_range<size_t>& range) {
+                    vector<S*> chunk(data.begin() + range.begin(),
+                            data.begin() + range.end());
+                    addMeans(chunk, filter, scratch.local(), shards.local());
+                });
+        return meanTree<S>(shards);
+    }
+
+    /**
+     * Puts the k leaf clusters nearest to object into ranked, nearest first.
+     * object must have been prepared by OPTIMIZER::prepare(). At most
+     * maxExpanded nodes are expanded, see ClusterSearch.h. Any number of
+     * threads can search at once while the tree is not being changed.
+     */
+    void nearestClusters(const T* object, const size_t k,
+            const size_t maxExpanded, vector<RankedCluster<T>>* ranked) const {
+        QueryScratch& scratch = _queryScratch.local();
+        const double objectNorm = _optimizer.norm(object);
+        scratch.search.search(_root, k, maxExpanded, _optimizer,
+                [&](const KeyNode* node, double* out) {
+                    keyDistances(object, objectNorm, node, node->getCache(), out);
+                }, &scratch.ranked);
+        ranked->clear();
+        for (auto& cluster : scratch.ranked) {
+            ranked->push_back({cluster.key->key, cluster.distance});
+        }
+    }
+
+    /**
+     * Prepares a batch of vectors and finds the k nearest leaf clusters of
+     * each in parallel. ranked[i] holds the clusters of objects[i].
+     */
+    void nearestClusters(const vector<T*>& objects, const size_t k,
+            const size_t maxExpanded,
+            vector<vector<RankedCluster<T>>>* ranked) const {
+        ranked->resize(objects.size());
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, objects.size(), 16),
+                [&](const tbb::blocked_range<size_t>& range) {
+                    for (size_t i = range.begin(); i != range.end(); ++i) {
+                        _optimizer.prepare(objects[i]);
+                        nearestClusters(objects[i], k, maxExpanded, &(*ranked)[i]);
+                    }
+                });
     }
 
     int prune() {
-        return prune(_root);
+        uint64_t count;
+        int pruned = prune(_root, &count);
+        indexLeaves();
+        rebuildCaches(_root);
+        return pruned;
     }
 
     void update() {
-        update(_root);
+        if (!_root->isEmpty()) {
+            size_t dimensions = _root->getKey(0)->key->size();
+            ACCUMULATOR total(dimensions);
+            total.setAll(0);
+            uint64_t totalCount = 0;
+            update(_root, &total, &totalCount);
+        }
+        rebuildCaches(_root);
     }
 
     void clearAccumulators() {
         clearAccumulators(_root);
+        _distanceCounts.clear();
+    }
+
+    /**
+     * Saves the keys, counts and sum of squared errors of every cluster in
+     * the tree file format, see TreeFile.h.
+     */
+    void save(const string& path) const {
+        typedef typename T::value_type V;
+        size_t dimensions = _root->isEmpty() ? 0 : _root->getKey(0)->key->size();
+        writeTreeFile<V>(path, _root, dimensions,
+                [this](const KeyNode* node, const size_t i, TreeFileKey* record) {
+                    record->count = objCount(node, i);
+                    record->sumSquaredError = sumSquaredError(node, i);
+                    return static_cast<const V*>(node->getKey(i)->key->begin());
+                });
     }
 
     int getMaxLevelCount() const {
@@ -152,6 +319,107 @@ public:
         return objCount(_root);
     }
 
+    /**
+     * The number of vectors read at once when processing a stream.
+     */
+    void setReadSize(const int readsize) {
+        _readsize = readsize;
+    }
+
+    int getReadSize() const {
+        return _readsize;
+    }
+
+    /**
+     * The maximum number of chunks in the pipeline at once.
+     */
+    void setMaxTokens(const int maxtokens) {
+        _maxtokens = maxtokens;
+    }
+
+    int getMaxTokens() const {
+        return _maxtokens;
+    }
+
+    /**
+     * The number of chunks read ahead by an I/O thread while earlier chunks
+     * are processed. 0 reads chunks in the pipeline without a thread.
+     */
+    void setPrefetchChunks(const int prefetchChunks) {
+        _prefetchChunks = prefetchChunks;
+    }
+
+    int getPrefetchChunks() const {
+        return _prefetchChunks;
+    }
+
+    /**
+     * The number of keys kept at each level when searching for the leaf of a
+     * vector in insert() and visit(). 1 follows the nearest key.
+     */
+    void setBeamWidth(const int beamWidth) {
+        if (beamWidth < 1) {
+            throw runtime_error("the beam width must be at least 1");
+        }
+        if (beamWidth > 1 && _int8Keys) {
+            throw runtime_error("8 bit keys can not be used with a beam width greater than 1");
+        }
+        _beamWidth = beamWidth;
+    }
+
+    int getBeamWidth() const {
+        return _beamWidth;
+    }
+
+    /**
+     * Finds the nearest key at each level using keys quantized to 8 bits
+     * when insert() and visit() follow the nearest key. Throws unless
+     * DotProductDistance<OPTIMIZER::distance_type>::value is true and the
+     * beam width is 1.
+     */
+    void setInt8Keys(const bool int8Keys) {
+        if (int8Keys && !DotProductDistance<typename OPTIMIZER::distance_type>::value) {
+            throw runtime_error("8 bit keys need a dot product distance");
+        }
+        if (int8Keys && _beamWidth > 1) {
+            throw runtime_error("8 bit keys can not be used with a beam width greater than 1");
+        }
+        _int8Keys = int8Keys;
+        rebuildCaches(_root);
+    }
+
+    bool getInt8Keys() const {
+        return _int8Keys;
+    }
+
+    /**
+     * The number of leaf keys nearest by their quantized distance that are
+     * compared again with the exact keys, up to OPTIMIZER::MAX_RERANK. 0
+     * chooses the leaf key by the quantized distance alone.
+     */
+    void setInt8Rerank(const int int8Rerank) {
+        _int8Rerank = int8Rerank;
+    }
+
+    int getInt8Rerank() const {
+        return _int8Rerank;
+    }
+
+    /**
+     * The number of distances calculated at each level of the tree by
+     * insert() and visit() since clearAccumulators(). Element 0 is the root.
+     */
+    const vector<uint64_t>& getDistanceCounts() const {
+        return _distanceCounts;
+    }
+
+    /**
+     * The seconds the pipeline waited for data in the last stream processed.
+     */
+    double getInputStallSeconds() const {
+        return _inputStallSeconds;
+    }
+
     double getRMSE() const {
         double RMSE = sumSquaredError(_root);
         uint64_t size = getObjCount();
@@ -161,11 +429,11 @@ public:
     }
 
 	// add by fantao at 2015-08-23;
-	double setLastRMSE(double rmse){
+	void setLastRMSE(double rmse){
 		_lastrmse = rmse;		
 		}
 
-	double setConverage(bool converage){
+	void setConverage(bool converage){
 		_converage = converage;
 		}
 
@@ -173,16 +441,14 @@ public:
 		return _lastrmse;
 		}
 
-	double getConverage()const{
+	bool getConverage()const{
 		return _converage;
 		}
 
 private:
-    typedef tbb::mutex Mutex;
-
     struct AccumulatorKey {
-        AccumulatorKey() : key(NULL), sumSquaredError(0), accumulator(NULL),
-                count(0),  mutex(NULL) { }
+        AccumulatorKey() : key(NULL), keyNorm(0), sumSquaredError(0),
+                accumulator(NULL), count(0), leafIndex(0) { }
 
         ~AccumulatorKey() {
             if (key) {
@@ -191,25 +457,294 @@ private:
             if (accumulator) {
                 delete accumulator;
             }
-            if (mutex) {
-                delete mutex;
-            }
         }
 
         T* key;
+        double keyNorm; // OPTIMIZER norm of key, updated whenever key changes
         double sumSquaredError;
         ACCUMULATOR* accumulator; // accumulator for partially updated key
         uint64_t count; // how many vectors have been added to accumulator
-        Mutex* mutex;
+        size_t leafIndex; // position of a leaf key in an AccumulatorShard
     };
 
+    /**
+     * For dot product distances each node keeps a KeyMatrix copy of its keys,
+     * so the nearest key is found by a scan over contiguous memory.
+     */
+    typedef typename QuantizedKeyCache<T, typename OPTIMIZER::distance_type>::type Cache;
+    typedef Node<AccumulatorKey, Cache> KeyNode;
+    typedef typename ShardAccumulator<T, ACCUMULATOR>::type ShardAccumulator_t;
+
     struct Accessor {
         T* operator()(AccumulatorKey* accumulatorKey) const {
             return accumulatorKey->key;
         }
     };
 
-    void visit(const T* parentKey, const Node<AccumulatorKey>* node,
+    struct NormAccessor {
+        double operator()(AccumulatorKey* accumulatorKey) const {
+            return accumulatorKey->keyNorm;
+        }
+    };
+
+    /**
+     * The accumulators of one thread for every leaf key, indexed by
+     * AccumulatorKey::leafIndex. Accumulators are only allocated for leaves
+     * that the thread inserts into. They are a BitCounter for bit vectors,
+     * see ShardAccumulator.
+     */
+    struct AccumulatorShard {
+        AccumulatorShard() { }
+
+        ~AccumulatorShard() {
+            for (auto accumulator : accumulators) {
+                delete accumulator;
+            }
+        }
+
+        void resize(const size_t leaves) {
+            accumulators.resize(leaves, NULL);
+            sumSquaredErrors.resize(leaves, 0);
+            counts.resize(leaves, 0);
+        }
+
+        vector<ShardAccumulator_t*> accumulators;
+        vector<double> sumSquaredErrors;
+        vector<uint64_t> counts;
+        vector<uint64_t> distanceCounts; // indexed by level starting at 0
+
+    private:
+        AccumulatorShard(const AccumulatorShard&);
+        AccumulatorShard& operator=(const AccumulatorShard&);
+    };
+
+    typedef tbb::enumerable_thread_specific<AccumulatorShard> Shards;
+
+    /**
+     * The filtered vectors of one thread, reused for every chunk.
+     */
+    struct FilterScratch {
+        FilterScratch() { }
+
+        ~FilterScratch() {
+            Utils::purge(pool);
+        }
+
+        vector<T*> pool; // every vector allocated by the FILTER
+        vector<T*> objects; // the vectors of the current chunk
+
+    private:
+        FilterScratch(const FilterScratch&);
+        FilterScratch& operator=(const FilterScratch&);
+    };
+
+    /**
+     * Filters and prepares a chunk of source vectors. The vectors returned
+     * belong to scratch and are overwritten by the next chunk.
+     */
+    template <typename S, typename FILTER>
+    const vector<T*>& filterChunk(const vector<S*>& data, const FILTER& filter,
+            FilterScratch& scratch) const {
+        while (scratch.pool.size() < data.size()) {
+            scratch.pool.push_back(filter.allocate());
+        }
+        scratch.objects.assign(scratch.pool.begin(), scratch.pool.begin() + data.size());
+        for (size_t i = 0; i < data.size(); i++) {
+            filter(data[i], scratch.objects[i]);
+            _optimizer.prepare(scratch.objects[i]);
+        }
+        return scratch.objects;
+    }
+
+    /**
+     * The sums of source vectors reaching each leaf in meanTree().
+     */
+    struct MeanShard {
+        MeanShard() { }
+
+        ~MeanShard() {
+            Utils::purge(sums);
+        }
+
+        void resize(const size_t leaves) {
+            sums.resize(leaves, NULL);
+            counts.resize(leaves, 0);
+        }
+
+        template <typename S>
+        void add(const size_t leaf, const S& object, const uint64_t count = 1) {
+            if (!sums[leaf]) {
+                sums[leaf] = new SVector<double>(object.size());
+                sums[leaf]->setAll(0);
+            }
+            SVector<double>& sum = *sums[leaf];
+            for (size_t i = 0; i < sum.size(); i++) {
+                sum[i] += object[i];
+            }
+            counts[leaf] += count;
+        }
+
+        vector<SVector<double>*> sums;
+        vector<uint64_t> counts;
+
+    private:
+        MeanShard(const MeanShard&);
+        MeanShard& operator=(const MeanShard&);
+    };
+
+    template <typename S, typename FILTER>
+    void addMeans(const vector<S*>& data, const FILTER& filter,
+            FilterScratch& scratch, MeanShard& shard) const {
+        const vector<T*>& objects = filterChunk(data, filter, scratch);
+        shard.resize(_leafCount);
+        for (size_t i = 0; i < data.size(); i++) {
+            shard.add(nearestLeaf(objects[i])->leafIndex, *data[i]);
+        }
+    }
+
+    template <typename S>
+    Node<S>* meanTree(tbb::enumerable_thread_specific<MeanShard>& shards) const {
+        MeanShard total;
+        total.resize(_leafCount);
+        size_t dimensions = 0;
+        for (auto& shard : shards) {
+            for (size_t leaf = 0; leaf < shard.sums.size(); leaf++) {
+                if (shard.sums[leaf]) {
+                    dimensions = shard.sums[leaf]->size();
+                    total.add(leaf, *shard.sums[leaf], shard.counts[leaf]);
+                }
+            }
+        }
+        auto root = new Node<S>();
+        root->setOwnsKeys(true);
+        if (dimensions > 0) {
+            SVector<double> sum(dimensions);
+            uint64_t count = 0;
+            meanTree(_root, total, root, &sum, &count);
+        }
+        return root;
+    }
+
+    /**
+     * Adds the keys of node with vectors to dst as means of the sums in
+     * total, and adds the sums below node into sum and count.
+     */
+    template <typename S>
+    void meanTree(const KeyNode* node, const MeanShard& total, Node<S>* dst,
+            SVector<double>* sum, uint64_t* count) const {
+        const size_t dimensions = sum->size();
+        sum->setAll(0);
+        *count = 0;
+        SVector<double> childSum(dimensions);
+        for (size_t i = 0; i < node->size(); i++) {
+            uint64_t childCount = 0;
+            Node<S>* child = new Node<S>();
+            child->setOwnsKeys(true);
+            if (node->isLeaf()) {
+                size_t leaf = node->getKey(i)->leafIndex;
+                childCount = total.counts[leaf];
+                if (childCount > 0) {
+                    std::copy(total.sums[leaf]->begin(), total.sums[leaf]->end(),
+                            childSum.begin());
+                }
+            } else {
+                meanTree(node->getChild(i), total, child, &childSum, &childCount);
+            }
+            if (childCount == 0) {
+                delete child;
+                continue;
+            }
+            S* key = new S(dimensions);
+            for (size_t j = 0; j < dimensions; j++) {
+                key->set(j, childSum[j] / childCount);
+                (*sum)[j] += childSum[j];
+            }
+            *count += childCount;
+            dst->add(key, child);
+        }
+    }
+
+    AccumulatorShard& localShard() const {
+        AccumulatorShard& shard = _shards.local();
+        if (shard.counts.size() != _leafCount) {
+            shard.resize(_leafCount);
+        }
+        return shard;
+    }
+
+    /**
+     * Adds the shards of all threads into the leaf keys and zeros them. It
+     * must not run concurrently with insert() or visit().
+     */
+    void reduceShards() {
+        reduceShards(_root);
+        for (auto& shard : _shards) {
+            if (_distanceCounts.size() < shard.distanceCounts.size()) {
+                _distanceCounts.resize(shard.distanceCounts.size(), 0);
+            }
+            for (size_t level = 0; level < shard.distanceCounts.size(); level++) {
+                _distanceCounts[level] += shard.distanceCounts[level];
+                shard.distanceCounts[level] = 0;
+            }
+            for (size_t i = 0; i < shard.counts.size(); i++) {
+                if (shard.accumulators[i]) {
+                    shard.accumulators[i]->setAll(0);
+                }
+                shard.sumSquaredErrors[i] = 0;
+                shard.counts[i] = 0;
+            }
+        }
+    }
+
+    void reduceShards(KeyNode* node) {
+        if (node->isLeaf()) {
+            for (auto accumulatorKey : node->getKeys()) {
+                size_t leaf = accumulatorKey->leafIndex;
+                ACCUMULATOR* accumulator = accumulatorKey->accumulator;
+                for (auto& shard : _shards) {
+                    if (shard.counts.size() != _leafCount || shard.counts[leaf] == 0) {
+                        continue;
+                    }
+                    accumulatorKey->sumSquaredError += shard.sumSquaredErrors[leaf];
+                    accumulatorKey->count += shard.counts[leaf];
+                    ShardAccumulator_t* partial = shard.accumulators[leaf];
+                    if (partial) {
+                        for (size_t i = 0; i < accumulator->size(); i++) {
+                            (*accumulator)[i] += (*partial)[i];
+                        }
+                    }
+                }
+            }
+        } else {
+            for (auto child : node->getChildren()) {
+                reduceShards(child);
+            }
+        }
+    }
+
+    /**
+     * Numbers the leaf keys and discards the shards, which were sized for
+     * the old leaves. The shards must already be reduced.
+     */
+    void indexLeaves() {
+        _leafCount = 0;
+        indexLeaves(_root);
+        _shards.clear();
+    }
+
+    void indexLeaves(KeyNode* node) {
+        if (node->isLeaf()) {
+            for (auto accumulatorKey : node->getKeys()) {
+                accumulatorKey->leafIndex = _leafCount++;
+            }
+        } else {
+            for (auto child : node->getChildren()) {
+                indexLeaves(child);
+            }
+        }
+    }
+
+    void visit(const T* parentKey, const KeyNode* node,
             ClusterVisitor<T>& visitor, const int level = 1) const {
         for (size_t i = 0; i < node->size(); i++) {
             auto accumulatorKey = node->getKey(i);
@@ -223,141 +758,459 @@ private:
         }
     }
 
-    Nearest<AccumulatorKey> nearestKey(const T* object,
-            const Node<AccumulatorKey>* node) const {
-        return _optimizer.nearest(object, node->getKeys(), _accessor);
+    /**
+     * objectNorm is the OPTIMIZER norm of object. It is calculated once per
+     * path through the tree, and the norms of keys are cached.
+     */
+    Nearest<AccumulatorKey> nearestKey(const T* object, const double objectNorm,
+            const KeyNode* node) const {
+        return nearestKey(object, objectNorm, node, node->getCache());
+    }
+
+    Nearest<AccumulatorKey> nearestKey(const T* object, const double objectNorm,
+            const KeyNode* node, const NoNodeCache&) const {
+        return _optimizer.nearest(object, objectNorm, node->getKeys(), _accessor,
+                _normAccessor);
+    }
+
+    template <typename V>
+    Nearest<AccumulatorKey> nearestKey(const T* object, const double objectNorm,
+            const KeyNode* node, const KeyMatrix<V>& matrix) const {
+        return _optimizer.nearest(object, objectNorm, node->getKeys(), matrix);
+    }
+
+    /**
+     * Searches the quantized keys when they are filled, see setInt8Keys().
+     */
+    template <typename V>
+    Nearest<AccumulatorKey> nearestKey(const T* object, const double objectNorm,
+            const KeyNode* node, const Int8KeyCache<V>& cache) const {
+        if (cache.quantized.size() == 0) {
+            return nearestKey(object, objectNorm, node,
+                    static_cast<const KeyMatrix<V>&>(cache));
+        }
+        Int8Query& query = _int8Queries.local();
+        if (query.source != object->begin()) {
+            query.quantize(object->begin(), object->size(), cache.quantized.stride());
+        }
+        Nearest<void> row = _optimizer.nearestQuantizedRow(object, objectNorm,
+                cache, cache.quantized, query, node->isLeaf() ? _int8Rerank : 0);
+        return {node->getKeys()[row.index], row.index, row.distance};
+    }
+
+    /**
+     * Copies the keys of every node into its cache. It must be called
+     * whenever keys are changed, added or removed.
+     */
+    void rebuildCaches(KeyNode* node) {
+        rebuildCache(node, node->getCache());
+        if (!node->isLeaf()) {
+            for (auto child : node->getChildren()) {
+                rebuildCaches(child);
+            }
+        }
+    }
+
+    void rebuildCache(KeyNode* node, NoNodeCache&) { }
+
+    template <typename V>
+    void rebuildCache(KeyNode* node, KeyMatrix<V>& matrix) {
+        size_t dimensions = node->isEmpty() ? 0 : node->getKey(0)->key->size();
+        matrix.resize(node->size(), dimensions);
+        for (size_t i = 0; i < node->size(); i++) {
+            auto accumulatorKey = node->getKey(i);
+            matrix.setRow(i, accumulatorKey->key->begin(), accumulatorKey->keyNorm);
+        }
+    }
+
+    template <typename V>
+    void rebuildCache(KeyNode* node, Int8KeyCache<V>& cache) {
+        rebuildCache(node, static_cast<KeyMatrix<V>&>(cache));
+        if (!_int8Keys) {
+            cache.quantized.resize(0, 0);
+            return;
+        }
+        cache.quantized.resize(node->size(), cache.dimensions());
+        for (size_t i = 0; i < node->size(); i++) {
+            cache.quantized.setRow(i, node->getKey(i)->key->begin());
+        }
+    }
+
+    /**
+     * Counts distances calculated at a level starting at 1 for the root.
+     */
+    void countDistances(AccumulatorShard& shard, const int level,
+            const size_t count) const {
+        if (shard.distanceCounts.size() < size_t(level)) {
+            shard.distanceCounts.resize(level, 0);
+        }
+        shard.distanceCounts[level - 1] += count;
     }
 
-    void visit(const Node<AccumulatorKey>* node, const T* object,
-            InsertVisitor<T>& visitor, const int level = 1) const {
-        auto nearest = nearestKey(object, node);
+    /**
+     * A key kept by beam search. parent is the position of the key it was
+     * reached from in the beam of the level above.
+     */
+    struct BeamEntry {
+        const KeyNode* node;
+        size_t index;
+        double distance;
+        size_t parent;
+    };
+
+    /**
+     * The beams of one thread, reused for every vector it searches.
+     */
+    struct BeamScratch {
+        vector<vector<BeamEntry>> beams;
+        vector<double> distances;
+        vector<BeamEntry> path;
+    };
+
+    void keyDistances(const T* object, const double objectNorm,
+            const KeyNode* node, const NoNodeCache&, double* out) const {
+        _optimizer.distances(object, objectNorm, node->getKeys(), _accessor,
+                _normAccessor, out);
+    }
+
+    template <typename V>
+    void keyDistances(const T* object, const double objectNorm,
+            const KeyNode* node, const KeyMatrix<V>& matrix, double* out) const {
+        _optimizer.distances(object, objectNorm, matrix, 0, matrix.size(), out);
+    }
+
+    /**
+     * The search state of one thread for nearestClusters().
+     */
+    struct QueryScratch {
+        ClusterSearch<AccumulatorKey, Cache, OPTIMIZER> search;
+        vector<RankedCluster<AccumulatorKey>> ranked;
+    };
+
+    /**
+     * Adds every key of node to a beam.
+     */
+    void expand(const T* object, const double objectNorm, const KeyNode* node,
+            const size_t parent, vector<BeamEntry>* beam,
+            vector<double>* distances) const {
+        distances->resize(node->size());
+        keyDistances(object, objectNorm, node, node->getCache(), &(*distances)[0]);
+        for (size_t i = 0; i < node->size(); i++) {
+            beam->push_back({node, i, (*distances)[i], parent});
+        }
+    }
+
+    /**
+     * Finds the leaf key for object below root with a beam of _beamWidth
+     * keys per level. Returns the keys from root to the nearest leaf key found.
+     */
+    const vector<BeamEntry>& beamSearch(const KeyNode* root, const T* object,
+            const double objectNorm) const {
+        BeamScratch& scratch = _beamScratch.local();
+        AccumulatorShard& shard = localShard();
+        vector<vector<BeamEntry>>& beams = scratch.beams;
+        const size_t width = _beamWidth;
+        size_t bestLevel = 0, bestPosition = 0;
+        bool foundLeaf = false;
+        for (size_t level = 0; ; level++) {
+            if (beams.size() <= level) {
+                beams.emplace_back();
+            }
+            vector<BeamEntry>& beam = beams[level];
+            beam.clear();
+            if (level == 0) {
+                expand(object, objectNorm, root, 0, &beam, &scratch.distances);
+            } else {
+                const vector<BeamEntry>& above = beams[level - 1];
+                for (size_t p = 0; p < above.size(); p++) {
+                    if (!above[p].node->isLeaf()) {
+                        expand(object, objectNorm,
+                                above[p].node->getChild(above[p].index), p,
+                                &beam, &scratch.distances);
+                    }
+                }
+            }
+            if (beam.empty()) {
+                break;
+            }
+            countDistances(shard, level + 1, beam.size());
+            if (beam.size() > width) {
+                std::partial_sort(beam.begin(), beam.begin() + width, beam.end(),
+                        [this](const BeamEntry& a, const BeamEntry& b) {
+                            return _optimizer.nearer(a.distance, b.distance);
+                        });
+                beam.resize(width);
+            }
+            for (size_t p = 0; p < beam.size(); p++) {
+                if (beam[p].node->isLeaf() && (!foundLeaf || _optimizer.nearer(
+                        beam[p].distance, beams[bestLevel][bestPosition].distance))) {
+                    foundLeaf = true;
+                    bestLevel = level;
+                    bestPosition = p;
+                }
+            }
+        }
+        vector<BeamEntry>& path = scratch.path;
+        path.resize(bestLevel + 1);
+        for (size_t level = bestLevel + 1, p = bestPosition; level-- > 0; ) {
+            path[level] = beams[level][p];
+            p = beams[level][p].parent;
+        }
+        return path;
+    }
+
+    /**
+     * Updates the stats of a leaf key and the accumulators of this thread.
+     */
+    void accumulate(const AccumulatorKey* accumulatorKey, const T* object) const {
+        AccumulatorShard& shard = localShard();
+        size_t leaf = accumulatorKey->leafIndex;
+        ShardAccumulator_t*& accumulator = shard.accumulators[leaf];
+        if (!accumulator) {
+            accumulator = new ShardAccumulator_t(object->size());
+            accumulator->setAll(0);
+        }
+        shard.sumSquaredErrors[leaf] +=
+                _optimizer.squaredDistance(object, accumulatorKey->key);
+        addObject(accumulator, object);
+        shard.counts[leaf]++;
+    }
+
+    template <typename A>
+    static void addObject(A* accumulator, const T* object) {
+        for (size_t i = 0; i < accumulator->size(); i++) {
+            (*accumulator)[i] += (*object)[i];
+        }
+    }
+
+    static void addObject(BitCounter* counter, const SVector<bool>* object) {
+        counter->add(*object);
+    }
+
+    /**
+     * Updates the stats of a leaf key but not the accumulators.
+     */
+    void addStats(const AccumulatorKey* accumulatorKey, const T* object) const {
+        AccumulatorShard& shard = localShard();
+        size_t leaf = accumulatorKey->leafIndex;
+        shard.sumSquaredErrors[leaf] +=
+                _optimizer.squaredDistance(object, accumulatorKey->key);
+        shard.counts[leaf]++;
+    }
+
+    void visit(const KeyNode* node, const T* object,
+            InsertVisitor<T>& visitor) const {
+        const double objectNorm = _optimizer.norm(object);
+        resetInt8Query();
+        if (_beamWidth > 1) {
+            const vector<BeamEntry>& path = beamSearch(node, object, objectNorm);
+            for (size_t level = 0; level < path.size(); level++) {
+                visitor.accept(level + 1, object,
+                        path[level].node->getKey(path[level].index)->key,
+                        path[level].distance);
+            }
+            addStats(path.back().node->getKey(path.back().index), object);
+        } else {
+            visit(node, object, objectNorm, visitor);
+        }
+    }
+
+    void visit(const KeyNode* node, const T* object,
+            const double objectNorm, InsertVisitor<T>& visitor,
+            const int level = 1) const {
+        auto nearest = nearestKey(object, objectNorm, node);
         auto accumulatorKey = nearest.key;
+        countDistances(localShard(), level, node->size());
         visitor.accept(level, object, accumulatorKey->key, nearest.distance);
         if (node->isLeaf()) {
-            // update stats but not accumulators
-            Mutex::scoped_lock lock(*accumulatorKey->mutex);
-            accumulatorKey->sumSquaredError +=
-                    _optimizer.squaredDistance(object, accumulatorKey->key);
-            accumulatorKey->count++;
+            addStats(accumulatorKey, object);
         } else {
-            visit(node->getChild(nearest.index), object, visitor, level + 1);
+            visit(node->getChild(nearest.index), object, objectNorm, visitor,
+                    level + 1);
         }
     }
 
-    void insert(Node<AccumulatorKey>* node, T* object) {
-        auto nearest = nearestKey(object, node);
-        if (node->isLeaf()) {
-            // update stats and accumulators
-            auto accumulatorKey = nearest.key;
-            Mutex::scoped_lock lock(*accumulatorKey->mutex);
-            T* key = accumulatorKey->key;
-            accumulatorKey->sumSquaredError += _optimizer.squaredDistance(object, key);
-            ACCUMULATOR* accumulator = accumulatorKey->accumulator;
-            for (size_t i = 0; i < accumulator->size(); i++) {
-                (*accumulator)[i] += (*object)[i];
-            }
-            accumulatorKey->count++;
-        } else {
-            insert(node->getChild(nearest.index), object);
+    /**
+     * Forgets the quantized query of this thread, as the next object may reuse
+     * the memory of the last one.
+     */
+    void resetInt8Query() const {
+        if (_int8Keys) {
+            _int8Queries.local().source = NULL;
         }
     }
 
-    int prune(Node<AccumulatorKey>* node) {
-        int pruned = 0;
-        for (int i = 0; i < node->size(); i++) {
-            if (objCount(node, i) == 0) {
-                node->remove(i);
-                pruned++;
-            } else if (!node->isLeaf()) {
-                pruned += prune(node->getChild(i));
+    /**
+     * The leaf key reached by following the nearest key at each level. It
+     * does not count distances.
+     */
+    const AccumulatorKey* nearestLeaf(const T* object) const {
+        const double objectNorm = _optimizer.norm(object);
+        resetInt8Query();
+        const KeyNode* node = _root;
+        for (;;) {
+            auto nearest = nearestKey(object, objectNorm, node);
+            if (node->isLeaf()) {
+                return nearest.key;
             }
+            node = node->getChild(nearest.index);
+        }
+    }
+
+    void insert(KeyNode* node, T* object) {
+        const double objectNorm = _optimizer.norm(object);
+        resetInt8Query();
+        if (_beamWidth > 1) {
+            const vector<BeamEntry>& path = beamSearch(node, object, objectNorm);
+            accumulate(path.back().node->getKey(path.back().index), object);
+        } else {
+            insert(node, object, objectNorm);
         }
-        node->finalizeRemovals();
-        return pruned;
     }
 
-    void gatherAccumulators(Node<AccumulatorKey>* node, ACCUMULATOR* total,
-            uint64_t* totalCount) {
+    void insert(KeyNode* node, T* object, const double objectNorm,
+            const int level = 1) {
+        auto nearest = nearestKey(object, objectNorm, node);
+        countDistances(localShard(), level, node->size());
         if (node->isLeaf()) {
-            for (auto accumulatorKey : node->getKeys()) {
-                auto accumulator = accumulatorKey->accumulator;
-                for (size_t i = 0; i < accumulator->size(); i++) {
-                    (*total)[i] += (*accumulator)[i];
-                }
-                *totalCount += accumulatorKey->count;
-            }
+            accumulate(nearest.key, object);
         } else {
-            for (auto child : node->getChildren()) {
-                gatherAccumulators(child, total, totalCount);
-            }
+            insert(node->getChild(nearest.index), object, objectNorm, level + 1);
         }
     }
 
     /**
-     * TODO(cdevries): Make it work for something other than bitvectors. It needs
-     * to be parameterized, for example, with float vectors, a mean is taken.
+     * Runs f(i) for every key i in node in parallel.
      */
-    static void updatePrototypeFromAccumulator(T* key, ACCUMULATOR* accumulator,
-            uint64_t count) {
-        if (count == 0) return;
+    template <typename F>
+    static void parallelForKeys(const KeyNode* node, const F& f) {
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, node->size()),
+                [&](const tbb::blocked_range<size_t>& r) {
+                    for (size_t i = r.begin(); i != r.end(); ++i) {
+                        f(i);
+                    }
+                }
+        );
+    }
 
-        // calculate new key based on accumulator
-        //key->setAllBlocks(0);
-        // change by fantao at 2015-8-20;
-        key->setAll(0);
-        for (size_t i = 0; i < key->size(); i++) {
-			// change by fantao at 2015-8-16;
-			/*
-            if ((*accumulator)[i] > (count / 2)) {
-                key->set(i);
+    /**
+     * Sums f(i) over every key i in node in parallel.
+     */
+    template <typename R, typename F>
+    static R parallelSumKeys(const KeyNode* node, const F& f) {
+        return tbb::parallel_reduce(tbb::blocked_range<size_t>(0, node->size()),
+                R(0),
+                [&](const tbb::blocked_range<size_t>& r, R sum) -> R {
+                    for (size_t i = r.begin(); i != r.end(); ++i) {
+                        sum += f(i);
+                    }
+                    return sum;
+                },
+                std::plus<R>()
+        );
+    }
+
+    /**
+     * Removes keys that no vectors were inserted into. Children are pruned in
+     * parallel, and subtreeCount returns the number of vectors below node.
+     * A removed subtree is counted as a single pruned node.
+     */
+    int prune(KeyNode* node, uint64_t* subtreeCount) {
+        vector<uint64_t> counts(node->size());
+        vector<int> childPruned(node->size(), 0);
+        if (node->isLeaf()) {
+            for (size_t i = 0; i < node->size(); i++) {
+                counts[i] = node->getKey(i)->count;
+            }
+        } else {
+            parallelForKeys(node, [&](size_t i) {
+                childPruned[i] = prune(node->getChild(i), &counts[i]);
+            });
+        }
+        int pruned = 0;
+        *subtreeCount = 0;
+        for (size_t i = 0; i < node->size(); i++) {
+            if (counts[i] == 0) {
+                node->remove(i);
+                pruned++;
+            } else {
+                pruned += childPruned[i];
+                *subtreeCount += counts[i];
             }
-            */
-            double mean_val = (*accumulator)[i] /(count + 0.0);
-			key->set(i, mean_val);
         }
+        node->finalizeRemovals();
+        return pruned;
+    }
+
+    void updatePrototypeFromAccumulator(AccumulatorKey* accumulatorKey,
+            ACCUMULATOR* accumulator, uint64_t count) const {
+        if (count == 0) return;
+
+        T* key = accumulatorKey->key;
+        _accumulatorPrototype(key, *accumulator, count);
+        _optimizer.prepare(key);
+        accumulatorKey->keyNorm = _optimizer.norm(key);
     }
 
-    void update(Node<AccumulatorKey>* node) {
+    /**
+     * Updates the keys in node and its subtree in a single bottom-up pass,
+     * and adds the accumulators of the subtree into total. The accumulator of
+     * an internal key is the sum of the accumulators of its child node, so
+     * every leaf accumulator is only read once. Children are updated in
+     * parallel.
+     */
+    void update(KeyNode* node, ACCUMULATOR* total, uint64_t* totalCount) {
         if (node->isLeaf()) {
             // leaves flatten accumulators in node
-            for (auto accumulatorKey : node->getKeys()) {
-                updatePrototypeFromAccumulator(accumulatorKey->key,
+            parallelForKeys(node, [&](size_t i) {
+                auto accumulatorKey = node->getKey(i);
+                updatePrototypeFromAccumulator(accumulatorKey,
                         accumulatorKey->accumulator, accumulatorKey->count);
+            });
+            for (auto accumulatorKey : node->getKeys()) {
+                add(total, *accumulatorKey->accumulator);
+                *totalCount += accumulatorKey->count;
             }
         } else {
-            // internal nodes must gather accumulators from leaves
-            size_t dimensions = node->getKey(0)->key->size();
+            // internal keys are the mean of the accumulators below them
+            size_t dimensions = total->size();
+            vector<ACCUMULATOR*> childTotals(node->size());
+            vector<uint64_t> childCounts(node->size(), 0);
+            parallelForKeys(node, [&](size_t i) {
+                childTotals[i] = new ACCUMULATOR(dimensions);
+                childTotals[i]->setAll(0);
+                update(node->getChild(i), childTotals[i], &childCounts[i]);
+                updatePrototypeFromAccumulator(node->getKey(i), childTotals[i],
+                        childCounts[i]);
+            });
             for (size_t i = 0; i < node->size(); i++) {
-                auto accumulatorKey = node->getKey(i);
-                T* key = accumulatorKey->key;
-                auto child = node->getChild(i);
-                ACCUMULATOR total(dimensions);
-                total.setAll(0);
-                uint64_t totalCount = 0;
-                gatherAccumulators(child, &total, &totalCount);
-                updatePrototypeFromAccumulator(key, &total, totalCount);
-            }
-            for (auto child : node->getChildren()) {
-                update(child);
+                add(total, *childTotals[i]);
+                *totalCount += childCounts[i];
+                delete childTotals[i];
             }
         }
     }
 
-    void clearAccumulators(Node<AccumulatorKey>* node) {
-        if (node->isLeaf()) {
-            for (auto accumulatorKey : node->getKeys()) {
+    static void add(ACCUMULATOR* total, const ACCUMULATOR& accumulator) {
+        for (size_t i = 0; i < total->size(); i++) {
+            (*total)[i] += accumulator[i];
+        }
+    }
+
+    void clearAccumulators(KeyNode* node) {
+        parallelForKeys(node, [&](size_t i) {
+            if (node->isLeaf()) {
+                auto accumulatorKey = node->getKey(i);
                 accumulatorKey->sumSquaredError = 0;
                 accumulatorKey->accumulator->setAll(0);
                 accumulatorKey->count = 0;
+            } else {
+                clearAccumulators(node->getChild(i));
             }
-        } else {
-            for (auto child : node->getChildren()) {
-                clearAccumulators(child);
-            }
-        }
+        });
     }
 
-    void deepCopy(const Node<T>* src, Node<AccumulatorKey>* dst) {
+    void deepCopy(const Node<T>* src, KeyNode* dst) {
         if (!src->isEmpty()) {
             size_t dimensions = src->getKey(0)->size();
             for (size_t i = 0; i < src->size(); i++) {
@@ -365,15 +1218,15 @@ private:
                 auto child = src->getChild(i);
                 auto accumulatorKey = new AccumulatorKey();
                 accumulatorKey->key = new T(*key);
+                accumulatorKey->keyNorm = _optimizer.norm(accumulatorKey->key);
                 if (child->isLeaf()) {
                     // Do not copy leaves of original tree and setup
                     // accumulators for the lowest level cluster means.
                     accumulatorKey->accumulator = new ACCUMULATOR(dimensions);
                     accumulatorKey->accumulator->setAll(0);
-                    accumulatorKey->mutex = new Mutex();
                     dst->add(accumulatorKey);
                 } else {
-                    auto newChild = new Node<AccumulatorKey>();
+                    auto newChild = new KeyNode();
                     newChild->setOwnsKeys(true);
                     deepCopy(child, newChild);
                     dst->add(accumulatorKey, newChild);
@@ -382,28 +1235,97 @@ private:
         }
     }
 
-	// change by fantao at 2015-8-19; bool->double;
-    std::function<vector<SVector<double>*>*(tbb::flow_control&)> inputFilter(
-            SVectorStream<T>& vs, size_t& totalRead, const size_t maxToRead = -1) {
-        return ([&vs, &totalRead, this, maxToRead]
-                (tbb::flow_control & fc) -> vector < SVector<double>*>* {
-            if (maxToRead > 0 && totalRead >= maxToRead) {
-                fc.stop();
-                return NULL;
-            }
-            auto data = new vector<T*>;
-            size_t read = vs.read(_readsize, data);
-            if (read == 0) {
-                delete data;
-                fc.stop();
-                return NULL;
+    void load(const MappedTreeFile& file, const size_t index, KeyNode* dst) {
+        const TreeFileNode& node = file.node(index);
+        size_t dimensions = file.dimensions();
+        for (size_t k = node.firstKey; k < node.firstKey + node.keyCount; k++) {
+            const TreeFileKey& record = file.key(k);
+            auto accumulatorKey = new AccumulatorKey();
+            accumulatorKey->key = new T(dimensions);
+            file.copyValues(k, accumulatorKey->key->begin());
+            accumulatorKey->keyNorm = _optimizer.norm(accumulatorKey->key);
+            if (node.flags & TreeFileNode::LEAF) {
+                accumulatorKey->accumulator = new ACCUMULATOR(dimensions);
+                accumulatorKey->accumulator->setAll(0);
+                accumulatorKey->count = record.count;
+                accumulatorKey->sumSquaredError = record.sumSquaredError;
+                dst->add(accumulatorKey);
+            } else {
+                auto newChild = new KeyNode();
+                newChild->setOwnsKeys(true);
+                dst->add(accumulatorKey, newChild);
+                load(file, record.child, newChild);
             }
-            totalRead += data->size();
-            return data;
-        });
+        }
+    }
+
+    /**
+     * Runs a parallel pipeline over a stream of S. A serial input filter
+     * takes readsize chunks of raw data from a ChunkPrefetcher, a parallel
+     * filter parses chunks into vectors and prepares them for the OPTIMIZER
+     * when S is T, and a parallel filter passes the vectors to process.
+     * Parsing text is as expensive as inserting, so it must not be serial.
+     * Reading happens on the I/O thread of the prefetcher so it does not
+     * block a TBB worker.
+     */
+    template <typename S, typename VECTORSTREAM, typename PROCESS>
+    size_t processStream(VECTORSTREAM& vs, const size_t maxToRead,
+            const PROCESS& process) const {
+        typedef SVectorChunk<S> Chunk;
+        atomic<size_t> totalRead(0);
+        ChunkPrefetcher<VECTORSTREAM, S> prefetcher(vs, _readsize, maxToRead,
+                _prefetchChunks);
+
+        // setup parallel processing pipeline
+        tbb::parallel_pipeline(_maxtokens,
+                // Input filter reads readsize chunks of raw data in serial
+                tbb::make_filter<void, Chunk*>(
+                tbb::filter::serial_out_of_order,
+                [&] (tbb::flow_control& fc) -> Chunk* {
+                    Chunk* chunk = prefetcher.next();
+                    if (!chunk) {
+                        fc.stop();
+                    }
+                    return chunk;
+                }
+                ) &
+                // Parse filter turns chunks into vectors in parallel
+                tbb::make_filter<Chunk*, Chunk*>(
+                tbb::filter::parallel,
+                [&] (Chunk* chunk) -> Chunk* {
+                    vs.parseChunk(chunk);
+                    prepare(chunk->vectors);
+                    return chunk;
+                }
+                ) &
+                // Process filter inserts or visits chunks of vectors in parallel
+                tbb::make_filter<Chunk*, void>(
+                tbb::filter::parallel,
+                [&] (Chunk* chunk) -> void {
+                    process(chunk->vectors);
+                    totalRead += chunk->vectors.size();
+                    prefetcher.free(chunk);
+                }
+        )
+        );
+
+        _inputStallSeconds = prefetcher.stallSeconds();
+        return totalRead;
+    }
+
+    void prepare(vector<T*>& objects) const {
+        for (T* object : objects) {
+            _optimizer.prepare(object);
+        }
     }
 
-    double sumSquaredError(const Node<AccumulatorKey>* node, const size_t i) const {
+    /**
+     * Vectors of another type are prepared once they are filtered into T.
+     */
+    template <typename S>
+    void prepare(vector<S*>& objects) const { }
+
+    double sumSquaredError(const KeyNode* node, const size_t i) const {
         if (node->isLeaf()) {
             return node->getKey(i)->sumSquaredError;
         } else {
@@ -411,26 +1333,16 @@ private:
         }
     }
 
-    double sumSquaredError(const Node<AccumulatorKey>* node) const {
-        if (node->isLeaf()) {
-            double localSum = 0;
-            for (auto key : node->getKeys()) {
-                localSum += key->sumSquaredError;
-            }
-            return localSum;
-        } else {
-            double localSum = 0;
-            for (auto child : node->getChildren()) {
-                localSum += sumSquaredError(child);
-            }
-            return localSum;
-        }
+    double sumSquaredError(const KeyNode* node) const {
+        return parallelSumKeys<double>(node, [&](size_t i) {
+            return sumSquaredError(node, i);
+        });
     }
 
     /**
      * Object count for cluster i in node.
      */
-    uint64_t objCount(const Node<AccumulatorKey>* node, const size_t i) const {
+    uint64_t objCount(const KeyNode* node, const size_t i) const {
         if (node->isLeaf()) {
             return node->getKey(i)->count;
         } else {
@@ -438,23 +1350,13 @@ private:
         }
     }
 
-    uint64_t objCount(const Node<AccumulatorKey>* node) const {
-        if (node->isLeaf()) {
-            uint64_t localCount = 0;
-            for (auto key : node->getKeys()) {
-                localCount += key->count;
-            }
-            return localCount;
-        } else {
-            uint64_t localCount = 0;
-            for (auto child : node->getChildren()) {
-                localCount += objCount(child);
-            }
-            return localCount;
-        }
+    uint64_t objCount(const KeyNode* node) const {
+        return parallelSumKeys<uint64_t>(node, [&](size_t i) {
+            return objCount(node, i);
+        });
     }
 
-    int maxLevelCount(const Node<AccumulatorKey>* current) const {
+    int maxLevelCount(const KeyNode* current) const {
         if (current->isLeaf()) {
             return 1;
         } else {
@@ -466,7 +1368,7 @@ private:
         }
     }
 
-    int clusterCount(const Node<AccumulatorKey>* current, const int depth) const {
+    int clusterCount(const KeyNode* current, const int depth) const {
         if (depth == 1) {
             return current->size();
         } else {
@@ -478,9 +1380,32 @@ private:
         }
     }
 
-    Node<AccumulatorKey>* _root;
+    KeyNode* _root;
     OPTIMIZER _optimizer;
+    ACCUMULATOR_PROTOTYPE _accumulatorPrototype;
     Accessor _accessor;
+    NormAccessor _normAccessor;
+
+    // Per thread accumulators for the leaves, reduced after each insert
+    mutable Shards _shards;
+    size_t _leafCount = 0;
+
+    // The keys kept per level by beamSearch() and its per thread beams
+    int _beamWidth = 1;
+    mutable tbb::enumerable_thread_specific<BeamScratch> _beamScratch;
+
+    // Whether insert() and visit() scan keys quantized to 8 bits, the leaf
+    // keys reranked with the exact keys, and the quantized vector of each
+    // thread
+    bool _int8Keys = false;
+    int _int8Rerank = 4;
+    mutable tbb::enumerable_thread_specific<Int8Query> _int8Queries;
+
+    // The per thread state of nearestClusters()
+    mutable tbb::enumerable_thread_specific<QueryScratch> _queryScratch;
+
+    // Distances calculated per level since clearAccumulators()
+    vector<uint64_t> _distanceCounts;
 
 	// add by fantao at 2015-8-23;
 	double _lastrmse;
@@ -491,6 +1416,11 @@ private:
 
     // The maximum number of readsize vector chunks that can be loaded at once.
     int _maxtokens = 1024;
+
+    // The number of readsize chunks read ahead of the pipeline.
+    int _prefetchChunks = 2;
+
+    mutable double _inputStallSeconds = 0;
 };
 
 } // namespace lmw
@@ -0,0 +1,348 @@
+/**
+ * This file contains the binary tree file format. It stores the topology and
+ * keys of a tree of dense vectors so a trained model can be reloaded by a
+ * later process, either to continue iterating or to assign new vectors.
+ *
+ * The layout of a tree file is,
+ *      TreeFileHeader      fixed 64 byte header
+ *      nodes               nodeCount TreeFileNode records
+ *      keys                keyCount TreeFileKey records
+ *      padding             up to valuesOffset which is page aligned
+ *      values              keyCount * dimensions values in row major order
+ *
+ * Nodes are stored in breadth first order starting with the root, so the
+ * children of a node are next to each other, and the keys of a node are the
+ * contiguous records firstKey to firstKey + keyCount. The values of key k are
+ * row k of the values section, so a memory mapped file can be searched
+ * without copying it.
+ *
+ * KTree and TSVQ build a tree in one pass and have no constructor taking a
+ * root, so a saved KTree or TSVQ tree is resumed as an EMTree. For example,
+ *      saveTree("tsvq.tree", tsvq.getMWayTree());
+ *      MappedTreeFile file("tsvq.tree");
+ *      EMTree_t emtree(loadTree<SVector<float>>(file));
+ *      emtree.EMStep();
+ */
+
+#ifndef TREEFILE_H
+#define	TREEFILE_H
+
+#include "StdIncludes.h"
+#include "Node.h"
+#include "SVector.h"
+#include "VectorFile.h"
+
+#include <cstdio>
+
+namespace lmw {
+
+struct TreeFileHeader {
+    static const uint32_t VERSION = 1;
+
+    char magic[8];
+    uint32_t version;
+    uint32_t type; // VectorFileHeader::Type of the values
+    uint64_t dimensions;
+    uint64_t nodeCount;
+    uint64_t keyCount;
+    uint64_t nodesOffset;
+    uint64_t keysOffset;
+    uint64_t valuesOffset;
+
+    static const char* expectedMagic() {
+        return "LMWTREE\0";
+    }
+};
+
+static_assert(sizeof (TreeFileHeader) == 64, "TreeFileHeader must not be padded");
+
+struct TreeFileNode {
+    enum Flags : uint32_t {
+        LEAF = 1
+    };
+
+    uint64_t firstKey;
+    uint32_t keyCount;
+    uint32_t flags;
+};
+
+struct TreeFileKey {
+    enum : uint64_t {
+        NO_CHILD = uint64_t(-1)
+    };
+
+    uint64_t child; // node index of the child, or NO_CHILD in a leaf
+    uint64_t id; // SVector::getID() of the key
+    uint64_t count; // vectors in the cluster, 0 if it is not known
+    double sumSquaredError; // of the vectors in the cluster, 0 if not known
+};
+
+/**
+ * Writes the tree below root to path in breadth first order. NODE is a Node
+ * of any key type. describe(node, i, &record) fills in the id and statistics
+ * of key i of node, and returns a pointer to its dimensions values. They are
+ * converted to V as they are written.
+ *
+ * The file is written next to path and renamed over it when it is complete,
+ * so a reader never sees a partial tree.
+ */
+template <typename V, typename NODE, typename DESCRIBE>
+void writeTreeFile(const string& path, const NODE* root, const size_t dimensions,
+        DESCRIBE describe) {
+    vector<const NODE*> nodes(1, root);
+    for (size_t i = 0; i < nodes.size(); i++) {
+        if (!nodes[i]->isLeaf()) {
+            for (int j = 0; j < nodes[i]->size(); j++) {
+                nodes.push_back(nodes[i]->getChild(j));
+            }
+        }
+    }
+
+    TreeFileHeader header;
+    memset(&header, 0, sizeof (header));
+    memcpy(header.magic, TreeFileHeader::expectedMagic(), sizeof (header.magic));
+    header.version = TreeFileHeader::VERSION;
+    header.type = VectorFileHeader::typeOf<V>();
+    header.dimensions = dimensions;
+    header.nodeCount = nodes.size();
+    vector<TreeFileNode> nodeRecords(nodes.size());
+    uint64_t nextChild = 1;
+    for (size_t i = 0; i < nodes.size(); i++) {
+        nodeRecords[i].firstKey = header.keyCount;
+        nodeRecords[i].keyCount = nodes[i]->size();
+        nodeRecords[i].flags = nodes[i]->isLeaf() ? uint32_t(TreeFileNode::LEAF) : 0;
+        header.keyCount += nodes[i]->size();
+    }
+    header.nodesOffset = sizeof (header);
+    header.keysOffset = header.nodesOffset + header.nodeCount * sizeof (TreeFileNode);
+    uint64_t keysEnd = header.keysOffset + header.keyCount * sizeof (TreeFileKey);
+    header.valuesOffset = (keysEnd + VectorFileHeader::ALIGNMENT - 1)
+            / VectorFileHeader::ALIGNMENT * VectorFileHeader::ALIGNMENT;
+
+    vector<TreeFileKey> keyRecords(header.keyCount);
+    vector<V> values(header.keyCount * dimensions);
+    for (size_t i = 0; i < nodes.size(); i++) {
+        for (int j = 0; j < nodes[i]->size(); j++) {
+            uint64_t k = nodeRecords[i].firstKey + j;
+            TreeFileKey& record = keyRecords[k];
+            memset(&record, 0, sizeof (record));
+            record.child = nodes[i]->isLeaf() ? TreeFileKey::NO_CHILD : nextChild++;
+            auto keyValues = describe(nodes[i], j, &record);
+            std::copy(keyValues, keyValues + dimensions, &values[k * dimensions]);
+        }
+    }
+
+    string tmp = path + ".tmp";
+    {
+        ofstream out(tmp, ios::out | ios::binary | ios::trunc);
+        if (!out) {
+            throw runtime_error("unable to open " + tmp);
+        }
+        vector<char> padding(header.valuesOffset - keysEnd, 0);
+        out.write(reinterpret_cast<const char*>(&header), sizeof (header));
+        out.write(reinterpret_cast<const char*>(nodeRecords.data()),
+                nodeRecords.size() * sizeof (TreeFileNode));
+        out.write(reinterpret_cast<const char*>(keyRecords.data()),
+                keyRecords.size() * sizeof (TreeFileKey));
+        out.write(padding.data(), padding.size());
+        out.write(reinterpret_cast<const char*>(values.data()),
+                values.size() * sizeof (V));
+        out.close();
+        if (!out) {
+            throw runtime_error("failed writing " + tmp);
+        }
+    }
+    if (std::rename(tmp.c_str(), path.c_str()) != 0) {
+        throw runtime_error("failed to rename " + tmp + " to " + path);
+    }
+}
+
+/**
+ * A read only view of a tree file using mmap.
+ */
+class MappedTreeFile {
+public:
+    explicit MappedTreeFile(const string& path) : _base(NULL), _length(0) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw runtime_error("failed to open " + path);
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof (TreeFileHeader)) {
+            ::close(fd);
+            throw runtime_error("not a tree file " + path);
+        }
+        _length = st.st_size;
+        void* base = mmap(NULL, _length, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (base == MAP_FAILED) {
+            throw runtime_error("failed to mmap " + path);
+        }
+        _base = static_cast<char*>(base);
+        _header = reinterpret_cast<const TreeFileHeader*>(_base);
+        try {
+            validate(path);
+        } catch (...) {
+            munmap(_base, _length);
+            throw;
+        }
+    }
+
+    ~MappedTreeFile() {
+        munmap(_base, _length);
+    }
+
+    size_t dimensions() const {
+        return _header->dimensions;
+    }
+
+    uint32_t type() const {
+        return _header->type;
+    }
+
+    size_t nodeCount() const {
+        return _header->nodeCount;
+    }
+
+    size_t keyCount() const {
+        return _header->keyCount;
+    }
+
+    const TreeFileNode& node(const size_t i) const {
+        return reinterpret_cast<const TreeFileNode*>(_base + _header->nodesOffset)[i];
+    }
+
+    const TreeFileKey& key(const size_t k) const {
+        return reinterpret_cast<const TreeFileKey*>(_base + _header->keysOffset)[k];
+    }
+
+    /**
+     * The values of key k in place. V must be the type stored in the file.
+     */
+    template <typename V>
+    const V* values(const size_t k) const {
+        if (_header->type != VectorFileHeader::typeOf<V>()) {
+            throw runtime_error(string("tree file stores ")
+                    + VectorFileHeader::typeName(_header->type) + " values");
+        }
+        return reinterpret_cast<const V*>(_base + _header->valuesOffset)
+                + k * _header->dimensions;
+    }
+
+    /**
+     * Copies the values of key k into out, converting them to V.
+     */
+    template <typename V>
+    void copyValues(const size_t k, V* out) const {
+        size_t offset = _header->valuesOffset;
+        if (_header->type == VectorFileHeader::FLOAT32) {
+            const float* row = reinterpret_cast<const float*>(_base + offset) + k * _header->dimensions;
+            std::copy(row, row + _header->dimensions, out);
+        } else {
+            const double* row = reinterpret_cast<const double*>(_base + offset) + k * _header->dimensions;
+            std::copy(row, row + _header->dimensions, out);
+        }
+    }
+
+private:
+    void validate(const string& path) const {
+        if (memcmp(_header->magic, TreeFileHeader::expectedMagic(), sizeof (_header->magic)) != 0) {
+            throw runtime_error("not a tree file " + path);
+        }
+        if (_header->version != TreeFileHeader::VERSION) {
+            throw runtime_error("unsupported tree file version in " + path);
+        }
+        const uint64_t typeSize = VectorFileHeader::typeSize(_header->type);
+        if (_header->nodesOffset % sizeof (uint64_t) != 0
+                || _header->keysOffset % sizeof (uint64_t) != 0
+                || _header->valuesOffset % typeSize != 0) {
+            throw runtime_error("misaligned tree file " + path);
+        }
+        // a row of values must fit the file before it is multiplied by keyCount
+        if (_header->nodeCount == 0
+                || _header->dimensions > _length / typeSize
+                || !fits(_header->nodesOffset, _header->nodeCount, sizeof (TreeFileNode))
+                || !fits(_header->keysOffset, _header->keyCount, sizeof (TreeFileKey))
+                || !fits(_header->valuesOffset, _header->keyCount,
+                        _header->dimensions * typeSize)) {
+            throw runtime_error("truncated tree file " + path);
+        }
+        for (size_t i = 0; i < nodeCount(); i++) {
+            const TreeFileNode& n = node(i);
+            if (n.firstKey > keyCount() || n.keyCount > keyCount() - n.firstKey) {
+                throw runtime_error("corrupt tree file " + path);
+            }
+            for (size_t k = n.firstKey; k < n.firstKey + n.keyCount; k++) {
+                bool leaf = n.flags & TreeFileNode::LEAF;
+                uint64_t child = key(k).child;
+                if (leaf != (child == TreeFileKey::NO_CHILD)
+                        || (!leaf && (child <= i || child >= nodeCount()))) {
+                    throw runtime_error("corrupt tree file " + path);
+                }
+            }
+        }
+    }
+
+    /**
+     * True if count records of recordSize bytes starting at offset lie inside
+     * the file. Nothing is added or multiplied before it is bounded, so a
+     * corrupt header cannot overflow the check.
+     */
+    bool fits(const uint64_t offset, const uint64_t count,
+            const uint64_t recordSize) const {
+        if (offset > _length) {
+            return false;
+        }
+        if (recordSize == 0) {
+            return true;
+        }
+        return count <= (_length - offset) / recordSize;
+    }
+
+    MappedTreeFile(const MappedTreeFile&);
+    MappedTreeFile& operator=(const MappedTreeFile&);
+
+    char* _base;
+    size_t _length;
+    const TreeFileHeader* _header;
+};
+
+/**
+ * Saves a tree of dense vectors built by EMTree, KTree or TSVQ. The leaves of
+ * these trees hold the data vectors, and they are saved with their ordinals.
+ */
+template <typename T, typename CACHE>
+void saveTree(const string& path, const Node<T, CACHE>* root) {
+    typedef typename T::value_type V;
+    size_t dimensions = root->isEmpty() ? 0 : root->getKey(0)->size();
+    writeTreeFile<V>(path, root, dimensions,
+            [](const Node<T, CACHE>* node, const size_t i, TreeFileKey* record) {
+                record->id = node->getKey(i)->getID();
+                return node->getKey(i)->begin();
+            });
+}
+
+/**
+ * Loads a tree saved by saveTree(). Every node owns its keys.
+ */
+template <typename T, typename CACHE = NoNodeCache>
+Node<T, CACHE>* loadTree(const MappedTreeFile& file, const size_t index = 0) {
+    unique_ptr<Node<T, CACHE>> node(new Node<T, CACHE>());
+    node->setOwnsKeys(true);
+    const TreeFileNode& record = file.node(index);
+    for (size_t k = record.firstKey; k < record.firstKey + record.keyCount; k++) {
+        T* key = new T(file.dimensions());
+        file.copyValues(k, key->begin());
+        key->setID(file.key(k).id);
+        if (record.flags & TreeFileNode::LEAF) {
+            node->add(key);
+        } else {
+            node->add(key, loadTree<T, CACHE>(file, file.key(k).child));
+        }
+    }
+    return node.release();
+}
+
+} // namespace lmw
+
+#endif	/* TREEFILE_H */
@@ -0,0 +1,348 @@
+/**
+ * This file contains the binary vector file format. It stores dense vectors
+ * so they can be memory mapped and used in place without any parsing.
+ *
+ * The layout of a vector file is,
+ *      VectorFileHeader    fixed 64 byte header
+ *      padding             up to dataOffset which is page aligned
+ *      data                count * dimensions values in row major order
+ *      ID bytes            all object IDs concatenated without separators
+ *      ID index            count + 1 uint64_t offsets into the ID bytes
+ *
+ * All offsets are stored in the header so the sections could be placed in
+ * any order. The writer places the ID table last so a file can be written in
+ * a single pass without knowing how many vectors will be written.
+ *
+ * For example,
+ *      VectorFileWriter writer("doc2vec.bin", 200, VectorFileHeader::FLOAT32);
+ *      writer.write("doc1", values);
+ *      writer.close();
+ *
+ *      MappedVectorFile file("doc2vec.bin");
+ *      const float* row = file.row<float>(0);
+ */
+
+#ifndef VECTORFILE_H
+#define	VECTORFILE_H
+
+#include "StdIncludes.h"
+
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace lmw {
+
+struct VectorFileHeader {
+    enum Type : uint32_t {
+        FLOAT32 = 1,
+        FLOAT64 = 2
+    };
+
+    static const uint32_t VERSION = 1;
+    static const uint64_t ALIGNMENT = 4096;
+
+    char magic[8];
+    uint32_t version;
+    uint32_t type;
+    uint64_t dimensions;
+    uint64_t count;
+    uint64_t dataOffset;
+    uint64_t idOffset; // start of the concatenated ID bytes
+    uint64_t idIndexOffset; // start of the count + 1 ID offsets
+    uint64_t reserved;
+
+    static const char* expectedMagic() {
+        return "LMWVEC\0\0";
+    }
+
+    static size_t typeSize(const uint32_t type) {
+        switch (type) {
+            case FLOAT32: return sizeof (float);
+            case FLOAT64: return sizeof (double);
+            default: throw runtime_error("unknown vector file type");
+        }
+    }
+
+    static const char* typeName(const uint32_t type) {
+        switch (type) {
+            case FLOAT32: return "float32";
+            case FLOAT64: return "float64";
+            default: return "unknown";
+        }
+    }
+
+    template <typename T>
+    static uint32_t typeOf();
+};
+
+template <>
+inline uint32_t VectorFileHeader::typeOf<float>() {
+    return FLOAT32;
+}
+
+template <>
+inline uint32_t VectorFileHeader::typeOf<double>() {
+    return FLOAT64;
+}
+
+static_assert(sizeof (VectorFileHeader) == 64, "VectorFileHeader must not be padded");
+
+/**
+ * Returns true if path starts with the magic bytes of a vector file.
+ */
+inline bool isVectorFile(const string& path) {
+    ifstream in(path, ios::in | ios::binary);
+    char magic[8];
+    if (!in.read(magic, sizeof (magic))) {
+        return false;
+    }
+    return memcmp(magic, VectorFileHeader::expectedMagic(), sizeof (magic)) == 0;
+}
+
+/**
+ * Throws runtime_error if header does not describe a valid vector file of
+ * length bytes. Every section must lie inside the file without the sizes
+ * overflowing, and the data and the ID index must be aligned for their
+ * types so they can be used in place.
+ */
+inline void validateVectorFile(const VectorFileHeader& header, const size_t length,
+        const string& path) {
+    if (memcmp(header.magic, VectorFileHeader::expectedMagic(), sizeof (header.magic)) != 0) {
+        throw runtime_error("not a vector file " + path);
+    }
+    if (header.version != VectorFileHeader::VERSION) {
+        throw runtime_error("unsupported vector file version in " + path);
+    }
+    const uint64_t typeSize = VectorFileHeader::typeSize(header.type);
+    if (header.dataOffset % typeSize != 0
+            || header.idIndexOffset % sizeof (uint64_t) != 0) {
+        throw runtime_error("misaligned vector file " + path);
+    }
+    // the ID index alone needs count + 1 entries, so a larger count or a row
+    // size that does not fit the file would overflow below
+    if (header.count >= length / sizeof (uint64_t)
+            || (header.dimensions != 0
+            && header.count > length / typeSize / header.dimensions)) {
+        throw runtime_error("truncated vector file " + path);
+    }
+    uint64_t dataBytes = header.count * header.dimensions * typeSize;
+    uint64_t idIndexBytes = (header.count + 1) * sizeof (uint64_t);
+    if (header.dataOffset > length || dataBytes > length - header.dataOffset
+            || header.idIndexOffset > length
+            || idIndexBytes > length - header.idIndexOffset
+            || header.idOffset > header.idIndexOffset) {
+        throw runtime_error("truncated vector file " + path);
+    }
+}
+
+/**
+ * Throws runtime_error unless the count + 1 entries of idIndex, the ID index
+ * of a file with a header accepted by validateVectorFile(), increase and
+ * stay inside the ID bytes. IDs can then be read without further checks.
+ */
+inline void validateIdIndex(const VectorFileHeader& header, const uint64_t* idIndex,
+        const string& path) {
+    const uint64_t idBytes = header.idIndexOffset - header.idOffset;
+    if (idIndex[header.count] > idBytes) {
+        throw runtime_error("corrupt ID index in vector file " + path);
+    }
+    for (uint64_t i = 0; i < header.count; i++) {
+        if (idIndex[i] > idIndex[i + 1]) {
+            throw runtime_error("corrupt ID index in vector file " + path);
+        }
+    }
+}
+
+/**
+ * Writes a vector file in a single pass. Values are converted to the element
+ * type of the file as they are written.
+ */
+class VectorFileWriter {
+public:
+    VectorFileWriter(const string& path, const size_t dimensions,
+            const VectorFileHeader::Type type)
+            : _out(path, ios::out | ios::binary | ios::trunc),
+            _path(path),
+            _closed(false) {
+        if (!_out) {
+            throw runtime_error("unable to open " + path);
+        }
+        memset(&_header, 0, sizeof (_header));
+        memcpy(_header.magic, VectorFileHeader::expectedMagic(), sizeof (_header.magic));
+        _header.version = VectorFileHeader::VERSION;
+        _header.type = type;
+        _header.dimensions = dimensions;
+        _header.dataOffset = VectorFileHeader::ALIGNMENT;
+        _row.resize(dimensions * VectorFileHeader::typeSize(type));
+        _idIndex.push_back(0);
+
+        // reserve space for the header and padding, it is rewritten on close
+        vector<char> padding(_header.dataOffset, 0);
+        _out.write(&padding[0], padding.size());
+    }
+
+    ~VectorFileWriter() {
+        if (!_closed) {
+            close();
+        }
+    }
+
+    template <typename T>
+    void write(const string& id, const T* values) {
+        if (_header.type == VectorFileHeader::FLOAT32) {
+            float* row = reinterpret_cast<float*>(&_row[0]);
+            for (size_t i = 0; i < _header.dimensions; i++) {
+                row[i] = values[i];
+            }
+        } else {
+            double* row = reinterpret_cast<double*>(&_row[0]);
+            for (size_t i = 0; i < _header.dimensions; i++) {
+                row[i] = values[i];
+            }
+        }
+        _out.write(&_row[0], _row.size());
+        _ids.append(id);
+        _idIndex.push_back(_ids.size());
+        _header.count++;
+    }
+
+    template <typename T>
+    void write(const string& id, const SVector<T>& vector) {
+        if (vector.size() != _header.dimensions) {
+            throw runtime_error("vector length does not match vector file dimensions");
+        }
+        write(id, vector.begin());
+    }
+
+    size_t size() const {
+        return _header.count;
+    }
+
+    /**
+     * Appends the ID table and writes the final header.
+     */
+    void close() {
+        _closed = true;
+        _header.idOffset = _header.dataOffset + _header.count * _row.size();
+        // keep the ID index 8 byte aligned
+        _ids.resize((_ids.size() + 7) & ~size_t(7), '\0');
+        _header.idIndexOffset = _header.idOffset + _ids.size();
+        _out.write(_ids.data(), _ids.size());
+        _out.write(reinterpret_cast<const char*>(&_idIndex[0]),
+                _idIndex.size() * sizeof (uint64_t));
+        _out.seekp(0);
+        _out.write(reinterpret_cast<const char*>(&_header), sizeof (_header));
+        _out.close();
+        if (!_out) {
+            throw runtime_error("failed writing " + _path);
+        }
+    }
+
+private:
+    ofstream _out;
+    string _path;
+    VectorFileHeader _header;
+    vector<char> _row; // conversion buffer for a single row
+    string _ids;
+    vector<uint64_t> _idIndex;
+    bool _closed;
+};
+
+/**
+ * A read only view of a vector file using mmap. The mapping is private, so
+ * writes to the vectors are never written back to the file.
+ */
+class MappedVectorFile {
+public:
+    explicit MappedVectorFile(const string& path) : _base(NULL), _length(0) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw runtime_error("failed to open " + path);
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof (VectorFileHeader)) {
+            ::close(fd);
+            throw runtime_error("not a vector file " + path);
+        }
+        _length = st.st_size;
+        void* base = mmap(NULL, _length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (base == MAP_FAILED) {
+            throw runtime_error("failed to mmap " + path);
+        }
+        _base = static_cast<char*>(base);
+        _header = reinterpret_cast<const VectorFileHeader*>(_base);
+        try {
+            validateVectorFile(*_header, _length, path);
+            _idIndex = reinterpret_cast<const uint64_t*>(_base + _header->idIndexOffset);
+            validateIdIndex(*_header, _idIndex, path);
+        } catch (...) {
+            munmap(_base, _length);
+            throw;
+        }
+    }
+
+    ~MappedVectorFile() {
+        if (_base) {
+            munmap(_base, _length);
+        }
+    }
+
+    size_t dimensions() const {
+        return _header->dimensions;
+    }
+
+    size_t size() const {
+        return _header->count;
+    }
+
+    uint32_t type() const {
+        return _header->type;
+    }
+
+    template <typename T>
+    T* row(const size_t i) const {
+        return reinterpret_cast<T*>(_base + _header->dataOffset) + i * _header->dimensions;
+    }
+
+    string id(const size_t i) const {
+        return string(_base + _header->idOffset + _idIndex[i],
+                _idIndex[i + 1] - _idIndex[i]);
+    }
+
+    /**
+     * The concatenated IDs, where ID i is idBytes()[idIndex()[i]] to
+     * idBytes()[idIndex()[i + 1]].
+     */
+    const char* idBytes() const {
+        return _base + _header->idOffset;
+    }
+
+    const uint64_t* idIndex() const {
+        return _idIndex;
+    }
+
+    /**
+     * Tells the kernel the data section will be read from start to end.
+     */
+    void adviseSequential() const {
+        madvise(_base, _length, MADV_SEQUENTIAL);
+    }
+
+private:
+    // Copying would unmap the file twice.
+    MappedVectorFile(const MappedVectorFile&);
+    MappedVectorFile& operator=(const MappedVectorFile&);
+
+    char* _base;
+    size_t _length;
+    const VectorFileHeader* _header;
+    const uint64_t* _idIndex;
+};
+
+} // namespace lmw
+
+#endif	/* VECTORFILE_H */
@@ -0,0 +1,848 @@
+/**
+ * This file contains the inner loops of distance functions for dense float
+ * and double vectors, and of counting the bits of bit vectors. Each kernel
+ * has a portable scalar version and AVX2 and AVX-512 versions. The best
+ * version supported by the CPU is chosen once at runtime, so a binary built
+ * for a generic x86-64 target still uses SIMD.
+ *
+ * For example,
+ *      double dot, norm1, norm2;
+ *      VectorKernels::cosineTerms(a, b, 200, &dot, &norm1, &norm2);
+ *      double cosine = dot / sqrt(norm1 * norm2);
+ */
+
+#ifndef VECTORKERNELS_H
+#define	VECTORKERNELS_H
+
+#include "StdIncludes.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LMW_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+namespace lmw {
+
+class VectorKernels {
+public:
+    /**
+     * Calculates the dot product and the squared L2 norms of a and b in a
+     * single pass over both vectors.
+     */
+    static void cosineTerms(const float* a, const float* b, const size_t n,
+            double* dot, double* normA, double* normB) {
+        static const CosineTermsFloat kernel = selectFloat();
+        kernel(a, b, n, dot, normA, normB);
+    }
+
+    static void cosineTerms(const double* a, const double* b, const size_t n,
+            double* dot, double* normA, double* normB) {
+        static const CosineTermsDouble kernel = selectDouble();
+        kernel(a, b, n, dot, normA, normB);
+    }
+
+    /**
+     * The dot product of a and b.
+     */
+    static double dot(const float* a, const float* b, const size_t n) {
+        static const DotFloat kernel = selectDotFloat();
+        return kernel(a, b, n);
+    }
+
+    static double dot(const double* a, const double* b, const size_t n) {
+        static const DotDouble kernel = selectDotDouble();
+        return kernel(a, b, n);
+    }
+
+    /**
+     * Calculates the dot product of x with count rows of a row-major matrix,
+     * out[i] = dot(x, rows + i * stride, n). This is matrix vector
+     * multiplication where each load of x is shared by several rows.
+     *
+     * rows must be aligned to ROW_ALIGNMENT bytes, stride must be a multiple
+     * of ROW_ALIGNMENT / sizeof(value), and the padding at the end of each
+     * row must be zero. KeyMatrix stores keys in this layout.
+     */
+    static void dotRows(const float* x, const float* rows, const size_t count,
+            const size_t n, const size_t stride, double* out) {
+        static const DotRowsFloat kernel = selectDotRowsFloat();
+        kernel(x, rows, count, n, stride, out);
+    }
+
+    static void dotRows(const double* x, const double* rows, const size_t count,
+            const size_t n, const size_t stride, double* out) {
+        for (size_t r = 0; r < count; r++) {
+            out[r] = dot(x, rows + r * stride, n);
+        }
+    }
+
+    /**
+     * Matrix multiplication of two row-major matrices in the dotRows()
+     * layout, out[i * outStride + j] = dot(a + i * aStride, b + j * bStride, n).
+     * Tiles of up to four rows of a by four rows of b are kept in registers,
+     * so each load is used several times.
+     */
+    static void dotRowsBlock(const float* a, const size_t aCount,
+            const size_t aStride, const float* b, const size_t bCount,
+            const size_t bStride, const size_t n, double* out,
+            const size_t outStride) {
+        static const DotRowsBlockFloat kernel = selectDotRowsBlockFloat();
+        kernel(a, aCount, aStride, b, bCount, bStride, n, out, outStride);
+    }
+
+    static void dotRowsBlock(const double* a, const size_t aCount,
+            const size_t aStride, const double* b, const size_t bCount,
+            const size_t bStride, const size_t n, double* out,
+            const size_t outStride) {
+        for (size_t i = 0; i < aCount; i++) {
+            dotRows(a + i * aStride, b, bCount, n, bStride, out + i * outStride);
+        }
+    }
+
+    /**
+     * The integer dot products of x with count rows of 8 bit values,
+     * out[i] = dot(x, rows + i * stride, n). Values must be in [-127, 127].
+     *
+     * rows has the dotRows() layout with stride a multiple of ROW_ALIGNMENT
+     * bytes, and x must also be zero padded to stride values. Int8KeyMatrix
+     * stores keys in this layout.
+     */
+    static void dotRowsInt8(const int8_t* x, const int8_t* rows,
+            const size_t count, const size_t n, const size_t stride,
+            int32_t* out) {
+        static const DotRowsInt8 kernel = selectDotRowsInt8();
+        kernel(x, rows, count, n, stride, out);
+    }
+
+    /**
+     * Adds bit i of blocks to counts[i] for the 64 * n bits of n blocks, bit
+     * i being bit i % 64 of blocks[i / 64] as in SVector<bool>. Counts wrap
+     * around at 65536, so callers must move them into wider counters before
+     * that, see BitCounter.
+     */
+    static void addBits(const uint64_t* blocks, const size_t n,
+            uint16_t* counts) {
+        static const AddBits kernel = selectAddBits();
+        kernel(blocks, n, counts);
+    }
+
+    static const size_t ROW_ALIGNMENT = 64;
+
+    /**
+     * The name of the instruction set used by the kernels.
+     */
+    static const char* instructionSet() {
+#ifdef LMW_X86_KERNELS
+        if (hasAVX512()) return "AVX-512";
+        if (hasAVX2()) return "AVX2";
+#endif
+        return "scalar";
+    }
+
+    template <typename T>
+    static void cosineTermsScalar(const T* a, const T* b, const size_t n,
+            double* dot, double* normA, double* normB) {
+        double sum = 0, sumA = 0, sumB = 0;
+        for (size_t i = 0; i < n; i++) {
+            sum += double(a[i]) * b[i];
+            sumA += double(a[i]) * a[i];
+            sumB += double(b[i]) * b[i];
+        }
+        *dot = sum;
+        *normA = sumA;
+        *normB = sumB;
+    }
+
+    template <typename T>
+    static double dotScalar(const T* a, const T* b, const size_t n) {
+        double sum = 0;
+        for (size_t i = 0; i < n; i++) {
+            sum += double(a[i]) * b[i];
+        }
+        return sum;
+    }
+
+    template <typename T>
+    static void dotRowsScalar(const T* x, const T* rows, const size_t count,
+            const size_t n, const size_t stride, double* out) {
+        for (size_t r = 0; r < count; r++) {
+            out[r] = dotScalar(x, rows + r * stride, n);
+        }
+    }
+
+    template <typename T>
+    static void dotRowsBlockScalar(const T* a, const size_t aCount,
+            const size_t aStride, const T* b, const size_t bCount,
+            const size_t bStride, const size_t n, double* out,
+            const size_t outStride) {
+        for (size_t i = 0; i < aCount; i++) {
+            dotRowsScalar(a + i * aStride, b, bCount, n, bStride, out + i * outStride);
+        }
+    }
+
+    static void dotRowsInt8Scalar(const int8_t* x, const int8_t* rows,
+            const size_t count, const size_t n, const size_t stride,
+            int32_t* out) {
+        for (size_t r = 0; r < count; r++) {
+            const int8_t* row = rows + r * stride;
+            int32_t sum = 0;
+            for (size_t i = 0; i < n; i++) {
+                sum += int32_t(x[i]) * row[i];
+            }
+            out[r] = sum;
+        }
+    }
+
+    static void addBitsScalar(const uint64_t* blocks, const size_t n,
+            uint16_t* counts) {
+        for (size_t b = 0; b < n; b++, counts += 64) {
+            const uint64_t bits = blocks[b];
+            for (size_t i = 0; i < 64; i++) {
+                counts[i] += (bits >> i) & 1;
+            }
+        }
+    }
+
+private:
+    typedef void (*AddBits)(const uint64_t*, size_t, uint16_t*);
+    typedef void (*DotRowsInt8)(const int8_t*, const int8_t*, size_t, size_t,
+            size_t, int32_t*);
+    typedef void (*DotRowsBlockFloat)(const float*, size_t, size_t,
+            const float*, size_t, size_t, size_t, double*, size_t);
+    typedef void (*DotRowsFloat)(const float*, const float*, size_t, size_t,
+            size_t, double*);
+    typedef double (*DotFloat)(const float*, const float*, size_t);
+    typedef double (*DotDouble)(const double*, const double*, size_t);
+    typedef void (*CosineTermsFloat)(const float*, const float*, size_t,
+            double*, double*, double*);
+    typedef void (*CosineTermsDouble)(const double*, const double*, size_t,
+            double*, double*, double*);
+
+#ifdef LMW_X86_KERNELS
+    static bool hasAVX2() {
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    }
+
+    static bool hasAVX512() {
+        return __builtin_cpu_supports("avx512f");
+    }
+
+    static bool hasAVX512BW() {
+        return __builtin_cpu_supports("avx512f")
+                && __builtin_cpu_supports("avx512bw");
+    }
+
+    static bool hasAVX512VNNI() {
+        return __builtin_cpu_supports("avx512bw")
+                && __builtin_cpu_supports("avx512vnni");
+    }
+
+    // maddubs multiplies unsigned by signed bytes, so |x| is multiplied by
+    // the row with the sign of x. Pairs of products are at most
+    // 2 * 127 * 127, so the 16 bit sums do not saturate. The padding of x
+    // and the rows is zero, so the loop runs to a multiple of 32 and needs
+    // no tail. Four rows share each load of x.
+    __attribute__((target("avx2")))
+    static __m256i dotInt8AVX2(__m256i absX, __m256i vx, const int8_t* row,
+            __m256i sum) {
+        const __m256i ones = _mm256_set1_epi16(1);
+        __m256i vr = _mm256_load_si256((const __m256i*) row);
+        __m256i pairs = _mm256_maddubs_epi16(absX, _mm256_sign_epi8(vr, vx));
+        return _mm256_add_epi32(sum, _mm256_madd_epi16(pairs, ones));
+    }
+
+    __attribute__((target("avx2")))
+    static int32_t horizontalSum(__m256i v) {
+        __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(v),
+                _mm256_extracti128_si256(v, 1));
+        sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+        sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+        return _mm_cvtsi128_si32(sum);
+    }
+
+    // The sums of 4 rows are reduced together, the horizontal adds of the
+    // last step serve all 4.
+    __attribute__((target("avx2")))
+    static __m128i halves(__m256i v) {
+        return _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    }
+
+    __attribute__((target("avx2")))
+    static void storeSums(__m128i a, __m128i b, __m128i c, __m128i d,
+            int32_t* out) {
+        __m128i sums = _mm_hadd_epi32(_mm_hadd_epi32(a, b), _mm_hadd_epi32(c, d));
+        _mm_storeu_si128((__m128i*) out, sums);
+    }
+
+    __attribute__((target("avx2")))
+    static void dotRowsInt8AVX2(const int8_t* x, const int8_t* rows,
+            const size_t count, const size_t n, const size_t stride,
+            int32_t* out) {
+        size_t r = 0;
+        for (; r + 4 <= count; r += 4) {
+            const int8_t* row = rows + r * stride;
+            __m256i sum0 = _mm256_setzero_si256(), sum1 = sum0, sum2 = sum0,
+                    sum3 = sum0;
+            for (size_t i = 0; i < n; i += 32) {
+                __m256i vx = _mm256_loadu_si256((const __m256i*) (x + i));
+                __m256i absX = _mm256_abs_epi8(vx);
+                sum0 = dotInt8AVX2(absX, vx, row + i, sum0);
+                sum1 = dotInt8AVX2(absX, vx, row + stride + i, sum1);
+                sum2 = dotInt8AVX2(absX, vx, row + 2 * stride + i, sum2);
+                sum3 = dotInt8AVX2(absX, vx, row + 3 * stride + i, sum3);
+            }
+            storeSums(halves(sum0), halves(sum1), halves(sum2), halves(sum3),
+                    out + r);
+        }
+        for (; r < count; r++) {
+            const int8_t* row = rows + r * stride;
+            __m256i sum = _mm256_setzero_si256();
+            for (size_t i = 0; i < n; i += 32) {
+                __m256i vx = _mm256_loadu_si256((const __m256i*) (x + i));
+                sum = dotInt8AVX2(_mm256_abs_epi8(vx), vx, row + i, sum);
+            }
+            out[r] = horizontalSum(sum);
+        }
+    }
+
+    // vpdpbusd adds four products of unsigned by signed bytes into each 32
+    // bit lane without saturating. AVX-512 has no sign instruction, so the
+    // row is negated where x is negative with a mask.
+    __attribute__((target("avx512f,avx512bw,avx512vnni")))
+    static __m512i dotInt8VNNI(__m512i absX, __mmask64 negative,
+            const int8_t* row, __m512i sum) {
+        __m512i vr = _mm512_load_si512(row);
+        __m512i signedRow = _mm512_mask_sub_epi8(vr, negative,
+                _mm512_setzero_si512(), vr);
+        return _mm512_dpbusd_epi32(sum, absX, signedRow);
+    }
+
+    __attribute__((target("avx512f,avx512bw,avx512vnni")))
+    static __m128i quarters(__m512i v) {
+        __m256i half = _mm256_add_epi32(_mm512_castsi512_si256(v),
+                _mm512_extracti64x4_epi64(v, 1));
+        return _mm_add_epi32(_mm256_castsi256_si128(half),
+                _mm256_extracti128_si256(half, 1));
+    }
+
+    __attribute__((target("avx512f,avx512bw,avx512vnni")))
+    static void dotRowsInt8VNNI(const int8_t* x, const int8_t* rows,
+            const size_t count, const size_t n, const size_t stride,
+            int32_t* out) {
+        size_t r = 0;
+        for (; r + 4 <= count; r += 4) {
+            const int8_t* row = rows + r * stride;
+            __m512i sum0 = _mm512_setzero_si512(), sum1 = sum0, sum2 = sum0,
+                    sum3 = sum0;
+            for (size_t i = 0; i < n; i += 64) {
+                __m512i vx = _mm512_loadu_si512(x + i);
+                __m512i absX = _mm512_abs_epi8(vx);
+                __mmask64 negative = _mm512_movepi8_mask(vx);
+                sum0 = dotInt8VNNI(absX, negative, row + i, sum0);
+                sum1 = dotInt8VNNI(absX, negative, row + stride + i, sum1);
+                sum2 = dotInt8VNNI(absX, negative, row + 2 * stride + i, sum2);
+                sum3 = dotInt8VNNI(absX, negative, row + 3 * stride + i, sum3);
+            }
+            storeSums(quarters(sum0), quarters(sum1), quarters(sum2),
+                    quarters(sum3), out + r);
+        }
+        for (; r < count; r++) {
+            const int8_t* row = rows + r * stride;
+            __m512i sum = _mm512_setzero_si512();
+            for (size_t i = 0; i < n; i += 64) {
+                __m512i vx = _mm512_loadu_si512(x + i);
+                sum = dotInt8VNNI(_mm512_abs_epi8(vx), _mm512_movepi8_mask(vx),
+                        row + i, sum);
+            }
+            out[r] = _mm512_reduce_add_epi32(sum);
+        }
+    }
+
+    __attribute__((target("avx2,fma")))
+    static double horizontalSum(__m256 v) {
+        __m128 sum = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+        sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+        sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+        return _mm_cvtss_f32(sum);
+    }
+
+    __attribute__((target("avx2,fma")))
+    static double horizontalSum(__m256d v) {
+        __m128d sum = _mm_add_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1));
+        sum = _mm_add_sd(sum, _mm_unpackhi_pd(sum, sum));
+        return _mm_cvtsd_f64(sum);
+    }
+
+    __attribute__((target("avx2,fma")))
+    static void cosineTermsAVX2(const float* a, const float* b, const size_t n,
+            double* dot, double* normA, double* normB) {
+        __m256 sum = _mm256_setzero_ps();
+        __m256 sumA = _mm256_setzero_ps();
+        __m256 sumB = _mm256_setzero_ps();
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            __m256 va = _mm256_loadu_ps(a + i);
+            __m256 vb = _mm256_loadu_ps(b + i);
+            sum = _mm256_fmadd_ps(va, vb, sum);
+            sumA = _mm256_fmadd_ps(va, va, sumA);
+            sumB = _mm256_fmadd_ps(vb, vb, sumB);
+        }
+        double tail, tailA, tailB;
+        cosineTermsScalar(a + i, b + i, n - i, &tail, &tailA, &tailB);
+        *dot = horizontalSum(sum) + tail;
+        *normA = horizontalSum(sumA) + tailA;
+        *normB = horizontalSum(sumB) + tailB;
+    }
+
+    __attribute__((target("avx2,fma")))
+    static void cosineTermsAVX2(const double* a, const double* b, const size_t n,
+            double* dot, double* normA, double* normB) {
+        __m256d sum = _mm256_setzero_pd();
+        __m256d sumA = _mm256_setzero_pd();
+        __m256d sumB = _mm256_setzero_pd();
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4) {
+            __m256d va = _mm256_loadu_pd(a + i);
+            __m256d vb = _mm256_loadu_pd(b + i);
+            sum = _mm256_fmadd_pd(va, vb, sum);
+            sumA = _mm256_fmadd_pd(va, va, sumA);
+            sumB = _mm256_fmadd_pd(vb, vb, sumB);
+        }
+        double tail, tailA, tailB;
+        cosineTermsScalar(a + i, b + i, n - i, &tail, &tailA, &tailB);
+        *dot = horizontalSum(sum) + tail;
+        *normA = horizontalSum(sumA) + tailA;
+        *normB = horizontalSum(sumB) + tailB;
+    }
+
+    __attribute__((target("avx2,fma")))
+    static double dotAVX2(const float* a, const float* b, const size_t n) {
+        __m256 sum = _mm256_setzero_ps();
+        __m256 sum2 = _mm256_setzero_ps();
+        size_t i = 0;
+        for (; i + 16 <= n; i += 16) {
+            sum = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), sum);
+            sum2 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), sum2);
+        }
+        for (; i + 8 <= n; i += 8) {
+            sum = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), sum);
+        }
+        return horizontalSum(_mm256_add_ps(sum, sum2)) + dotScalar(a + i, b + i, n - i);
+    }
+
+    __attribute__((target("avx2,fma")))
+    static double dotAVX2(const double* a, const double* b, const size_t n) {
+        __m256d sum = _mm256_setzero_pd();
+        __m256d sum2 = _mm256_setzero_pd();
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            sum = _mm256_fmadd_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i), sum);
+            sum2 = _mm256_fmadd_pd(_mm256_loadu_pd(a + i + 4), _mm256_loadu_pd(b + i + 4), sum2);
+        }
+        for (; i + 4 <= n; i += 4) {
+            sum = _mm256_fmadd_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i), sum);
+        }
+        return horizontalSum(_mm256_add_pd(sum, sum2)) + dotScalar(a + i, b + i, n - i);
+    }
+
+    __attribute__((target("avx512f")))
+    static double dotAVX512(const float* a, const float* b, const size_t n) {
+        __m512 sum = _mm512_setzero_ps();
+        __m512 sum2 = _mm512_setzero_ps();
+        size_t i = 0;
+        for (; i + 32 <= n; i += 32) {
+            sum = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), sum);
+            sum2 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16), sum2);
+        }
+        for (; i + 16 <= n; i += 16) {
+            sum = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), sum);
+        }
+        if (i < n) {
+            __mmask16 mask = (__mmask16) ((1u << (n - i)) - 1);
+            sum = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, a + i),
+                    _mm512_maskz_loadu_ps(mask, b + i), sum);
+        }
+        return _mm512_reduce_add_ps(_mm512_add_ps(sum, sum2));
+    }
+
+    __attribute__((target("avx512f")))
+    static double dotAVX512(const double* a, const double* b, const size_t n) {
+        __m512d sum = _mm512_setzero_pd();
+        __m512d sum2 = _mm512_setzero_pd();
+        size_t i = 0;
+        for (; i + 16 <= n; i += 16) {
+            sum = _mm512_fmadd_pd(_mm512_loadu_pd(a + i), _mm512_loadu_pd(b + i), sum);
+            sum2 = _mm512_fmadd_pd(_mm512_loadu_pd(a + i + 8), _mm512_loadu_pd(b + i + 8), sum2);
+        }
+        for (; i + 8 <= n; i += 8) {
+            sum = _mm512_fmadd_pd(_mm512_loadu_pd(a + i), _mm512_loadu_pd(b + i), sum);
+        }
+        if (i < n) {
+            __mmask8 mask = (__mmask8) ((1u << (n - i)) - 1);
+            sum = _mm512_fmadd_pd(_mm512_maskz_loadu_pd(mask, a + i),
+                    _mm512_maskz_loadu_pd(mask, b + i), sum);
+        }
+        return _mm512_reduce_add_pd(_mm512_add_pd(sum, sum2));
+    }
+
+    // The remainder is handled with masked loads instead of a scalar loop.
+    __attribute__((target("avx512f")))
+    static void cosineTermsAVX512(const float* a, const float* b, const size_t n,
+            double* dot, double* normA, double* normB) {
+        __m512 sum = _mm512_setzero_ps();
+        __m512 sumA = _mm512_setzero_ps();
+        __m512 sumB = _mm512_setzero_ps();
+        size_t i = 0;
+        for (; i + 16 <= n; i += 16) {
+            __m512 va = _mm512_loadu_ps(a + i);
+            __m512 vb = _mm512_loadu_ps(b + i);
+            sum = _mm512_fmadd_ps(va, vb, sum);
+            sumA = _mm512_fmadd_ps(va, va, sumA);
+            sumB = _mm512_fmadd_ps(vb, vb, sumB);
+        }
+        if (i < n) {
+            __mmask16 mask = (__mmask16) ((1u << (n - i)) - 1);
+            __m512 va = _mm512_maskz_loadu_ps(mask, a + i);
+            __m512 vb = _mm512_maskz_loadu_ps(mask, b + i);
+            sum = _mm512_fmadd_ps(va, vb, sum);
+            sumA = _mm512_fmadd_ps(va, va, sumA);
+            sumB = _mm512_fmadd_ps(vb, vb, sumB);
+        }
+        *dot = _mm512_reduce_add_ps(sum);
+        *normA = _mm512_reduce_add_ps(sumA);
+        *normB = _mm512_reduce_add_ps(sumB);
+    }
+
+    __attribute__((target("avx512f")))
+    static void cosineTermsAVX512(const double* a, const double* b, const size_t n,
+            double* dot, double* normA, double* normB) {
+        __m512d sum = _mm512_setzero_pd();
+        __m512d sumA = _mm512_setzero_pd();
+        __m512d sumB = _mm512_setzero_pd();
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            __m512d va = _mm512_loadu_pd(a + i);
+            __m512d vb = _mm512_loadu_pd(b + i);
+            sum = _mm512_fmadd_pd(va, vb, sum);
+            sumA = _mm512_fmadd_pd(va, va, sumA);
+            sumB = _mm512_fmadd_pd(vb, vb, sumB);
+        }
+        if (i < n) {
+            __mmask8 mask = (__mmask8) ((1u << (n - i)) - 1);
+            __m512d va = _mm512_maskz_loadu_pd(mask, a + i);
+            __m512d vb = _mm512_maskz_loadu_pd(mask, b + i);
+            sum = _mm512_fmadd_pd(va, vb, sum);
+            sumA = _mm512_fmadd_pd(va, va, sumA);
+            sumB = _mm512_fmadd_pd(vb, vb, sumB);
+        }
+        *dot = _mm512_reduce_add_pd(sum);
+        *normA = _mm512_reduce_add_pd(sumA);
+        *normB = _mm512_reduce_add_pd(sumB);
+    }
+
+    // Four rows are multiplied at a time so that each load of x is used four
+    // times. The tail of x is masked, and the rows are zero padded.
+    __attribute__((target("avx2,fma")))
+    static void dotRowsAVX2(const float* x, const float* rows, const size_t count,
+            const size_t n, const size_t stride, double* out) {
+        const size_t full = n & ~size_t(7);
+        const __m256i tailMask = _mm256_cmpgt_epi32(_mm256_set1_epi32(int(n - full)),
+                _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+        size_t r = 0;
+        for (; r + 4 <= count; r += 4) {
+            const float* r0 = rows + r * stride;
+            const float* r1 = r0 + stride;
+            const float* r2 = r1 + stride;
+            const float* r3 = r2 + stride;
+            __m256 s0 = _mm256_setzero_ps();
+            __m256 s1 = _mm256_setzero_ps();
+            __m256 s2 = _mm256_setzero_ps();
+            __m256 s3 = _mm256_setzero_ps();
+            for (size_t i = 0; i < n; i += 8) {
+                __m256 vx = i < full ? _mm256_loadu_ps(x + i)
+                        : _mm256_maskload_ps(x + i, tailMask);
+                s0 = _mm256_fmadd_ps(vx, _mm256_load_ps(r0 + i), s0);
+                s1 = _mm256_fmadd_ps(vx, _mm256_load_ps(r1 + i), s1);
+                s2 = _mm256_fmadd_ps(vx, _mm256_load_ps(r2 + i), s2);
+                s3 = _mm256_fmadd_ps(vx, _mm256_load_ps(r3 + i), s3);
+            }
+            out[r] = horizontalSum(s0);
+            out[r + 1] = horizontalSum(s1);
+            out[r + 2] = horizontalSum(s2);
+            out[r + 3] = horizontalSum(s3);
+        }
+        for (; r < count; r++) {
+            const float* row = rows + r * stride;
+            __m256 sum = _mm256_setzero_ps();
+            for (size_t i = 0; i < n; i += 8) {
+                __m256 vx = i < full ? _mm256_loadu_ps(x + i)
+                        : _mm256_maskload_ps(x + i, tailMask);
+                sum = _mm256_fmadd_ps(vx, _mm256_load_ps(row + i), sum);
+            }
+            out[r] = horizontalSum(sum);
+        }
+    }
+
+    __attribute__((target("avx512f")))
+    static void dotRowsAVX512(const float* x, const float* rows, const size_t count,
+            const size_t n, const size_t stride, double* out) {
+        const size_t full = n & ~size_t(15);
+        const __mmask16 tailMask = (__mmask16) ((1u << (n - full)) - 1);
+        size_t r = 0;
+        for (; r + 4 <= count; r += 4) {
+            const float* r0 = rows + r * stride;
+            const float* r1 = r0 + stride;
+            const float* r2 = r1 + stride;
+            const float* r3 = r2 + stride;
+            __m512 s0 = _mm512_setzero_ps();
+            __m512 s1 = _mm512_setzero_ps();
+            __m512 s2 = _mm512_setzero_ps();
+            __m512 s3 = _mm512_setzero_ps();
+            for (size_t i = 0; i < n; i += 16) {
+                __m512 vx = i < full ? _mm512_loadu_ps(x + i)
+                        : _mm512_maskz_loadu_ps(tailMask, x + i);
+                s0 = _mm512_fmadd_ps(vx, _mm512_load_ps(r0 + i), s0);
+                s1 = _mm512_fmadd_ps(vx, _mm512_load_ps(r1 + i), s1);
+                s2 = _mm512_fmadd_ps(vx, _mm512_load_ps(r2 + i), s2);
+                s3 = _mm512_fmadd_ps(vx, _mm512_load_ps(r3 + i), s3);
+            }
+            out[r] = _mm512_reduce_add_ps(s0);
+            out[r + 1] = _mm512_reduce_add_ps(s1);
+            out[r + 2] = _mm512_reduce_add_ps(s2);
+            out[r + 3] = _mm512_reduce_add_ps(s3);
+        }
+        for (; r < count; r++) {
+            const float* row = rows + r * stride;
+            __m512 sum = _mm512_setzero_ps();
+            for (size_t i = 0; i < n; i += 16) {
+                __m512 vx = i < full ? _mm512_loadu_ps(x + i)
+                        : _mm512_maskz_loadu_ps(tailMask, x + i);
+                sum = _mm512_fmadd_ps(vx, _mm512_load_ps(row + i), sum);
+            }
+            out[r] = _mm512_reduce_add_ps(sum);
+        }
+    }
+
+    // A 4x4 tile of dot products. The padding of the rows is zero, so the
+    // loop runs to the padded length and needs no tail.
+    __attribute__((target("avx512f")))
+    static void dotRowsBlockAVX512(const float* a, const size_t aCount,
+            const size_t aStride, const float* b, const size_t bCount,
+            const size_t bStride, const size_t n, double* out,
+            const size_t outStride) {
+        const size_t padded = (n + 15) & ~size_t(15);
+        size_t i = 0;
+        for (; i + 4 <= aCount; i += 4) {
+            const float* a0 = a + i * aStride;
+            const float* a1 = a0 + aStride;
+            const float* a2 = a1 + aStride;
+            const float* a3 = a2 + aStride;
+            size_t j = 0;
+            for (; j + 4 <= bCount; j += 4) {
+                const float* b0 = b + j * bStride;
+                const float* b1 = b0 + bStride;
+                const float* b2 = b1 + bStride;
+                const float* b3 = b2 + bStride;
+                __m512 s[16];
+                for (int t = 0; t < 16; t++) {
+                    s[t] = _mm512_setzero_ps();
+                }
+                for (size_t d = 0; d < padded; d += 16) {
+                    __m512 vb0 = _mm512_load_ps(b0 + d);
+                    __m512 vb1 = _mm512_load_ps(b1 + d);
+                    __m512 vb2 = _mm512_load_ps(b2 + d);
+                    __m512 vb3 = _mm512_load_ps(b3 + d);
+                    __m512 va = _mm512_load_ps(a0 + d);
+                    s[0] = _mm512_fmadd_ps(va, vb0, s[0]);
+                    s[1] = _mm512_fmadd_ps(va, vb1, s[1]);
+                    s[2] = _mm512_fmadd_ps(va, vb2, s[2]);
+                    s[3] = _mm512_fmadd_ps(va, vb3, s[3]);
+                    va = _mm512_load_ps(a1 + d);
+                    s[4] = _mm512_fmadd_ps(va, vb0, s[4]);
+                    s[5] = _mm512_fmadd_ps(va, vb1, s[5]);
+                    s[6] = _mm512_fmadd_ps(va, vb2, s[6]);
+                    s[7] = _mm512_fmadd_ps(va, vb3, s[7]);
+                    va = _mm512_load_ps(a2 + d);
+                    s[8] = _mm512_fmadd_ps(va, vb0, s[8]);
+                    s[9] = _mm512_fmadd_ps(va, vb1, s[9]);
+                    s[10] = _mm512_fmadd_ps(va, vb2, s[10]);
+                    s[11] = _mm512_fmadd_ps(va, vb3, s[11]);
+                    va = _mm512_load_ps(a3 + d);
+                    s[12] = _mm512_fmadd_ps(va, vb0, s[12]);
+                    s[13] = _mm512_fmadd_ps(va, vb1, s[13]);
+                    s[14] = _mm512_fmadd_ps(va, vb2, s[14]);
+                    s[15] = _mm512_fmadd_ps(va, vb3, s[15]);
+                }
+                for (int t = 0; t < 16; t++) {
+                    out[(i + t / 4) * outStride + j + t % 4] = _mm512_reduce_add_ps(s[t]);
+                }
+            }
+            if (j < bCount) {
+                for (size_t r = i; r < i + 4; r++) {
+                    dotRowsAVX512(a + r * aStride, b + j * bStride, bCount - j, n,
+                            bStride, out + r * outStride + j);
+                }
+            }
+        }
+        for (; i < aCount; i++) {
+            dotRowsAVX512(a + i * aStride, b, bCount, n, bStride, out + i * outStride);
+        }
+    }
+
+    // AVX2 has 16 registers, so the tiles are two rows of a by four rows of b.
+    __attribute__((target("avx2,fma")))
+    static void dotRowsBlockAVX2(const float* a, const size_t aCount,
+            const size_t aStride, const float* b, const size_t bCount,
+            const size_t bStride, const size_t n, double* out,
+            const size_t outStride) {
+        const size_t padded = (n + 7) & ~size_t(7);
+        size_t i = 0;
+        for (; i + 2 <= aCount; i += 2) {
+            const float* a0 = a + i * aStride;
+            const float* a1 = a0 + aStride;
+            size_t j = 0;
+            for (; j + 4 <= bCount; j += 4) {
+                const float* b0 = b + j * bStride;
+                const float* b1 = b0 + bStride;
+                const float* b2 = b1 + bStride;
+                const float* b3 = b2 + bStride;
+                __m256 s[8];
+                for (int t = 0; t < 8; t++) {
+                    s[t] = _mm256_setzero_ps();
+                }
+                for (size_t d = 0; d < padded; d += 8) {
+                    __m256 vb0 = _mm256_load_ps(b0 + d);
+                    __m256 vb1 = _mm256_load_ps(b1 + d);
+                    __m256 vb2 = _mm256_load_ps(b2 + d);
+                    __m256 vb3 = _mm256_load_ps(b3 + d);
+                    __m256 va = _mm256_load_ps(a0 + d);
+                    s[0] = _mm256_fmadd_ps(va, vb0, s[0]);
+                    s[1] = _mm256_fmadd_ps(va, vb1, s[1]);
+                    s[2] = _mm256_fmadd_ps(va, vb2, s[2]);
+                    s[3] = _mm256_fmadd_ps(va, vb3, s[3]);
+                    va = _mm256_load_ps(a1 + d);
+                    s[4] = _mm256_fmadd_ps(va, vb0, s[4]);
+                    s[5] = _mm256_fmadd_ps(va, vb1, s[5]);
+                    s[6] = _mm256_fmadd_ps(va, vb2, s[6]);
+                    s[7] = _mm256_fmadd_ps(va, vb3, s[7]);
+                }
+                for (int t = 0; t < 8; t++) {
+                    out[(i + t / 4) * outStride + j + t % 4] = horizontalSum(s[t]);
+                }
+            }
+            if (j < bCount) {
+                for (size_t r = i; r < i + 2; r++) {
+                    dotRowsAVX2(a + r * aStride, b + j * bStride, bCount - j, n,
+                            bStride, out + r * outStride + j);
+                }
+            }
+        }
+        for (; i < aCount; i++) {
+            dotRowsAVX2(a + i * aStride, b, bCount, n, bStride, out + i * outStride);
+        }
+    }
+
+    // 16 bits are broadcast to the 16 lanes, lane i keeps bit i, and the
+    // lanes equal to their bit are all ones, which is -1.
+    __attribute__((target("avx2")))
+    static void addBitsAVX2(const uint64_t* blocks, const size_t n,
+            uint16_t* counts) {
+        const __m256i lanes = _mm256_setr_epi16(1 << 0, 1 << 1, 1 << 2, 1 << 3,
+                1 << 4, 1 << 5, 1 << 6, 1 << 7, 1 << 8, 1 << 9, 1 << 10, 1 << 11,
+                1 << 12, 1 << 13, 1 << 14, int16_t(1 << 15));
+        for (size_t b = 0; b < n; b++) {
+            const uint64_t bits = blocks[b];
+            for (size_t i = 0; i < 64; i += 16, counts += 16) {
+                __m256i v = _mm256_set1_epi16(int16_t(bits >> i));
+                __m256i set = _mm256_cmpeq_epi16(_mm256_and_si256(v, lanes), lanes);
+                __m256i c = _mm256_loadu_si256((const __m256i*) counts);
+                _mm256_storeu_si256((__m256i*) counts, _mm256_sub_epi16(c, set));
+            }
+        }
+    }
+
+    // The bits are the write mask of the add.
+    __attribute__((target("avx512f,avx512bw")))
+    static void addBitsAVX512(const uint64_t* blocks, const size_t n,
+            uint16_t* counts) {
+        const __m512i ones = _mm512_set1_epi16(1);
+        for (size_t b = 0; b < n; b++, counts += 64) {
+            const uint64_t bits = blocks[b];
+            __m512i lo = _mm512_loadu_si512(counts);
+            __m512i hi = _mm512_loadu_si512(counts + 32);
+            lo = _mm512_mask_add_epi16(lo, __mmask32(bits), lo, ones);
+            hi = _mm512_mask_add_epi16(hi, __mmask32(bits >> 32), hi, ones);
+            _mm512_storeu_si512(counts, lo);
+            _mm512_storeu_si512(counts + 32, hi);
+        }
+    }
+#endif
+
+    static AddBits selectAddBits() {
+#ifdef LMW_X86_KERNELS
+        if (hasAVX512BW()) return &addBitsAVX512;
+        if (hasAVX2()) return &addBitsAVX2;
+#endif
+        return &addBitsScalar;
+    }
+
+    static DotRowsInt8 selectDotRowsInt8() {
+#ifdef LMW_X86_KERNELS
+        if (hasAVX512VNNI()) return &dotRowsInt8VNNI;
+        if (hasAVX2()) return &dotRowsInt8AVX2;
+#endif
+        return &dotRowsInt8Scalar;
+    }
+
+    static DotRowsBlockFloat selectDotRowsBlockFloat() {
+#ifdef LMW_X86_KERNELS
+        if (hasAVX512()) return &dotRowsBlockAVX512;
+        if (hasAVX2()) return &dotRowsBlockAVX2;
+#endif
+        return &dotRowsBlockScalar<float>;
+    }
+
+    static DotRowsFloat selectDotRowsFloat() {
+#ifdef LMW_X86_KERNELS
+        if (hasAVX512()) return &dotRowsAVX512;
+        if (hasAVX2()) return &dotRowsAVX2;
+#endif
+        return &dotRowsScalar<float>;
+    }
+
+    static DotFloat selectDotFloat() {
+#ifdef LMW_X86_KERNELS
+        if (hasAVX512()) return &dotAVX512;
+        if (hasAVX2()) return &dotAVX2;
+#endif
+        return &dotScalar<float>;
+    }
+
+    static DotDouble selectDotDouble() {
+#ifdef LMW_X86_KERNELS
+        if (hasAVX512()) return &dotAVX512;
+        if (hasAVX2()) return &dotAVX2;
+#endif
+        return &dotScalar<double>;
+    }
+
+    static CosineTermsFloat selectFloat() {
+#ifdef LMW_X86_KERNELS
+        if (hasAVX512()) return &cosineTermsAVX512;
+        if (hasAVX2()) return &cosineTermsAVX2;
+#endif
+        return &cosineTermsScalar<float>;
+    }
+
+    static CosineTermsDouble selectDouble() {
+#ifdef LMW_X86_KERNELS
+        if (hasAVX512()) return &cosineTermsAVX512;
+        if (hasAVX2()) return &cosineTermsAVX2;
+#endif
+        return &cosineTermsScalar<double>;
+    }
+};
+
+} // namespace lmw
+
+#endif	/* VECTORKERNELS_H */